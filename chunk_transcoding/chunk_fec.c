@@ -0,0 +1,227 @@
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include "chunk_fec.h"
+
+static void fecHeaderPush(uint8_t *p, uint32_t group, int index, int n, uint32_t length)
+{
+	uint32_t tmp;
+
+	tmp = htonl(group);
+	memcpy(p, &tmp, 4);
+	p[4] = index;
+	p[5] = n;
+	p[6] = 0;
+	p[7] = 0;
+	tmp = htonl(length);
+	memcpy(p + 8, &tmp, 4);
+}
+
+//dst ^= src over len bytes, dst zero padded from *dst_len up to len first
+static int fecFold(uint8_t **dst, size_t *dst_capacity, size_t *dst_len, size_t headroom, const uint8_t *src, size_t len)
+{
+	uint8_t *d;
+	size_t i;
+
+	if(len > *dst_len) {
+		if(len > *dst_capacity) {
+			uint8_t *tmp = realloc(*dst, headroom + len);
+			if(!tmp)
+				return -1;
+			*dst = tmp;
+			*dst_capacity = len;
+		}
+		memset(*dst + headroom + *dst_len, 0, len - *dst_len);
+		*dst_len = len;
+	}
+	d = *dst + headroom;
+	for(i = 0; i < len; i++)
+		d[i] ^= src[i];
+	return 0;
+}
+
+int fecEncoderInit(FecEncoder *e, int n, uint32_t first_group)
+{
+	memset(e, 0, sizeof(FecEncoder));
+	if(n < FEC_WINDOW_MIN || n > FEC_WINDOW_MAX)
+		return -1;
+	e->n = n;
+	e->group = first_group;
+	//room for the header even if every chunk of a group is empty
+	e->parity = malloc(FEC_HEADER_SIZE);
+	return e->parity ? 0 : -1;
+}
+
+void fecEncoderFree(FecEncoder *e)
+{
+	free(e->parity);
+	e->parity = NULL;
+	e->parity_capacity = 0;
+}
+
+int fecEncodeData(FecEncoder *e, const uint8_t *block, int len, uint8_t *hdr)
+{
+	//the parity of the previous group has been sent, start the next one
+	if(e->index == e->n) {
+		e->group++;
+		e->index = 0;
+		e->parity_len = 0;
+		e->length_xor = 0;
+	}
+	fecHeaderPush(hdr, e->group, e->index, e->n, len);
+	if(fecFold(&e->parity, &e->parity_capacity, &e->parity_len, FEC_HEADER_SIZE, block, len) < 0)
+		return -1;
+	e->length_xor ^= len;
+	e->data_bytes += FEC_HEADER_SIZE + len;
+	if(++e->index < e->n)
+		return 0;
+	fecHeaderPush(e->parity, e->group, e->n, e->n, e->length_xor);
+	e->parity_bytes += FEC_HEADER_SIZE + e->parity_len;
+	return FEC_HEADER_SIZE + e->parity_len;
+}
+
+uint8_t *fecEncoderParity(FecEncoder *e)
+{
+	return e->parity;
+}
+
+void fecDecoderInit(FecDecoder *d)
+{
+	memset(d, 0, sizeof(FecDecoder));
+}
+
+static void fecGroupClose(FecDecoder *d, FecGroup *g)
+{
+	if(!g->done)
+		d->lost += g->n - g->data_received;
+	g->in_use = 0;
+}
+
+void fecDecoderReset(FecDecoder *d)
+{
+	int i;
+
+	for(i = 0; i < FEC_DECODER_GROUPS; i++)
+		if(d->groups[i].in_use)
+			fecGroupClose(d, &d->groups[i]);
+}
+
+void fecDecoderFree(FecDecoder *d)
+{
+	int i;
+
+	fecDecoderReset(d);
+	for(i = 0; i < FEC_DECODER_GROUPS; i++) {
+		free(d->groups[i].acc);
+		d->groups[i].acc = NULL;
+		d->groups[i].acc_capacity = 0;
+	}
+}
+
+//the slot of group, a new one if needed: the oldest group is closed to make room
+static FecGroup *fecGroupGet(FecDecoder *d, uint32_t group, int n)
+{
+	FecGroup *g, *free_slot = NULL, *oldest = NULL;
+	int i;
+
+	for(i = 0; i < FEC_DECODER_GROUPS; i++) {
+		g = &d->groups[i];
+		if(!g->in_use) {
+			if(!free_slot)
+				free_slot = g;
+			continue;
+		}
+		if(g->group == group)
+			return g->n == n ? g : NULL;
+		if(!oldest || (int32_t)(g->group - oldest->group) < 0)
+			oldest = g;
+	}
+	if(!free_slot) {
+		//a straggler of a group already closed, anything further back is a restarted stream
+		if((int32_t)(group - oldest->group) < 0 && (int32_t)(group - oldest->group) > -FEC_STRAGGLER_GROUPS)
+			return NULL;
+		fecGroupClose(d, oldest);
+		free_slot = oldest;
+	}
+	g = free_slot;
+	g->in_use = 1;
+	g->group = group;
+	g->n = n;
+	g->have = 0;
+	g->data_received = 0;
+	g->done = 0;
+	g->acc_len = 0;
+	g->length_xor = 0;
+	return g;
+}
+
+int fecDecode(FecDecoder *d, const uint8_t *block, int len, FecDeliver deliver, void *arg)
+{
+	uint32_t group, length;
+	int index, n, i;
+	const uint8_t *payload = block + FEC_HEADER_SIZE;
+	int payload_len = len - FEC_HEADER_SIZE;
+	FecGroup *g;
+
+	if(len < FEC_HEADER_SIZE) {
+		d->invalid++;
+		return -1;
+	}
+	memcpy(&group, block, 4);
+	group = ntohl(group);
+	index = block[4];
+	n = block[5];
+	memcpy(&length, block + 8, 4);
+	length = ntohl(length);
+	if(n < FEC_WINDOW_MIN || n > FEC_WINDOW_MAX || index > n) {
+		d->invalid++;
+		return -1;
+	}
+
+	g = fecGroupGet(d, group, n);
+	//received twice, or already rebuilt
+	if(g && (g->have & (1ULL << index)))
+		return 0;
+	if(index < n) {
+		d->data++;
+		d->data_bytes += len;
+		deliver(payload, payload_len, arg);
+	} else {
+		d->parity++;
+		d->parity_bytes += len;
+	}
+	if(!g)
+		return 0;
+	g->have |= 1ULL << index;
+	if(g->done)
+		return 0;
+	if(index < n) {
+		g->data_received++;
+		g->length_xor ^= payload_len;
+		g->done = (g->data_received == n);
+	} else
+		g->length_xor ^= length;
+	if(g->done)
+		return 0;
+	if(fecFold(&g->acc, &g->acc_capacity, &g->acc_len, 0, payload, payload_len) < 0)
+		return 0;
+
+	//parity and all the data chunks but one: what is left in the XOR is the missing one
+	if(g->data_received == n - 1 && (g->have & (1ULL << n))) {
+		for(i = 0; i < n && (g->have & (1ULL << i)); i++)
+			;
+		if(g->length_xor <= g->acc_len) {
+			deliver(g->acc, g->length_xor, arg);
+			d->recovered++;
+			g->have |= 1ULL << i;
+			g->done = 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef _CHUNK_FEC_H
+#define _CHUNK_FEC_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/**
+ * XOR forward error correction across chunks.
+ * every group of n data chunks is followed by a parity chunk, the XOR of
+ * the n of them zero padded to the longest: any single chunk lost in a
+ * group is rebuilt from the others and the parity.
+ * each block, data or parity, is prefixed by a header: group (32 bits),
+ * index in the group (8, n for the parity), n (8), two reserved bytes and
+ * the block length (32), for the parity the XOR of the lengths of the group
+ */
+#define FEC_HEADER_SIZE 12
+//data chunks per group
+#define FEC_WINDOW_MIN 2
+#define FEC_WINDOW_MAX 32
+//groups the decoder reassembles at the same time, chunks may arrive out of order
+#define FEC_DECODER_GROUPS 4
+//how far behind the open groups a block is still taken for a late one
+#define FEC_STRAGGLER_GROUPS 64
+
+typedef struct FecEncoder {
+	int n;
+	uint32_t group;
+	int index; //data chunks folded into the parity of the current group
+	uint8_t *parity; //header and payload of the parity chunk
+	size_t parity_capacity;
+	size_t parity_len; //payload bytes, the longest chunk of the group
+	uint32_t length_xor;
+	unsigned long long data_bytes;
+	unsigned long long parity_bytes;
+} FecEncoder;
+
+/**
+ * n data chunks per group, numbered from first_group on: pick it at random, so
+ * that the groups of a restarted sender are not taken for those of the old one.
+ * returns -1 if n is out of range
+ */
+int fecEncoderInit(FecEncoder *e, int n, uint32_t first_group);
+void fecEncoderFree(FecEncoder *e);
+/**
+ * write the header of the next data chunk, len bytes at block, into hdr and
+ * fold the chunk into the parity of its group.
+ * returns the size of the parity block to send next when this chunk completes
+ * the group, 0 otherwise, -1 on allocation failure
+ */
+int fecEncodeData(FecEncoder *e, const uint8_t *block, int len, uint8_t *hdr);
+/** the parity block of the group just completed, header included */
+uint8_t *fecEncoderParity(FecEncoder *e);
+
+typedef struct FecGroup {
+	int in_use;
+	uint32_t group;
+	int n;
+	uint64_t have; //one bit per block received, the parity is bit n
+	int data_received;
+	int done; //every data chunk delivered, received or rebuilt
+	uint8_t *acc; //XOR of the blocks received
+	size_t acc_capacity;
+	size_t acc_len;
+	uint32_t length_xor;
+} FecGroup;
+
+typedef struct FecDecoder {
+	FecGroup groups[FEC_DECODER_GROUPS];
+	unsigned long long data;
+	unsigned long long parity;
+	unsigned long long recovered;
+	unsigned long long lost; //data chunks missing from closed groups
+	unsigned long long data_bytes;
+	unsigned long long parity_bytes;
+	unsigned long long invalid; //blocks without a valid FEC header
+} FecDecoder;
+
+//called with every data chunk, received or rebuilt, without its header
+typedef void (*FecDeliver)(const uint8_t *block, int len, void *arg);
+
+void fecDecoderInit(FecDecoder *d);
+/** close the open groups, counting what they miss as lost, e.g. when the source changes. counters are kept */
+void fecDecoderReset(FecDecoder *d);
+/** reset and free the buffers */
+void fecDecoderFree(FecDecoder *d);
+/**
+ * take a block, data or parity, and deliver the data chunks it yields.
+ * returns -1 if block is not a valid FEC block
+ */
+int fecDecode(FecDecoder *d, const uint8_t *block, int len, FecDeliver deliver, void *arg);
+
+#endif
@@ -83,6 +83,18 @@ typedef struct {
 //        (giuseppe tropea)
         uint8_t *data;
 
+        /**
+         * Allocated size of data. The buffer is kept from one chunk to the
+         * next, this is local bookkeeping and is not sent on the wire.
+         */
+        int32_t data_capacity;
+
+        /**
+         * Running average of payload_len over the chunks built so far in
+         * this buffer, used to size the allocation for the next ones.
+         */
+        int32_t payload_len_avg;
+
         /** Internal reference counter */
         int _refcnt;
 } ExternalChunk;
@@ -1,6 +1,11 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
 
 #include "external_chunk_transcoding.h"
 
@@ -39,15 +44,10 @@ static inline uint32_t int_rcpy(const uint8_t *p)
   return tmp;
 }
 
-int encodeChunk(const struct chunk *c, uint8_t *buff, int buff_len)
+static inline void encodeChunkHeader(const struct chunk *c, uint8_t *buff)
 {
   uint32_t half_ts;
 
-  if (buff_len < 20 + c->size + c->attributes_size) {
-    /* Not enough space... */
-    return -1;
-  }
-
   int_cpy(buff, c->id);
   half_ts = c->timestamp >> 32;
   int_cpy(buff + 4, half_ts);
@@ -55,6 +55,16 @@ int encodeChunk(const struct chunk *c, uint8_t *buff, int buff_len)
   int_cpy(buff + 8, half_ts);
   int_cpy(buff + 12, c->size);
   int_cpy(buff + 16, c->attributes_size);
+}
+
+int encodeChunk(const struct chunk *c, uint8_t *buff, int buff_len)
+{
+  if (buff_len < 20 + c->size + c->attributes_size) {
+    /* Not enough space... */
+    return -1;
+  }
+
+  encodeChunkHeader(c, buff);
   memcpy(buff + 20, c->data, c->size);
   if (c->attributes_size) {
     memcpy(buff + 20 + c->size, c->attributes, c->attributes_size);
@@ -63,6 +73,29 @@ int encodeChunk(const struct chunk *c, uint8_t *buff, int buff_len)
   return 20 + c->size + c->attributes_size;
 }
 
+int encodeChunkIov(const struct chunk *c, uint8_t *hdr, struct iovec *iov, int iov_len)
+{
+  int n = 0;
+
+  if (iov_len < GRAPES_ENCODED_CHUNK_IOV_MAX) {
+    return -1;
+  }
+
+  encodeChunkHeader(c, hdr);
+  iov[n].iov_base = hdr;
+  iov[n++].iov_len = GRAPES_ENCODED_CHUNK_HEADER_SIZE;
+  if (c->size) {
+    iov[n].iov_base = c->data;
+    iov[n++].iov_len = c->size;
+  }
+  if (c->attributes_size) {
+    iov[n].iov_base = c->attributes;
+    iov[n++].iov_len = c->attributes_size;
+  }
+
+  return n;
+}
+
 int decodeChunk(struct chunk *c, const uint8_t *buff, int buff_len)
 {
   if (buff_len < 20) {
@@ -85,7 +118,7 @@ int decodeChunk(struct chunk *c, const uint8_t *buff, int buff_len)
   memcpy(c->data, buff + 20, c->size);
 
   if (c->attributes_size > 0) {
-    if (buff_len < c->size + c->attributes_size) {
+    if (buff_len < 20 + c->size + c->attributes_size) {
       return -4;
     }
     c->attributes = malloc(c->attributes_size);
@@ -98,6 +131,29 @@ int decodeChunk(struct chunk *c, const uint8_t *buff, int buff_len)
   return 20 + c->size + c->attributes_size;
 }
 
+int decodeChunkInPlace(struct chunk *c, const uint8_t *buff, int buff_len)
+{
+  if (buff_len < 20) {
+    return -1;
+  }
+  c->id = int_rcpy(buff);
+  c->timestamp = int_rcpy(buff + 4);
+  c->timestamp = c->timestamp << 32;
+  c->timestamp |= int_rcpy(buff + 8); 
+  c->size = int_rcpy(buff + 12);
+  c->attributes_size = int_rcpy(buff + 16);
+
+  /* sizes come from the wire: reject negative ones and check without overflowing */
+  if (c->size < 0 || c->attributes_size < 0 ||
+      c->size > buff_len - 20 || c->attributes_size > buff_len - 20 - c->size) {
+    return -2;
+  }
+  c->data = (uint8_t *)buff + 20;
+  c->attributes = c->attributes_size > 0 ? (uint8_t *)buff + 20 + c->size : NULL;
+
+  return 20 + c->size + c->attributes_size;
+}
+
 void print_block(const uint8_t *b, int size) {
 int i=0;
 fprintf(stderr,"BEGIN OF %d BYTES---\n", size);
@@ -113,16 +169,15 @@ void chunker_logger(const char *s) {
 }
 
 
-void *packExternalChunkToAttributes(ExternalChunk *echunk, size_t attr_size) {
-	void *attr_block = NULL;
+int packExternalChunkToAttributesBuffer(ExternalChunk *echunk, uint8_t *attr_block, size_t attr_size) {
 	int64_t half_prio;
 	int64_t prio = 0.0;
 	
-	if( (attr_block = malloc(attr_size)) == NULL ) {
-		chunker_logger("attrib block malloc failed!");
-		return NULL;
+	if(attr_size < EXTERNAL_CHUNK_ATTRIBUTES_SIZE) {
+		fprintf(stderr, "attributes block of %zu bytes is too small, %d needed\n", attr_size, EXTERNAL_CHUNK_ATTRIBUTES_SIZE);
+		return -1;
 	}
-	
+
 	/* copy the content of the external_chunk structure into a proper attributes block */
 	/* also network-encoding the 4bytes pieces */
 	bit32_encoded_push(echunk->seq, attr_block);
@@ -144,11 +199,112 @@ void *packExternalChunkToAttributes(ExternalChunk *echunk, size_t attr_size) {
 	half_prio = prio;
 	bit32_encoded_push(half_prio, attr_block + CHUNK_TRANSCODING_INT_SIZE*10);
 	/* ref count is not needed over the wire */
+	return 0;
+}
+
+
+void *packExternalChunkToAttributes(ExternalChunk *echunk, size_t attr_size) {
+	void *attr_block = NULL;
+	
+	if( (attr_block = malloc(attr_size)) == NULL ) {
+		chunker_logger("attrib block malloc failed!");
+		return NULL;
+	}
+	if(packExternalChunkToAttributesBuffer(echunk, attr_block, attr_size) < 0) {
+		free(attr_block);
+		return NULL;
+	}
 	
 	return attr_block;
 }
 
 
+int chunkFragmentCount(uint32_t size, int max_payload) {
+	return size ? (size + max_payload - 1) / max_payload : 1;
+}
+
+
+uint32_t chunkFragmentPayloadSize(uint32_t size, int count) {
+	/* spread evenly, both ends compute it from size and count */
+	return (size + count - 1) / count;
+}
+
+
+void chunkFragmentHeaderPush(uint8_t *p, uint32_t seq, uint16_t index, uint16_t count, uint32_t size) {
+	uint16_t tmp;
+
+	int_cpy(p, seq);
+	tmp = htons(index);
+	memcpy(p + 4, &tmp, 2);
+	tmp = htons(count);
+	memcpy(p + 6, &tmp, 2);
+	int_cpy(p + 8, size);
+}
+
+
+void chunkFragmentHeaderPull(const uint8_t *p, uint32_t *seq, uint16_t *index, uint16_t *count, uint32_t *size) {
+	uint16_t tmp;
+
+	*seq = int_rcpy(p);
+	memcpy(&tmp, p + 4, 2);
+	*index = ntohs(tmp);
+	memcpy(&tmp, p + 6, 2);
+	*count = ntohs(tmp);
+	*size = int_rcpy(p + 8);
+}
+
+
+void chunkArenaInit(ChunkArena *a) {
+	a->buf = NULL;
+	a->size = 0;
+	a->used = 0;
+	a->grow_count = 0;
+}
+
+
+int chunkArenaReset(ChunkArena *a, size_t len) {
+	a->used = 0;
+	if(len > a->size) {
+		/* grow geometrically so that a slowly increasing chunk size settles quickly */
+		size_t new_size = a->size ? a->size * 2 : 4096;
+		uint8_t *tmp;
+
+		while(new_size < len)
+			new_size *= 2;
+		/* content is dropped on reset anyway, no need to realloc */
+		if( (tmp = malloc(new_size)) == NULL ) {
+			chunker_logger("chunk arena grow failed!");
+			return -1;
+		}
+		free(a->buf);
+		a->buf = tmp;
+		a->size = new_size;
+		a->grow_count++;
+	}
+	return 0;
+}
+
+
+void *chunkArenaAlloc(ChunkArena *a, size_t len) {
+	void *p;
+
+	if(a->used + len > a->size)
+		return NULL;
+	p = a->buf + a->used;
+	/* keep 8 bytes alignment for whatever goes in next */
+	a->used += CHUNK_ARENA_ALIGN(len);
+	if(a->used > a->size)
+		a->used = a->size;
+	return p;
+}
+
+
+void chunkArenaFree(ChunkArena *a) {
+	free(a->buf);
+	chunkArenaInit(a);
+}
+
+
 ExternalChunk *grapesChunkToExternalChunk(Chunk *gchunk) {
 	uint64_t tmp_prio;
 	ExternalChunk *echunk = (ExternalChunk *)malloc(sizeof(ExternalChunk));
@@ -5,13 +5,58 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <chunk.h>
 
 #include "external_chunk.h"
 
 #define CHUNK_TRANSCODING_INT_SIZE 4
+//bytes written by packExternalChunkToAttributesBuffer
+#define EXTERNAL_CHUNK_ATTRIBUTES_SIZE (11*CHUNK_TRANSCODING_INT_SIZE)
 //this should be in chunk.h and used in som's chunk_encoding.c
 #define GRAPES_ENCODED_CHUNK_HEADER_SIZE 20
+//header, payload and attributes
+#define GRAPES_ENCODED_CHUNK_IOV_MAX 3
+
+/**
+ * growable scratch area owned by an output, reset for every chunk:
+ * once it has reached the steady state size no more heap allocations are done
+ */
+typedef struct ChunkArena {
+	uint8_t *buf;
+	size_t size;
+	size_t used;
+	unsigned int grow_count;
+} ChunkArena;
+
+/**
+ * datagram transports: an encoded chunk travels as count fragments of
+ * equal size (the last one possibly shorter), each one prefixed by
+ * chunk sequence (32 bits), fragment index (16), fragment count (16)
+ * and encoded chunk size (32), all in network order
+ */
+#define CHUNK_FRAGMENT_HEADER_SIZE 12
+//fragment payload that fits a 1500 bytes MTU with IP and UDP headers
+#define CHUNK_FRAGMENT_PAYLOAD_MAX 1400
+#define CHUNK_FRAGMENT_COUNT_MAX 0xFFFF
+
+//allocations are kept 8 bytes aligned, reserve accordingly
+#define CHUNK_ARENA_ALIGN(len) (((len) + 7) & ~((size_t)7))
+
+void chunkArenaInit(ChunkArena *a);
+/**
+ * start a new chunk: drop previous allocations and make sure at least
+ * len bytes are available, growing the arena if needed.
+ * returns 0 on success, -1 on allocation failure
+ */
+int chunkArenaReset(ChunkArena *a, size_t len);
+/**
+ * carve len bytes out of the reserved space, never grows the arena
+ * so pointers handed out since the last reset stay valid.
+ * returns NULL if the reservation was too small
+ */
+void *chunkArenaAlloc(ChunkArena *a, size_t len);
+void chunkArenaFree(ChunkArena *a);
 
 /**
  * commodity function to dump a block of bytes
@@ -30,11 +75,41 @@ ExternalChunk *grapesChunkToExternalChunk(Chunk *gchunk);
  */
 void *packExternalChunkToAttributes(ExternalChunk *echunk, size_t attr_size);
 
+/**
+ * same as above, but packs into a caller provided block of attr_size bytes
+ * returns -1 if the block is smaller than EXTERNAL_CHUNK_ATTRIBUTES_SIZE
+ */
+int packExternalChunkToAttributesBuffer(ExternalChunk *echunk, uint8_t *attr_block, size_t attr_size);
+
 /**
  * theese are copied from GRAPES
  */
 int encodeChunk(const struct chunk *c, uint8_t *buff, int buff_len);
 int decodeChunk(struct chunk *c, const uint8_t *buff, int buff_len);
+
+/**
+ * borrowing variant of decodeChunk: data and attributes point into buff
+ * instead of being copied, so they are only valid as long as buff is.
+ * nothing has to be freed afterwards
+ */
+int decodeChunkInPlace(struct chunk *c, const uint8_t *buff, int buff_len);
+
+/**
+ * scatter/gather variant of encodeChunk: only the GRAPES header is
+ * written, into hdr (GRAPES_ENCODED_CHUNK_HEADER_SIZE bytes), while
+ * payload and attributes are referenced in place by the iovec entries.
+ * returns the number of iovec entries filled, or -1 if iov_len is too small
+ */
+int encodeChunkIov(const struct chunk *c, uint8_t *hdr, struct iovec *iov, int iov_len);
+/**
+ * fragments needed for an encoded chunk of size bytes with payloads of at most
+ * max_payload bytes, and the payload size of all but the last of them
+ */
+int chunkFragmentCount(uint32_t size, int max_payload);
+uint32_t chunkFragmentPayloadSize(uint32_t size, int count);
+void chunkFragmentHeaderPush(uint8_t *p, uint32_t seq, uint16_t index, uint16_t count, uint32_t size);
+void chunkFragmentHeaderPull(const uint8_t *p, uint32_t *seq, uint16_t *index, uint16_t *count, uint32_t *size);
+
 int bit32_encoded_pull(uint8_t *p);
 void bit32_encoded_push(uint32_t v, uint8_t *p);
 
@@ -0,0 +1,180 @@
+/*
+ * round trip of chunk_fec.c: chunks of varying length are encoded, some
+ * blocks are dropped or swapped and whatever the decoder delivers is checked
+ * against what was sent.
+ * usage: ./fec_check, exits non zero on a mismatch
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "chunk_fec.h"
+
+//rounded up to whole groups, so that every group gets its parity
+#define CHECK_CHUNKS 1000
+#define CHECK_MAX_LEN 1500
+
+typedef struct DropPattern {
+	const char *name;
+	int n;
+	uint32_t first_group;
+	int data_drop; //drop data chunk i if i % data_drop == data_drop_at
+	int data_drop_at;
+	int parity_drop; //drop the parity of group g if g % parity_drop == 0
+	int swap; //deliver the data chunks two by two in reverse order
+	int expect_lost; //data chunks can be lost, more than one missing in a group
+} DropPattern;
+
+static const DropPattern patterns[] = {
+	{"no loss", 5, 0, 0, 0, 0, 0, 0},
+	{"one loss per group", 5, 0, 5, 2, 0, 0, 0},
+	{"one loss per group, parity lost too", 4, 0, 4, 0, 3, 0, 0},
+	{"sparse losses, group wraps", 8, 0xfffffffe, 7, 3, 11, 0, 1},
+	{"losses and reordering", 6, 0, 6, 5, 0, 1, 0},
+	{"two losses per group", 4, 0, 2, 1, 0, 0, 1},
+	{"widest group", FEC_WINDOW_MAX, 0, FEC_WINDOW_MAX, 7, 0, 0, 0},
+};
+
+static int received[CHECK_CHUNKS + FEC_WINDOW_MAX];
+static int corrupted;
+
+//length and content both derive from the chunk id, written in its first bytes
+static int chunkLen(int id) {
+	return 8 + (id * 131) % (CHECK_MAX_LEN - 8);
+}
+
+static void fillChunk(uint8_t *b, int id) {
+	int i;
+	int len = chunkLen(id);
+
+	memcpy(b, &id, sizeof(id));
+	for(i=sizeof(id); i<len; i++)
+		b[i] = (uint8_t)(id * 7 + i);
+}
+
+static void deliver(const uint8_t *block, int len, void *arg) {
+	int i, id;
+
+	if(len < (int)sizeof(id)) {
+		corrupted++;
+		return;
+	}
+	memcpy(&id, block, sizeof(id));
+	if(id < 0 || id >= CHECK_CHUNKS + FEC_WINDOW_MAX || len != chunkLen(id)) {
+		corrupted++;
+		return;
+	}
+	for(i=sizeof(id); i<len; i++) {
+		if(block[i] != (uint8_t)(id * 7 + i)) {
+			corrupted++;
+			return;
+		}
+	}
+	received[id]++;
+}
+
+static int runPattern(const DropPattern *p) {
+	FecEncoder e;
+	FecDecoder d;
+	uint8_t blocks[2][FEC_HEADER_SIZE + CHECK_MAX_LEN];
+	int held = -1; //chunk kept back when swapping
+	int i, parity_len, group = 0;
+	int chunks = (CHECK_CHUNKS + p->n - 1) / p->n * p->n;
+	int dropped = 0, missing = 0, duplicated = 0;
+	int failed = 0;
+
+	memset(received, 0, sizeof(received));
+	corrupted = 0;
+	if(fecEncoderInit(&e, p->n, p->first_group) < 0) {
+		fprintf(stderr, "%s: encoder init failed\n", p->name);
+		return -1;
+	}
+	fecDecoderInit(&d);
+
+	for(i=0; i<chunks; i++) {
+		uint8_t *b = blocks[i & 1];
+		int drop = p->data_drop && i % p->data_drop == p->data_drop_at;
+
+		fillChunk(b + FEC_HEADER_SIZE, i);
+		parity_len = fecEncodeData(&e, b + FEC_HEADER_SIZE, chunkLen(i), b);
+		if(parity_len < 0) {
+			fprintf(stderr, "%s: encoder allocation failed\n", p->name);
+			failed = 1;
+			break;
+		}
+		if(drop) {
+			dropped++;
+		}
+		else if(p->swap && held < 0 && parity_len == 0) {
+			held = i;
+		}
+		else {
+			fecDecode(&d, b, FEC_HEADER_SIZE + chunkLen(i), deliver, NULL);
+		}
+		if(held >= 0 && held != i) {
+			fecDecode(&d, blocks[held & 1], FEC_HEADER_SIZE + chunkLen(held), deliver, NULL);
+			held = -1;
+		}
+		if(parity_len > 0) {
+			if(held >= 0) {
+				fecDecode(&d, blocks[held & 1], FEC_HEADER_SIZE + chunkLen(held), deliver, NULL);
+				held = -1;
+			}
+			if(!p->parity_drop || group % p->parity_drop != 0)
+				fecDecode(&d, fecEncoderParity(&e), parity_len, deliver, NULL);
+			group++;
+		}
+	}
+	if(held >= 0)
+		fecDecode(&d, blocks[held & 1], FEC_HEADER_SIZE + chunkLen(held), deliver, NULL);
+	fecDecoderFree(&d);
+	fecEncoderFree(&e);
+
+	for(i=0; i<chunks; i++) {
+		if(!received[i])
+			missing++;
+		else if(received[i] > 1)
+			duplicated++;
+	}
+	//with the parity of a group lost its dropped chunk stays lost
+	if(corrupted || duplicated || (missing && !p->expect_lost && !p->parity_drop)
+		|| (unsigned long long)missing != d.lost || d.invalid)
+		failed = 1;
+
+	printf("%-40s n %2d dropped %4d recovered %4llu lost %4llu missing %4d corrupted %d duplicated %d %s\n",
+		p->name, p->n, dropped, d.recovered, d.lost, missing, corrupted, duplicated, failed ? "FAILED" : "ok");
+	return failed ? -1 : 0;
+}
+
+//blocks shorter than the header or with a bad index must be refused, not delivered
+static int checkInvalid(void) {
+	FecDecoder d;
+	uint8_t block[FEC_HEADER_SIZE + 16];
+	int failed = 0;
+
+	memset(block, 0, sizeof(block));
+	block[5] = 4; //n
+	block[4] = 9; //index past the parity
+	fecDecoderInit(&d);
+	corrupted = 0;
+	if(fecDecode(&d, block, FEC_HEADER_SIZE - 1, deliver, NULL) != -1)
+		failed = 1;
+	if(fecDecode(&d, block, sizeof(block), deliver, NULL) != -1)
+		failed = 1;
+	if(corrupted || d.invalid != 2)
+		failed = 1;
+	fecDecoderFree(&d);
+	printf("%-40s invalid %llu %s\n", "invalid blocks", d.invalid, failed ? "FAILED" : "ok");
+	return failed ? -1 : 0;
+}
+
+int main(void) {
+	int i, failed = 0;
+
+	if(checkInvalid() < 0)
+		failed++;
+	for(i=0; i<(int)(sizeof(patterns)/sizeof(patterns[0])); i++) {
+		if(runPattern(&patterns[i]) < 0)
+			failed++;
+	}
+	return failed ? 1 : 0;
+}
@@ -7,6 +7,14 @@ void finalizeChunkPuller(struct MHD_Daemon *daemon);
 #endif
 #ifdef TCPIO
 int initChunkPuller(const int port);
+//listen on a further port, the chunks received there go to ring instead of the demux thread
+struct ChunkRing;
+int initFeedPuller(const int port, struct ChunkRing *ring);
+void finalizeChunkPuller(void);
+#endif
+#ifdef UDPIO
+//reassembles the fragmented chunks sent to port
+int initChunkPuller(const int port);
 void finalizeChunkPuller(void);
 #endif
 
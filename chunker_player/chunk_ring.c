@@ -0,0 +1,164 @@
+/*
+ *  Copyright (c) 2009-2011 Carmelo Daniele, Dario Marchese, Diego Reforgiato, Giuseppe Tropea
+ *  developed for the Napa-Wine EU project. See www.napa-wine.eu
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <SDL.h>
+#include <SDL_thread.h>
+
+#include "chunk_ring.h"
+
+typedef struct ChunkRingSlot {
+	uint8_t *data;
+	int capacity;
+	int size;
+} ChunkRingSlot;
+
+struct ChunkRing {
+	ChunkRingSlot *slots;
+	unsigned int mask;
+	//head is only written by the producer, tail only by the consumer
+	volatile unsigned int head;
+	volatile unsigned int tail;
+	SDL_sem *available;
+	unsigned int dropped;
+	unsigned int max_depth;
+};
+
+ChunkRing *ChunkRingCreate(int slots)
+{
+	ChunkRing *r;
+
+	if(slots <= 0 || (slots & (slots - 1))) {
+		fprintf(stderr, "CHUNK-RING: size %d is not a power of two\n", slots);
+		return NULL;
+	}
+	r = calloc(1, sizeof(ChunkRing));
+	if(!r)
+		return NULL;
+	r->slots = calloc(slots, sizeof(ChunkRingSlot));
+	r->available = SDL_CreateSemaphore(0);
+	if(!r->slots || !r->available) {
+		ChunkRingDestroy(r);
+		return NULL;
+	}
+	r->mask = slots - 1;
+	return r;
+}
+
+void ChunkRingDestroy(ChunkRing *r)
+{
+	unsigned int i;
+
+	if(!r)
+		return;
+	if(r->slots) {
+		for(i = 0; i <= r->mask; i++)
+			free(r->slots[i].data);
+		free(r->slots);
+	}
+	if(r->available)
+		SDL_DestroySemaphore(r->available);
+	free(r);
+}
+
+uint8_t *ChunkRingReserve(ChunkRing *r, int size)
+{
+	unsigned int head = r->head;
+	ChunkRingSlot *slot;
+
+	if(head - r->tail > r->mask) {
+		r->dropped++;
+		return NULL;
+	}
+	slot = &r->slots[head & r->mask];
+	//the slot is not visible to the consumer yet, it can be grown freely
+	if(slot->capacity < size) {
+		uint8_t *tmp = realloc(slot->data, size);
+		if(!tmp) {
+			r->dropped++;
+			return NULL;
+		}
+		slot->data = tmp;
+		slot->capacity = size;
+	}
+	return slot->data;
+}
+
+void ChunkRingCommit(ChunkRing *r, int size)
+{
+	unsigned int depth;
+
+	r->slots[r->head & r->mask].size = size;
+	//the slot content must be visible before the new head
+	__sync_synchronize();
+	r->head++;
+	depth = r->head - r->tail;
+	if(depth > r->max_depth)
+		r->max_depth = depth;
+	SDL_SemPost(r->available);
+}
+
+int ChunkRingPush(ChunkRing *r, const uint8_t *block, int size)
+{
+	uint8_t *p = ChunkRingReserve(r, size);
+
+	if(!p)
+		return -1;
+	memcpy(p, block, size);
+	ChunkRingCommit(r, size);
+	return 0;
+}
+
+const uint8_t *ChunkRingPeek(ChunkRing *r, int *size, int timeout_ms)
+{
+	ChunkRingSlot *slot;
+
+	if(r->head == r->tail) {
+		SDL_SemWaitTimeout(r->available, timeout_ms);
+		if(r->head == r->tail)
+			return NULL;
+	}
+	else {
+		//keep the semaphore count in step with the ring content
+		SDL_SemWaitTimeout(r->available, 0);
+	}
+	//read the slot only after having seen the head that published it
+	__sync_synchronize();
+	slot = &r->slots[r->tail & r->mask];
+	*size = slot->size;
+	return slot->data;
+}
+
+void ChunkRingRelease(ChunkRing *r)
+{
+	//done with the slot before handing it back
+	__sync_synchronize();
+	r->tail++;
+}
+
+void ChunkRingWakeup(ChunkRing *r)
+{
+	SDL_SemPost(r->available);
+}
+
+unsigned int ChunkRingDepth(ChunkRing *r)
+{
+	return r->head - r->tail;
+}
+
+unsigned int ChunkRingDropped(ChunkRing *r)
+{
+	return r->dropped;
+}
+
+unsigned int ChunkRingMaxDepth(ChunkRing *r)
+{
+	return r->max_depth;
+}
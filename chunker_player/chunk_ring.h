@@ -0,0 +1,52 @@
+/*
+ *  Copyright (c) 2009-2011 Carmelo Daniele, Dario Marchese, Diego Reforgiato, Giuseppe Tropea
+ *  developed for the Napa-Wine EU project. See www.napa-wine.eu
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#ifndef _CHUNK_RING_H
+#define _CHUNK_RING_H
+
+#include <stdint.h>
+
+/**
+ * lock-free single producer / single consumer ring of received chunks.
+ * the producer is the network thread, the consumer the demux thread:
+ * neither of them ever waits for the other one holding a lock.
+ * every slot owns a buffer that is grown on demand and then reused.
+ */
+typedef struct ChunkRing ChunkRing;
+
+/** slots must be a power of two */
+ChunkRing *ChunkRingCreate(int slots);
+void ChunkRingDestroy(ChunkRing *r);
+
+/**
+ * producer: get the buffer of the next free slot, large enough for size bytes.
+ * returns NULL if the ring is full (the chunk is counted as dropped)
+ */
+uint8_t *ChunkRingReserve(ChunkRing *r, int size);
+/** producer: publish the slot returned by the last ChunkRingReserve */
+void ChunkRingCommit(ChunkRing *r, int size);
+/** producer: reserve, copy and commit in one go. returns -1 if dropped */
+int ChunkRingPush(ChunkRing *r, const uint8_t *block, int size);
+
+/**
+ * consumer: wait up to timeout_ms for a chunk.
+ * returns the oldest chunk, or NULL on timeout. The chunk stays valid until ChunkRingRelease
+ */
+const uint8_t *ChunkRingPeek(ChunkRing *r, int *size, int timeout_ms);
+/** consumer: give the slot returned by ChunkRingPeek back to the producer */
+void ChunkRingRelease(ChunkRing *r);
+/** wake up a consumer waiting in ChunkRingPeek */
+void ChunkRingWakeup(ChunkRing *r);
+
+/** number of chunks waiting in the ring */
+unsigned int ChunkRingDepth(ChunkRing *r);
+/** number of chunks dropped because the ring was full */
+unsigned int ChunkRingDropped(ChunkRing *r);
+/** highest number of chunks ever waiting in the ring */
+unsigned int ChunkRingMaxDepth(ChunkRing *r);
+
+#endif
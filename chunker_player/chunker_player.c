@@ -15,6 +15,8 @@
 #include "player_defines.h"
 #include "chunker_player.h"
 #include "chunk_puller.h"
+#include "chunk_ring.h"
+#include "chunk_fec.h"
 #include "player_gui.h"
 #include <time.h>
 #include <getopt.h>
@@ -34,6 +36,7 @@
 
 #ifdef __linux__
 #include <X11/Xlib.h>
+#include <sys/resource.h>
 #endif
 
 int NChannels;
@@ -43,6 +46,21 @@ int Port;
 
 int ParseConf(char *file, char *uri);
 int SwitchChannel(SChannel* channel);
+int StartStreamer(SChannel* channel);
+
+//received chunks wait here for the demux thread, so that receivers never take the playout locks
+static ChunkRing *chunk_ring = NULL;
+static SDL_Thread *DemuxThread = NULL;
+static int DemuxThreadProc(void *params);
+
+//keep the streamers of the neighbour channels running, so that zapping only swaps the ring read
+static int PrewarmChannels = 0;
+static ChunkRing *active_ring = NULL; //chunk_ring, or the feed of the selected channel
+static SDL_mutex *DemuxMutex = NULL;
+static int StreamerRunning(SChannel *channel);
+static void UpdatePrewarmedChannels();
+static void TrimPrewarmedFeeds();
+static void StopPrewarmedChannels();
 
 int ReadALine(FILE* fp, char* Output, int MaxOutputSize)
 {
@@ -109,11 +127,18 @@ static void print_usage(int argc, char *argv[])
     "\t[-C file]: channel list file name (default: channels.conf)\n"
     "\t[-p port]: player http port\n"
     "\t[-q q_thresh]: playout queue size\n"
+    "\t[-a ms]: audio decoded ahead of playback (default: %d)\n"
+    "\t[-j threads]: video decoder threads (default: %d)\n"
+    "\t[-J frame|slice]: video decoder threading type (default: frame)\n"
     "\t[-A audiocodec]\n"
     "\t[-V videocodec]\n"
     "\t[-t]: log traces (WARNING: old traces will be deleted).\n"
+    "\t[-z]: prewarm the channels next to the selected one, for a faster zap\n"
+    "\t[-u n]: UDP datagrams received per system call (default: %d)\n"
+    "\t[-U]: UDP receive offload (GRO), where the kernel supports it\n"
+    "\t[-f]: the streamer sends FEC parity chunks (--fec), rebuild the lost chunks\n"
     "\t[-s mode]: silent mode (no GUI) (mode=1 audio ON, mode=2 audio OFF, mode=3 audio OFF; P2P OFF).\n\n"
-    "=======================================================\n", argv[0]
+    "=======================================================\n", argv[0], AUDIO_LOOKAHEAD_MS_DEFAULT, DECODER_THREADS_DEFAULT, UDP_BATCH_DEFAULT
     );
 }
 
@@ -139,6 +164,14 @@ int initIPCReceiver(Port)
 		return -1;
 	}
 #endif
+#ifdef UDPIO
+	int fd = initChunkPuller(Port);
+	if(! (fd > 0))
+	{
+		printf("CANNOT START UDP PULLER...\n");
+		return -1;
+	}
+#endif
 
 	return 1;
 }
@@ -152,6 +185,12 @@ int main(int argc, char *argv[])
 	// some initializations
 	SilentMode = 0;
 	queue_filling_threshold = 5;
+	audio_lookahead_ms = AUDIO_LOOKAHEAD_MS_DEFAULT;
+	decoder_threads = DECODER_THREADS_DEFAULT;
+	decoder_slice_threads = 0;
+	udp_batch = UDP_BATCH_DEFAULT;
+	udp_gro = 0;
+	fec_enabled = 0;
 	quit = 0;
 	QueueFillingMode=1;
 	LogTraces = 0;
@@ -172,7 +211,7 @@ int main(int argc, char *argv[])
 	OverlayMutex = SDL_CreateMutex();
 	
 	char c;
-	while ((c = getopt (argc, argv, "q:c:C:p:s:t")) != -1)
+	while ((c = getopt (argc, argv, "q:a:c:C:p:s:tzj:J:u:Uf")) != -1)
 	{
 		switch (c) {
 			case 0: //for long options
@@ -180,6 +219,24 @@ int main(int argc, char *argv[])
 			case 'q':
 				sscanf(optarg, "%d", &queue_filling_threshold);
 				break;
+			case 'a':
+				sscanf(optarg, "%d", &audio_lookahead_ms);
+				break;
+			case 'j':
+				sscanf(optarg, "%d", &decoder_threads);
+				break;
+			case 'J':
+				decoder_slice_threads = !strcmp(optarg, "slice");
+				break;
+			case 'u':
+				sscanf(optarg, "%d", &udp_batch);
+				break;
+			case 'U':
+				udp_gro = 1;
+				break;
+			case 'f':
+				fec_enabled = 1;
+				break;
 			case 'c':
 				sprintf(firstChannelName, "%s", optarg);
 				break;
@@ -197,6 +254,9 @@ int main(int argc, char *argv[])
 				CREATE_DIR("traces");
 				LogTraces = 1;
 				break;
+			case 'z':
+				PrewarmChannels = 1;
+				break;
 			default:
 				print_usage(argc, argv);
 				return -1;
@@ -254,6 +314,31 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+#if !defined(TCPIO) || defined(__WIN32__)
+	if(PrewarmChannels) {
+		fprintf(stderr, "Prewarming channels needs the TCP input, ignored\n");
+		PrewarmChannels = 0;
+	}
+#endif
+#ifndef UDPIO
+	if(fec_enabled) {
+		fprintf(stderr, "FEC needs the UDP input, ignored\n");
+		fec_enabled = 0;
+	}
+#endif
+
+	chunk_ring = ChunkRingCreate(CHUNK_RING_SLOTS);
+	if(!chunk_ring) {
+		fprintf(stderr, "Could not create the chunk ring\n");
+		exit(2);
+	}
+	active_ring = chunk_ring;
+	DemuxMutex = SDL_CreateMutex();
+	if((DemuxThread = SDL_CreateThread(&DemuxThreadProc, NULL)) == 0) {
+		fprintf(stderr, "Could not start the demux thread\n");
+		exit(2);
+	}
+
 	if (initIPCReceiver(Port) < 0) {
 		exit(2);
 	}
@@ -331,6 +416,8 @@ int main(int argc, char *argv[])
 	
 	SelectedChannel = firstChannelIndex;
 
+	if(PrewarmChannels)
+		UpdatePrewarmedChannels();
 	SwitchChannel(&(Channels[SelectedChannel]));
 
 	// Wait for user input
@@ -453,8 +540,11 @@ int main(int argc, char *argv[])
 	}
 
 	KILL_PROCESS(&(Channels[SelectedChannel].StreamerProcess));
+	StopPrewarmedChannels();
 
 	//TERMINATE
+	ChunkRingWakeup(chunk_ring);
+	SDL_WaitThread(DemuxThread, NULL);
 	ChunkerPlayerCore_Stop();
 	ChunkerPlayerCore_Finalize();
 	ChunkerPlayerGUI_Close();
@@ -464,7 +554,7 @@ int main(int argc, char *argv[])
 #ifdef HTTPIO
 	finalizeChunkPuller(daemon);
 #endif
-#ifdef TCPIO
+#if defined(TCPIO) || defined(UDPIO)
 	finalizeChunkPuller();
 #endif
 	
@@ -617,17 +707,124 @@ int ReTune(SChannel* channel)
 	return 0;
 }
 
+#if defined(TCPIO) && !defined(__WIN32__)
+//port where the player receives the chunks of a channel in prewarm mode, past the peer ports
+static int FeedPort(SChannel *channel)
+{
+	return Port + MAX_CHANNELS_NUM + 1 + channel->Index;
+}
+
+static int StreamerRunning(SChannel *channel)
+{
+	return PrewarmChannels && channel->StreamerProcess > 0;
+}
+
+/*
+ * run the streamers of the selected channel and of its neighbours, the latter at
+ * a lower priority, stop the others, and have the demux thread read the selected feed
+ */
+static void UpdatePrewarmedChannels()
+{
+	int i;
+
+	for(i = 0; i < NChannels; i++) {
+		SChannel *channel = &Channels[i];
+		int neighbour = i == (SelectedChannel+1) % NChannels || i == (SelectedChannel+NChannels-1) % NChannels;
+
+		if(i != SelectedChannel && !neighbour) {
+			if(channel->StreamerProcess > 0) {
+				KILL_PROCESS(&channel->StreamerProcess);
+				channel->StreamerProcess = 0;
+			}
+			continue;
+		}
+		if(!channel->Feed) {
+			channel->Feed = ChunkRingCreate(PREWARM_FEED_SLOTS);
+			if(!channel->Feed || initFeedPuller(FeedPort(channel), channel->Feed) < 0) {
+				fprintf(stderr, "PREWARM: cannot receive channel %s on port %d\n", channel->Title, FeedPort(channel));
+				//no ring nobody fills: the channel plays from the main port, the feed is tried again on the next zap
+				if(channel->Feed)
+					ChunkRingDestroy(channel->Feed);
+				channel->Feed = NULL;
+				continue;
+			}
+			//started while it had no feed, it sends to the main port
+			if(channel->StreamerProcess > 0) {
+				KILL_PROCESS(&channel->StreamerProcess);
+				channel->StreamerProcess = 0;
+			}
+		}
+		if(i != SelectedChannel) {
+			if(channel->StreamerProcess > 0)
+				setpriority(PRIO_PROCESS, channel->StreamerProcess, PREWARM_NICE);
+			else
+				StartStreamer(channel);
+		}
+		else if(channel->StreamerProcess > 0) {
+			//without privileges this fails, and the streamer keeps running niced
+			if(setpriority(PRIO_PROCESS, channel->StreamerProcess, 0) < 0)
+				fprintf(stderr, "PREWARM: streamer of %s keeps its low priority\n", channel->Title);
+		}
+	}
+
+	SDL_LockMutex(DemuxMutex);
+	active_ring = Channels[SelectedChannel].Feed ? Channels[SelectedChannel].Feed : chunk_ring;
+	SDL_UnlockMutex(DemuxMutex);
+}
+
+//demux thread: the feeds of the neighbours only keep their newest chunks
+static void TrimPrewarmedFeeds()
+{
+	int i, size;
+
+	for(i = 0; i < NChannels; i++) {
+		ChunkRing *feed = Channels[i].Feed;
+
+		if(!feed || feed == active_ring)
+			continue;
+		while(ChunkRingDepth(feed) > PREWARM_FEED_CHUNKS && ChunkRingPeek(feed, &size, 0))
+			ChunkRingRelease(feed);
+	}
+}
+
+static void StopPrewarmedChannels()
+{
+	int i;
+
+	for(i = 0; PrewarmChannels && i < NChannels; i++) {
+		if(i != SelectedChannel && Channels[i].StreamerProcess > 0)
+			KILL_PROCESS(&Channels[i].StreamerProcess);
+	}
+}
+#else
+static int StreamerRunning(SChannel *channel) { return 0; }
+static void UpdatePrewarmedChannels() {}
+static void TrimPrewarmedFeeds() {}
+static void StopPrewarmedChannels() {}
+#endif
+
 int StartStreamer(SChannel* channel)
 {
 	char argv0[255], parameters_string[511];
+	int out_port = Port;
 	sprintf(argv0, "%s", StreamerFilename);
 
+#if defined(TCPIO) && !defined(__WIN32__)
+	//every channel has its own feed, whether selected or not
+	if(PrewarmChannels && channel->Feed)
+		out_port = FeedPort(channel);
+#endif
+
 #ifdef HTTPIO
 	sprintf(parameters_string, "%s %s %s %d %s %s %d", "-C", channel->Title, "-P", (Port+channel->Index), channel->LaunchString, "-F", Port);
 #endif
 
 #ifdef TCPIO
-	sprintf(parameters_string, "%s %s %s %d %s %s tcp://127.0.0.1:%d", "-C", channel->Title, "-P", (Port+channel->Index), channel->LaunchString, "-F", Port);
+	sprintf(parameters_string, "%s %s %s %d %s %s tcp://127.0.0.1:%d", "-C", channel->Title, "-P", (Port+channel->Index), channel->LaunchString, "-F", out_port);
+#endif
+
+#ifdef UDPIO
+	sprintf(parameters_string, "%s %s %s %d %s %s udp://127.0.0.1:%d", "-C", channel->Title, "-P", (Port+channel->Index), channel->LaunchString, "-F", out_port);
 #endif
 
 	printf("OFFERSTREAMER LAUNCH STRING: %s %s\n", argv0, parameters_string);
@@ -674,6 +871,8 @@ int StartStreamer(SChannel* channel)
 		int pid = fork();
 		if(pid == 0)
 		{
+			if(PrewarmChannels && channel != &Channels[SelectedChannel])
+				nice(PREWARM_NICE);
 			execv(argv0, parameters_vector);
 			printf("ERROR, COULD NOT LAUNCH OFFERSTREAMER\n");
 			exit(2);
@@ -727,9 +926,21 @@ int StartStreamer(SChannel* channel)
 	return 1;
 }
 
+static void ResetChannelQuality(SChannel* channel)
+{
+	int i;
+
+	channel->startTime = time(NULL);
+	channel->instant_score = 0.0;
+	channel->average_score = 0.0;
+	channel->history_index = 0;
+	for(i=0; i<CHANNEL_SCORE_HISTORY_SIZE; i++)
+		channel->score_history[i] = -1;
+	sprintf(channel->quality, "EVALUATING...");
+}
+
 int SwitchChannel(SChannel* channel)
 {
-	int i=0;
 #ifdef RESTORE_SCREEN_ON_ZAPPING
 	int was_fullscreen = FullscreenMode;
 	int old_width = window_width, old_height = window_height;
@@ -760,16 +971,11 @@ int SwitchChannel(SChannel* channel)
 		exit(2);
 	}
 	
-	//reset quality info
-	channel->startTime = time(NULL);
-	channel->instant_score = 0.0;
-	channel->average_score = 0.0;
-	channel->history_index = 0;
-	for(i=0; i<CHANNEL_SCORE_HISTORY_SIZE; i++)
-		channel->score_history[i] = -1;
-	sprintf(channel->quality, "EVALUATING...");
+	ResetChannelQuality(channel);
 
-	StartStreamer(channel);
+	//a prewarmed streamer is already sending
+	if(!StreamerRunning(channel))
+		StartStreamer(channel);
 
 #ifdef RESTORE_SCREEN_ON_ZAPPING
 	if(SilentMode == 0) {
@@ -831,24 +1037,128 @@ int SwitchChannel(SChannel* channel)
 	return 0;
 }
 
+//the decoders, the overlay and the audio device of one fit the other
+static int SameStreams(SChannel* a, SChannel* b)
+{
+	return !strcmp(a->VideoCodec, b->VideoCodec) && !strcmp(a->AudioCodec, b->AudioCodec)
+		&& a->Width == b->Width && a->Height == b->Height && a->Ratio == b->Ratio
+		&& a->SampleRate == b->SampleRate && a->AudioChannels == b->AudioChannels;
+}
+
+/*
+ * zap to a prewarmed channel with the same streams as the one playing: the demux
+ * thread already reads its feed, the player keeps running and only drops what it
+ * holds of the old channel
+ */
+static void SwitchPrewarmedChannel(SChannel* channel)
+{
+	ChunkerPlayerCore_FlushDecoders();
+	ChunkerPlayerGUI_SetChannelRatio(channel->Ratio);
+	ChunkerPlayerGUI_SetChannelTitle(channel->Title);
+	ResetChannelQuality(channel);
+	ChunkerPlayerGUI_ChannelSwitched();
+}
+
+static void ZapTo(int index)
+{
+	Uint32 start = SDL_GetTicks();
+	int prewarmed = 0, flushed = 0;
+
+	if(PrewarmChannels) {
+		prewarmed = StreamerRunning(&Channels[index]);
+		flushed = prewarmed && Channels[index].Feed && ChunkerPlayerCore_IsRunning()
+			&& SameStreams(&Channels[SelectedChannel], &Channels[index]);
+		SelectedChannel = index;
+		UpdatePrewarmedChannels();
+	} else {
+		KILL_PROCESS(&Channels[SelectedChannel].StreamerProcess);
+		SelectedChannel = index;
+	}
+	if(flushed)
+		SwitchPrewarmedChannel(&(Channels[SelectedChannel]));
+	else
+		SwitchChannel(&(Channels[SelectedChannel]));
+	printf("ZAP: switched to %s (%s) in %u ms\n", Channels[SelectedChannel].Title,
+		flushed ? "prewarmed, decoders flushed" : prewarmed ? "prewarmed" : "cold", SDL_GetTicks() - start);
+}
+
 void ZapDown()
 {
-	KILL_PROCESS(&Channels[SelectedChannel].StreamerProcess);
-	SelectedChannel = ((SelectedChannel+1) %NChannels);
-	SwitchChannel(&(Channels[SelectedChannel]));
+	ZapTo((SelectedChannel+1) %NChannels);
 }
 
 void ZapUp()
 {
-	KILL_PROCESS(&Channels[SelectedChannel].StreamerProcess);
-	SelectedChannel--;
-	if(SelectedChannel < 0)
-		SelectedChannel = NChannels-1;
-
-	SwitchChannel(&(Channels[SelectedChannel]));
+	ZapTo(SelectedChannel > 0 ? SelectedChannel-1 : NChannels-1);
 }
 
 int enqueueBlock(const uint8_t *block, const int block_size)
 {
-	return ChunkerPlayerCore_EnqueueBlocks(block, block_size);
+	return ChunkRingPush(chunk_ring, block, block_size);
+}
+
+uint8_t *reserveBlock(const int block_size)
+{
+	return ChunkRingReserve(chunk_ring, block_size);
+}
+
+void commitBlock(const int block_size)
+{
+	ChunkRingCommit(chunk_ring, block_size);
+}
+
+static void DeliverRecoveredBlock(const uint8_t *block, int block_size, void *arg)
+{
+	ChunkerPlayerCore_EnqueueBlocks(block, block_size);
+}
+
+static int DemuxThreadProc(void *params)
+{
+	const uint8_t *block;
+	int block_size;
+	ChunkRing *ring;
+	FecDecoder fec;
+	ChunkRing *fec_ring = NULL; //the groups being decoded come from this ring
+	unsigned long long emulated_losses = 0;
+
+	fecDecoderInit(&fec);
+
+	while(!quit) {
+		ring = active_ring;
+		block = ChunkRingPeek(ring, &block_size, 100);
+		if(PrewarmChannels)
+			TrimPrewarmedFeeds();
+		if(!block)
+			continue;
+		SDL_LockMutex(DemuxMutex);
+		//after a zap the chunk stays in the feed of its channel
+		if(ring == active_ring) {
+			//lost on the way, parity chunks included
+			if(ChunkerPlayerCore_EmulatedChunkLoss())
+				emulated_losses++;
+			else if(!fec_enabled)
+				ChunkerPlayerCore_EnqueueBlocks(block, block_size);
+			else {
+				//after a zap the groups of the other channel cannot be completed
+				if(ring != fec_ring) {
+					fecDecoderReset(&fec);
+					fec_ring = ring;
+				}
+				fecDecode(&fec, block, block_size, DeliverRecoveredBlock, NULL);
+			}
+			ChunkRingRelease(ring);
+		}
+		SDL_UnlockMutex(DemuxMutex);
+	}
+	fprintf(stderr, "DEMUX: %u chunks dropped on a full ring, max depth %u\n", ChunkRingDropped(chunk_ring), ChunkRingMaxDepth(chunk_ring));
+	if(fec_enabled) {
+		fecDecoderFree(&fec);
+		fprintf(stderr, "FEC: %llu data and %llu parity chunks received, %llu without a valid header, %llu dropped by loss emulation, %llu rebuilt, %llu lost, %.1f%% of the losses recovered, %.1f%% overhead\n",
+			fec.data, fec.parity, fec.invalid, emulated_losses, fec.recovered, fec.lost,
+			fec.recovered + fec.lost ? 100.0 * fec.recovered / (fec.recovered + fec.lost) : 0.0,
+			fec.data_bytes ? 100.0 * fec.parity_bytes / fec.data_bytes : 0.0);
+	} else if(emulated_losses)
+		fprintf(stderr, "DEMUX: %llu chunks dropped by loss emulation\n", emulated_losses);
+
+	return 0;
 }
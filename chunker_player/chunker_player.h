@@ -34,6 +34,7 @@ typedef struct SChannel
 	int startTime;
 	char VideoCodec[255];
 	char AudioCodec[255];
+	struct ChunkRing *Feed; //prewarm mode: chunks received from this channel's streamer
 #ifndef __WIN32__
 	pid_t StreamerProcess;
 #else
@@ -48,6 +49,12 @@ SDL_mutex *OverlayMutex;
 SDL_Surface *MainScreen;
 int SilentMode;
 int queue_filling_threshold;
+int audio_lookahead_ms;
+int decoder_threads;
+int decoder_slice_threads; //slice instead of frame threading
+int udp_batch; //datagrams received per system call
+int udp_gro; //let the kernel coalesce the UDP fragments
+int fec_enabled; //chunks come with XOR parity, rebuild the lost ones
 int quit;
 short int QueueFillingMode;
 int LogTraces;
@@ -104,6 +111,10 @@ int Audio_ON;
 void ZapDown();
 void ZapUp();
 int ReTune(SChannel* channel);
+//hand a received chunk over to the demux thread (copied, returns -1 if dropped)
 int enqueueBlock(const uint8_t *block, const int block_size);
+//zero-copy variant: receive straight into the buffer returned by reserveBlock (NULL if full), then commit
+uint8_t *reserveBlock(const int block_size);
+void commitBlock(const int block_size);
 
 #endif // _CHUNKER_PLAYER_H
@@ -0,0 +1,185 @@
+/*
+ *  Copyright (c) 2009-2011 Carmelo Daniele, Dario Marchese, Diego Reforgiato, Giuseppe Tropea
+ *  developed for the Napa-Wine EU project. See www.napa-wine.eu
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "pcm_ring.h"
+
+struct PcmRing {
+	uint8_t *buf;
+	unsigned int mask;
+	//free running byte counters, head - tail bytes are ready.
+	//head and seg_head are only written by the producer, tail and seg_tail only by the consumer
+	volatile unsigned int head;
+	volatile unsigned int tail;
+	PcmSegment *segs;
+	unsigned int seg_mask;
+	volatile unsigned int seg_head;
+	volatile unsigned int seg_tail;
+	volatile unsigned int generation;
+};
+
+PcmRing *PcmRingCreate(int bytes, int segments)
+{
+	PcmRing *r;
+	unsigned int size = 1;
+
+	if(bytes <= 0 || segments <= 0 || (segments & (segments - 1))) {
+		fprintf(stderr, "PCM-RING: bad size %d bytes, %d segments\n", bytes, segments);
+		return NULL;
+	}
+	while(size < (unsigned int)bytes)
+		size <<= 1;
+	r = calloc(1, sizeof(PcmRing));
+	if(!r)
+		return NULL;
+	r->buf = malloc(size);
+	r->segs = calloc(segments, sizeof(PcmSegment));
+	if(!r->buf || !r->segs) {
+		PcmRingDestroy(r);
+		return NULL;
+	}
+	r->mask = size - 1;
+	r->seg_mask = segments - 1;
+	return r;
+}
+
+void PcmRingDestroy(PcmRing *r)
+{
+	if(!r)
+		return;
+	free(r->buf);
+	free(r->segs);
+	free(r);
+}
+
+void PcmRingReset(PcmRing *r)
+{
+	__sync_add_and_fetch(&r->generation, 1);
+}
+
+unsigned int PcmRingGeneration(PcmRing *r)
+{
+	return r->generation;
+}
+
+int PcmRingBytes(PcmRing *r)
+{
+	return r->head - r->tail;
+}
+
+int PcmRingWrite(PcmRing *r, const uint8_t *data, int len, long long pts, int stream_index, int compressed_size, unsigned int generation)
+{
+	unsigned int pos = r->head & r->mask;
+	unsigned int first;
+	PcmSegment *s;
+
+	//decoded from a packet queued before the last reset
+	if(generation != r->generation)
+		return 0;
+	if(len <= 0 || (unsigned int)len > r->mask + 1 - (r->head - r->tail) || r->seg_head - r->seg_tail > r->seg_mask)
+		return -1;
+
+	first = r->mask + 1 - pos;
+	if(first >= (unsigned int)len) {
+		memcpy(r->buf + pos, data, len);
+	}
+	else {
+		memcpy(r->buf + pos, data, first);
+		memcpy(r->buf, data + first, len - first);
+	}
+
+	s = &r->segs[r->seg_head & r->seg_mask];
+	s->pts = pts;
+	s->stream_index = stream_index;
+	s->bytes = len;
+	s->offset = 0;
+	s->compressed_size = compressed_size;
+	s->generation = generation;
+	s->end = r->head + len;
+	//the samples and the segment must be visible before the new seg_head
+	__sync_synchronize();
+	r->head += len;
+	r->seg_head++;
+	return 0;
+}
+
+PcmSegment *PcmRingFirst(PcmRing *r)
+{
+	PcmSegment *s;
+
+	while(r->seg_head != r->seg_tail) {
+		//read the segment only after having seen the seg_head that published it
+		__sync_synchronize();
+		s = &r->segs[r->seg_tail & r->seg_mask];
+		if(s->generation == r->generation)
+			return s;
+		//written before the last reset, nothing to read in it
+		r->tail = s->end;
+		r->seg_tail++;
+	}
+	return NULL;
+}
+
+void PcmRingDropSegment(PcmRing *r)
+{
+	PcmSegment *s = PcmRingFirst(r);
+
+	if(!s)
+		return;
+	r->tail = s->end;
+	r->seg_tail++;
+}
+
+int PcmRingRead(PcmRing *r, uint8_t *dst, int len, void (*done)(const PcmSegment *))
+{
+	unsigned int seg_head, seg_tail, tail, pos, n;
+	unsigned int first, left;
+	PcmSegment *s;
+
+	if(len < 0 || !PcmRingFirst(r))
+		return 0;
+	//only the bytes of the segments already published, head may be ahead of them
+	seg_head = r->seg_head;
+	__sync_synchronize();
+	seg_tail = r->seg_tail;
+	tail = r->tail;
+	n = r->segs[(seg_head - 1) & r->seg_mask].end - tail;
+	if(n > (unsigned int)len)
+		n = len;
+
+	pos = tail & r->mask;
+	first = r->mask + 1 - pos;
+	if(first >= n) {
+		memcpy(dst, r->buf + pos, n);
+	}
+	else {
+		memcpy(dst, r->buf + pos, first);
+		memcpy(dst + first, r->buf, n - first);
+	}
+
+	//move the segments past what has been read
+	for(left = n; left > 0 && seg_tail != seg_head; ) {
+		s = &r->segs[seg_tail & r->seg_mask];
+		if((unsigned int)(s->bytes - s->offset) > left) {
+			s->offset += left;
+			break;
+		}
+		left -= s->bytes - s->offset;
+		s->offset = s->bytes;
+		if(done)
+			done(s);
+		seg_tail++;
+	}
+	//done with the samples before handing the space back
+	__sync_synchronize();
+	r->tail = tail + n;
+	r->seg_tail = seg_tail;
+	return n;
+}
@@ -0,0 +1,66 @@
+/*
+ *  Copyright (c) 2009-2011 Carmelo Daniele, Dario Marchese, Diego Reforgiato, Giuseppe Tropea
+ *  developed for the Napa-Wine EU project. See www.napa-wine.eu
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#ifndef _PCM_RING_H
+#define _PCM_RING_H
+
+#include <stdint.h>
+
+/**
+ * contiguous ring of decoded audio samples, ready to be handed to SDL.
+ * the samples of every decoded frame form a segment, which remembers
+ * the timestamp and the frame it comes from.
+ * the ring does no locking: one producer thread writes while one consumer
+ * thread reads and drops, PcmRingReset and PcmRingBytes can be called
+ * from any thread.
+ */
+typedef struct PcmRing PcmRing;
+
+typedef struct PcmSegment {
+	long long pts; //of the first sample of the segment
+	int stream_index; //frame number
+	int bytes; //decoded bytes
+	int offset; //bytes already read
+	int compressed_size;
+	unsigned int generation; //PcmRingGeneration when it was written
+	unsigned int end; //ring position past its last byte
+} PcmSegment;
+
+/** bytes is rounded up to a power of two, segments must be a power of two */
+PcmRing *PcmRingCreate(int bytes, int segments);
+void PcmRingDestroy(PcmRing *r);
+/**
+ * drop all the samples: starts a new generation, the consumer skips the
+ * segments of the older ones
+ */
+void PcmRingReset(PcmRing *r);
+/** generation the samples of a frame belong to, read before decoding it */
+unsigned int PcmRingGeneration(PcmRing *r);
+
+/** bytes written and not read yet, including those of older generations */
+int PcmRingBytes(PcmRing *r);
+
+/**
+ * producer: append the samples of a frame of the given generation.
+ * returns -1 if they do not fit, 0 if they are written or belong to an
+ * older generation and are left out
+ */
+int PcmRingWrite(PcmRing *r, const uint8_t *data, int len, long long pts, int stream_index, int compressed_size, unsigned int generation);
+
+/** consumer: the segment that will be read next, NULL if the ring is empty */
+PcmSegment *PcmRingFirst(PcmRing *r);
+/** consumer: drop the unread part of the first segment */
+void PcmRingDropSegment(PcmRing *r);
+
+/**
+ * consumer: copy up to len bytes to dst, at most two memcpy.
+ * done, if not NULL, is called for every segment read up to its end.
+ * returns the number of bytes copied
+ */
+int PcmRingRead(PcmRing *r, uint8_t *dst, int len, void (*done)(const PcmSegment *));
+
+#endif
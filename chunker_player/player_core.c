@@ -23,9 +23,12 @@
 #include <SDL_video.h>
 #include <assert.h>
 #include <time.h>
+#include <math.h>
+#include <sys/time.h>
 
 #include "player_stats.h"
 #include "player_defines.h"
+#include "pcm_ring.h"
 #include "chunker_player.h"
 #include "player_gui.h"
 #include "player_core.h"
@@ -36,10 +39,18 @@
 
 SDL_Overlay *YUVOverlay;
 
+/*
+ * packets are kept in a power of two ring indexed by frame number
+ * (stream_index), so that insertion and head extraction are O(1).
+ * a slot is empty when its data is NULL.
+ */
+#define PACKET_QUEUE_INITIAL_RING_SIZE 256
+
 typedef struct PacketQueue {
-	AVPacketList *first_pkt;
-	AVPacket *minpts_pkt;
-	AVPacketList *last_pkt;
+	AVPacket *ring;
+	int ring_mask; //ring size - 1
+	int first_index; //stream_index of the head, valid if nb_packets > 0
+	int last_index; //highest stream_index in the queue, valid if nb_packets > 0
 	int nb_packets;
 	int size;
 	SDL_mutex *mutex;
@@ -49,6 +60,8 @@ typedef struct PacketQueue {
 	int total_lost_frames;
 	long cumulative_bitrate;
 	long cumulative_samples;
+	//audio queue only: decoded samples waiting to be played
+	PcmRing *pcm;
 
 	SHistory PacketHistory;
 	
@@ -58,16 +71,28 @@ typedef struct PacketQueue {
 
 AVCodecContext  *aCodecCtx;
 SDL_Thread *video_thread;
+SDL_Thread *audio_decode_thread;
 SDL_Thread *stats_thread;
 uint8_t *outbuf_audio;
 // short int QueueFillingMode=1;
 short int QueueStopped;
 ThreadVal VideoCallbackThreadParams;
 
-int AudioQueueOffset;
+/* timing of the SDL audio callback, to see underruns and how regular it runs */
+typedef struct AudioCallbackStats {
+	long callbacks;
+	long underruns;
+	long long last_us;
+	double jitter_sum_ms; //sum of |interval - expected interval|
+	double jitter_max_ms;
+	long long run_sum_us;
+	long long run_max_us;
+} AudioCallbackStats;
+AudioCallbackStats audio_cb_stats;
+
 PacketQueue audioq;
 PacketQueue videoq;
-AVPacket AudioPkt, VideoPkt;
+AVPacket VideoPkt;
 int AVPlaying;
 int CurrentAudioFreq;
 int CurrentAudioSamples;
@@ -79,6 +104,13 @@ long long DeltaTime;
 short int FirstTimeAudio, FirstTime;
 
 int dimAudioQ;
+int pcm_lookahead_bytes; //decoded audio the decode-ahead thread keeps ready
+//wakes the decode-ahead thread when audio packets are queued or samples are played out
+static struct {
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+	int pending;
+} audio_wake;
 float deltaAudioQ;
 float deltaAudioQError;
 
@@ -92,11 +124,21 @@ char VideoFrameSkipRateLogFilename[256];
 long int decoded_vframes;
 long int LastSavedVFrame;
 
+//after a zap, video frames are dropped until the first I frame (type 1) arrives
+int WaitingKeyframe;
+int ZapSkippedFrames;
+Uint32 ZapStartTicks; //0 once the first picture is shown
+//bumped by ChunkerPlayerCore_FlushDecoders, the decoding threads flush their decoder when it changes
+static volatile unsigned int decoder_flushes;
+
 void SaveFrame(AVFrame *pFrame, int width, int height);
 int VideoCallback(void *valthread);
+int VideoDecodeThread(void *valthread);
+int AudioDecodeAheadThread(void *params);
 int CollectStatisticsThread(void *params);
 void AudioCallback(void *userdata, Uint8 *stream, int len);
 void PacketQueueClearStats(PacketQueue *q);
+static void AudioDecodeAheadWake();
 
 //int lastCheckedVideoFrame = -1;
 long int last_video_frame_extracted = -1;
@@ -126,19 +168,80 @@ int timeval_subtract(struct timeval* x, struct timeval* y, struct timeval* resul
 }
 
 
+/*
+ * payload of a received chunk, shared by all the packets of its frames.
+ * each queued packet holds a reference, released by av_free_packet through
+ * the packet destructor, so that the frames are not copied one by one
+ */
+typedef struct ChunkBuffer {
+	volatile int refcnt;
+	uint8_t *data;
+} ChunkBuffer;
+
+ChunkBuffer *ChunkBufferCreate(const uint8_t *payload, int size)
+{
+	//decoders may read a bit past the end of the last frame
+	ChunkBuffer *cb = av_malloc(sizeof(ChunkBuffer) + size + FF_INPUT_BUFFER_PADDING_SIZE);
+	if(!cb)
+		return NULL;
+	cb->refcnt = 1;
+	cb->data = (uint8_t *)(cb + 1);
+	memcpy(cb->data, payload, size);
+	memset(cb->data + size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+	return cb;
+}
+
+void ChunkBufferUnref(ChunkBuffer *cb)
+{
+	if(__sync_sub_and_fetch(&cb->refcnt, 1) == 0)
+		av_free(cb);
+}
+
+static void ChunkBufferDestructPacket(AVPacket *pkt)
+{
+	ChunkBufferUnref((ChunkBuffer *)pkt->priv);
+	pkt->data = NULL;
+	pkt->size = 0;
+	pkt->priv = NULL;
+}
+
+/*
+ * let pkt reference its data inside cb: with a destructor set,
+ * av_dup_packet leaves the data where it is
+ */
+void ChunkBufferRefPacket(ChunkBuffer *cb, AVPacket *pkt)
+{
+	__sync_add_and_fetch(&cb->refcnt, 1);
+	pkt->priv = cb;
+	pkt->destruct = ChunkBufferDestructPacket;
+}
+
 void PacketQueueInit(PacketQueue *q, short int Type)
 {
+	//the ring is kept across channel switches, it is empty after the reset on stop
+	AVPacket *ring = q->ring;
+	int ring_mask = q->ring_mask;
+	PcmRing *pcm = q->pcm;
 #ifdef DEBUG_QUEUE
 	printf("QUEUE: INIT BEGIN: NPackets=%d Type=%s\n", q->nb_packets, (q->queueType==AUDIO) ? "AUDIO" : "VIDEO");
 #endif
 	memset(q,0,sizeof(PacketQueue));
+	if(!ring) {
+		ring_mask = PACKET_QUEUE_INITIAL_RING_SIZE - 1;
+		ring = av_mallocz(sizeof(AVPacket) * (ring_mask + 1));
+		if(!ring) {
+			fprintf(stderr, "QUEUE: cannot allocate packet ring\n");
+			exit(1);
+		}
+	}
+	q->ring = ring;
+	q->ring_mask = ring_mask;
+	q->pcm = pcm;
 	q->mutex = SDL_CreateMutex();
 	QueueFillingMode=1;
 	q->queueType=Type;
 	q->last_frame_extracted = -1;
-	q->first_pkt= NULL;
-	q->minpts_pkt= NULL;
-	//q->last_pkt = NULL;
+	q->first_index = q->last_index = 0;
 	q->nb_packets = 0;
 	q->size = 0;
 	q->density= 0.0;
@@ -154,38 +257,41 @@ void PacketQueueInit(PacketQueue *q, short int Type)
 #endif
 }
 
-void PacketQueueReset(PacketQueue *q)
+/* to be called with the queue mutex held */
+static void PacketQueueResetLocked(PacketQueue *q)
 {
-	AVPacketList *tmp,*tmp1;
+	int i;
 #ifdef DEBUG_QUEUE
 	printf("QUEUE: RESET BEGIN: NPackets=%d Type=%s LastExtr=%d\n", q->nb_packets, (q->queueType==AUDIO) ? "AUDIO" : "VIDEO", q->last_frame_extracted);
 #endif
-	SDL_LockMutex(q->mutex);
 
-	tmp = q->first_pkt;
-	while(tmp) {
-		tmp1 = tmp;
-		tmp = tmp->next;
-		av_free_packet(&(tmp1->pkt));
-		av_free(tmp1);
+	for(i = q->first_index; q->nb_packets > 0 && i <= q->last_index; i++) {
+		AVPacket *slot = &q->ring[i & q->ring_mask];
+		if(slot->data) {
+			av_free_packet(slot);
+			slot->data = NULL;
+			q->nb_packets--;
 #ifdef DEBUG_QUEUE
-		printf("F ");
+			printf("F ");
 #endif
-		q->PacketHistory.LostCount++;
+			q->PacketHistory.LostCount++;
+		}
 	}
 #ifdef DEBUG_QUEUE
 	printf("\n");
 #endif
 
+	//the samples decoded from packets taken out before now are dropped by the reader
+	if(q->pcm)
+		PcmRingReset(q->pcm);
+
 	QueueFillingMode=1;
 	q->last_frame_extracted = -1;
 	
 	// on queue reset do not reset loss count
 	// (loss count reset is done on queue init, ie channel switch)
 	q->density=0.0;
-	q->first_pkt= NULL;
-	q->minpts_pkt= NULL;
-	//q->last_pkt = NULL;
+	q->first_index = q->last_index = 0;
 	q->nb_packets = 0;
 	q->size = 0;
 	FirstTime = 1;
@@ -195,7 +301,86 @@ void PacketQueueReset(PacketQueue *q)
 #ifdef DEBUG_QUEUE
 	printf("QUEUE: RESET END: NPackets=%d Type=%s LastExtr=%d\n", q->nb_packets, (q->queueType==AUDIO) ? "AUDIO" : "VIDEO", q->last_frame_extracted);
 #endif
+}
+
+void PacketQueueReset(PacketQueue *q)
+{
+	SDL_LockMutex(q->mutex);
+	PacketQueueResetLocked(q);
+	SDL_UnlockMutex(q->mutex);
+}
+
+/*
+ * make the ring large enough to hold frames first..last,
+ * moving the queued packets to their slot in the new ring
+ */
+static int PacketQueueGrowRing(PacketQueue *q, int first, int last)
+{
+	int new_size = q->ring_mask + 1;
+	int new_mask, i;
+	AVPacket *ring;
+
+	while(last - first >= new_size)
+		new_size *= 2;
+	new_mask = new_size - 1;
+	ring = av_mallocz(sizeof(AVPacket) * new_size);
+	if(!ring)
+		return -1;
+	for(i = q->first_index; q->nb_packets > 0 && i <= q->last_index; i++) {
+		if(q->ring[i & q->ring_mask].data)
+			ring[i & new_mask] = q->ring[i & q->ring_mask];
+	}
+	av_free(q->ring);
+	q->ring = ring;
+	q->ring_mask = new_mask;
+#ifdef DEBUG_QUEUE
+	printf("QUEUE: %s ring grown to %d slots\n", (q->queueType==AUDIO) ? "AUDIO" : "VIDEO", new_size);
+#endif
+	return 0;
+}
+
+/* head of the queue, NULL if empty */
+AVPacket *PacketQueueFirst(PacketQueue *q)
+{
+	return q->nb_packets > 0 ? &q->ring[q->first_index & q->ring_mask] : NULL;
+}
+
+/* packet with the highest frame number, NULL if empty */
+AVPacket *PacketQueueLast(PacketQueue *q)
+{
+	return q->nb_packets > 0 ? &q->ring[q->last_index & q->ring_mask] : NULL;
+}
+
+/*
+ * pts and frame numbers of the head and of the last packet, copied under the
+ * lock for the threads that do not own the queue: a put may grow the ring and
+ * free the old one. returns the number of queued packets, nothing is set if 0
+ */
+static int PacketQueueBounds(PacketQueue *q, int64_t *first_pts, int64_t *last_pts, int *first_index, int *last_index)
+{
+	int nb_packets;
+
+	SDL_LockMutex(q->mutex);
+	nb_packets = q->nb_packets;
+	if(nb_packets > 0) {
+		*first_pts = PacketQueueFirst(q)->pts;
+		*last_pts = PacketQueueLast(q)->pts;
+		*first_index = PacketQueueFirst(q)->stream_index;
+		*last_index = PacketQueueLast(q)->stream_index;
+	}
 	SDL_UnlockMutex(q->mutex);
+	return nb_packets;
+}
+
+/* the queued packet following pkt in frame number order, NULL if none */
+AVPacket *PacketQueueNext(PacketQueue *q, AVPacket *pkt)
+{
+	int i;
+	for(i = pkt->stream_index + 1; i <= q->last_index; i++) {
+		if(q->ring[i & q->ring_mask].data)
+			return &q->ring[i & q->ring_mask];
+	}
+	return NULL;
 }
 
 void PacketQueueClearStats(PacketQueue *q)
@@ -216,9 +401,10 @@ void PacketQueueClearStats(PacketQueue *q)
 int ChunkerPlayerCore_PacketQueuePut(PacketQueue *q, AVPacket *pkt)
 {
 	//~ printf("\tSTREAM_INDEX=%d\n", pkt->stream_index);
-	short int skip = 0;
-	AVPacketList *pkt1, *tmp, *prevtmp;
+	int index = pkt->stream_index;
+	AVPacket *slot;
 	int res = 0;
+	int wake = 0;
 
 	if(q->nb_packets > queue_filling_threshold*QUEUE_MAX_GROW_FACTOR) {
 #ifdef DEBUG_QUEUE
@@ -232,16 +418,9 @@ int ChunkerPlayerCore_PacketQueuePut(PacketQueue *q, AVPacket *pkt)
 #ifdef DEBUG_QUEUE
 		printf("QUEUE: PUT in Queue cannot duplicate in packet	: NPackets=%d Type=%s\n",q->nb_packets, (q->queueType==AUDIO) ? "AUDIO" : "VIDEO");
 #endif
-		return -1;
-	}
-	pkt1 = av_malloc(sizeof(AVPacketList));
-
-	if(!pkt1) {
 		av_free_packet(pkt);
 		return -1;
 	}
-	pkt1->pkt = *pkt;
-	pkt1->next = NULL;
 	
 	static time_t last_auto_switch = 0;
 
@@ -256,100 +435,232 @@ int ChunkerPlayerCore_PacketQueuePut(PacketQueue *q, AVPacket *pkt)
 		SDL_LockMutex(q->mutex);
 		ReTune(&(Channels[SelectedChannel]));
 		SDL_UnlockMutex(q->mutex);
+		av_free_packet(pkt);
 	}
 
 	else
 	{
 		SDL_LockMutex(q->mutex);
 
-		// INSERTION SORT ALGORITHM
 		// before inserting pkt, check if pkt.stream_index is <= current_extracted_frame.
-		if(pkt->stream_index > q->last_frame_extracted)
+		if(index > q->last_frame_extracted)
 		{
-			// either checking starting from the first_pkt or needed other struct like AVPacketList with next and prev....
-			//if (!q->last_pkt)
-			if(!q->first_pkt) {
-				q->first_pkt = pkt1;
-				q->last_pkt = pkt1;
+			int first = q->nb_packets ? MIN(q->first_index, index) : index;
+			int last = q->nb_packets ? MAX(q->last_index, index) : index;
+
+			//the queue would span more frames than it may ever hold: start over, as when it has too many packets
+			if(last - first >= queue_filling_threshold*QUEUE_MAX_GROW_FACTOR) {
+#ifdef DEBUG_QUEUE
+				printf("QUEUE: PUT frames %d..%d do not fit Type=%s, RESETTING\n", first, last, (q->queueType==AUDIO) ? "AUDIO" : "VIDEO");
+#endif
+				PacketQueueResetLocked(q);
+				first = last = index;
 			}
-			else if(pkt->stream_index < q->first_pkt->pkt.stream_index) {
-				//the packet that has arrived is earlier than the first we got some time ago!
-				//we need to put it at the head of the queue
-				pkt1->next = q->first_pkt;
-				q->first_pkt = pkt1;
+			if(last - first > q->ring_mask && PacketQueueGrowRing(q, first, last) < 0) {
+				av_free_packet(pkt);
+				SDL_UnlockMutex(q->mutex);
+				return -1;
 			}
-			else {
-				tmp = q->first_pkt;
-				while(tmp->pkt.stream_index < pkt->stream_index) {
-					prevtmp = tmp;
-					tmp = tmp->next;
 
-					if(!tmp) {
-						break;
-					}
-				}
-				if(tmp && tmp->pkt.stream_index == pkt->stream_index) {
-					//we already have a frame with that index
-					skip = 1;
+			slot = &q->ring[index & q->ring_mask];
+			if(q->nb_packets && slot->data) {
+				//we already have a frame with that index
+				av_free_packet(pkt);
 #ifdef DEBUG_QUEUE
-					printf("%s QUEUE: PUT: we already have frame with index %d, skipping\n", ((q->queueType == AUDIO) ? "AUDIO" : "VIDEO"), pkt->stream_index);
+				printf("%s QUEUE: PUT: we already have frame with index %d, skipping\n", ((q->queueType == AUDIO) ? "AUDIO" : "VIDEO"), index);
 #endif
-				}
-				else {
-					prevtmp->next = pkt1;
-					pkt1->next = tmp;
-					if(pkt1->next == NULL)
-						q->last_pkt = pkt1;
-				}
-				//q->last_pkt->next = pkt1; // It was uncommented when not insertion sort
 			}
-			if(skip == 0) {
-				//q->last_pkt = pkt1;
+			else {
+				*slot = *pkt;
+				q->first_index = first;
+				q->last_index = last;
 				q->nb_packets++;
-				q->size += pkt1->pkt.size;
+				q->size += slot->size;
+				wake = q->queueType == AUDIO;
 				if(q->nb_packets>=queue_filling_threshold && QueueFillingMode) // && q->queueType==AUDIO)
 				{
 					QueueFillingMode=0;
+					wake = 1;
 #ifdef DEBUG_QUEUE
 					printf("QUEUE: PUT: FillingMode set to zero\n");
 #endif
 				}
-				//set min
-				if (!q->minpts_pkt || (pkt1->pkt.pts < q->minpts_pkt->pts)) {
-					q->minpts_pkt = &(pkt1->pkt);
-				}
 			}
 		}
 		else {
-			av_free_packet(&pkt1->pkt);
-			av_free(pkt1);
+			av_free_packet(pkt);
 #ifdef DEBUG_QUEUE
-			printf("QUEUE: PUT: NOT inserting because index %d <= last extracted %d\n", pkt->stream_index, q->last_frame_extracted);
+			printf("QUEUE: PUT: NOT inserting because index %d <= last extracted %d\n", index, q->last_frame_extracted);
 #endif
 			res = 1;
 		}
 		SDL_UnlockMutex(q->mutex);
+		if(wake)
+			AudioDecodeAheadWake();
 	}
 
 	return res;
 }
 
-int OpenACodec (char *audio_codec, int sample_rate, short int audio_channels)
+/*
+ * opened decoders, kept across channel switches: a switch to a channel with the
+ * same codec parameters flushes a cached context instead of opening a new one
+ */
+typedef struct CodecCacheEntry {
+	AVCodecContext *ctx;
+	char codec[255];
+	int width, height; //video
+	int sample_rate, channels; //audio
+	int in_use;
+	unsigned int last_used;
+} CodecCacheEntry;
+
+static CodecCacheEntry codec_cache[CODEC_CACHE_SIZE];
+static unsigned int codec_cache_clock = 0;
+static int codec_cache_hits = 0, codec_cache_misses = 0;
+static SDL_mutex *codec_cache_mutex = NULL;
+
+static AVCodecContext *OpenDecoder(const char *codec_name, int width, int height, int sample_rate, int channels)
 {
-	AVCodec *aCodec;
-
-	aCodecCtx = avcodec_alloc_context();
-	//aCodecCtx->bit_rate = 64000;
-	aCodecCtx->sample_rate = sample_rate;
-	aCodecCtx->channels = audio_channels;
-	aCodec = avcodec_find_decoder_by_name(audio_codec);
-	if(!aCodec) {
-		printf("Codec not found!\n");
-		return -1;
+	AVCodec *codec;
+	AVCodecContext *ctx;
+
+	codec = avcodec_find_decoder_by_name(codec_name);
+	if(!codec) {
+		fprintf(stderr, "INIT: Unknown codec: %s!\n", codec_name);
+		return NULL;
+	}
+	ctx = avcodec_alloc_context();
+	if(!ctx) {
+		printf("Memory error!!!\n");
+		return NULL;
+	}
+	ctx->codec_type = codec->type;
+	ctx->codec_id = codec->id;
+	if(codec->type == CODEC_TYPE_VIDEO) {
+		// resolution must be a multiple of two
+		ctx->width = width;
+		ctx->height = height;
+		ctx->pix_fmt = PIX_FMT_YUV420P;
+		if(decoder_threads > 1) {
+#ifdef FF_THREAD_FRAME
+			ctx->thread_count = decoder_threads;
+			ctx->thread_type = decoder_slice_threads ? FF_THREAD_SLICE : FF_THREAD_FRAME;
+#else
+			//no frame threading in this libavcodec
+			avcodec_thread_init(ctx, decoder_threads);
+#endif
+		}
+	} else {
+		ctx->sample_rate = sample_rate;
+		ctx->channels = channels;
 	}
-	if(avcodec_open(aCodecCtx, aCodec)<0) {
+	if(avcodec_open(ctx, codec) < 0) {
 		fprintf(stderr, "could not open codec\n");
-		return -1; // Could not open codec
+		av_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+/* get an opened decoder, from the cache if possible */
+AVCodecContext *CodecCacheGet(const char *codec_name, int width, int height, int sample_rate, int channels)
+{
+	CodecCacheEntry *e, *slot = NULL;
+	AVCodecContext *ctx;
+	int i;
+
+	SDL_LockMutex(codec_cache_mutex);
+	codec_cache_clock++;
+	for(i = 0; i < CODEC_CACHE_SIZE; i++) {
+		e = &codec_cache[i];
+		if(e->ctx && !e->in_use && !strcmp(e->codec, codec_name) && e->width == width && e->height == height
+		   && e->sample_rate == sample_rate && e->channels == channels) {
+			e->in_use = 1;
+			e->last_used = codec_cache_clock;
+			codec_cache_hits++;
+			SDL_UnlockMutex(codec_cache_mutex);
+			//forget the pictures/samples of the previous channel
+			avcodec_flush_buffers(e->ctx);
+			return e->ctx;
+		}
+	}
+	codec_cache_misses++;
+
+	ctx = OpenDecoder(codec_name, width, height, sample_rate, channels);
+	if(!ctx) {
+		SDL_UnlockMutex(codec_cache_mutex);
+		return NULL;
+	}
+	//take a free slot, or the least recently used idle one
+	for(i = 0; i < CODEC_CACHE_SIZE; i++) {
+		e = &codec_cache[i];
+		if(e->in_use)
+			continue;
+		if(!e->ctx) {
+			slot = e;
+			break;
+		}
+		if(!slot || e->last_used < slot->last_used)
+			slot = e;
+	}
+	//all contexts in use: this one is closed on release
+	if(slot) {
+		if(slot->ctx) {
+			avcodec_close(slot->ctx);
+			av_free(slot->ctx);
+		}
+		slot->ctx = ctx;
+		snprintf(slot->codec, sizeof(slot->codec), "%s", codec_name);
+		slot->width = width;
+		slot->height = height;
+		slot->sample_rate = sample_rate;
+		slot->channels = channels;
+		slot->in_use = 1;
+		slot->last_used = codec_cache_clock;
+	}
+	SDL_UnlockMutex(codec_cache_mutex);
+	return ctx;
+}
+
+void CodecCacheRelease(AVCodecContext *ctx)
+{
+	int i;
+
+	if(!ctx)
+		return;
+	SDL_LockMutex(codec_cache_mutex);
+	for(i = 0; i < CODEC_CACHE_SIZE; i++) {
+		if(codec_cache[i].ctx == ctx) {
+			codec_cache[i].in_use = 0;
+			SDL_UnlockMutex(codec_cache_mutex);
+			return;
+		}
+	}
+	SDL_UnlockMutex(codec_cache_mutex);
+	avcodec_close(ctx);
+	av_free(ctx);
+}
+
+void CodecCacheFree()
+{
+	int i;
+
+	for(i = 0; i < CODEC_CACHE_SIZE; i++) {
+		if(codec_cache[i].ctx) {
+			avcodec_close(codec_cache[i].ctx);
+			av_free(codec_cache[i].ctx);
+		}
+	}
+	memset(codec_cache, 0, sizeof(codec_cache));
+	printf("CODEC-CACHE: %d decoders reused, %d opened\n", codec_cache_hits, codec_cache_misses);
+}
+
+int OpenACodec (char *audio_codec, int sample_rate, short int audio_channels)
+{
+	aCodecCtx = CodecCacheGet(audio_codec, 0, 0, sample_rate, audio_channels);
+	if(!aCodecCtx) {
+		return -1;
 	}
 	printf("using audio Codecid: %d ",aCodecCtx->codec_id);
 	printf("samplerate: %d ",aCodecCtx->sample_rate);
@@ -358,15 +669,14 @@ int OpenACodec (char *audio_codec, int sample_rate, short int audio_channels)
 	return 1;
 }
 
+//spec the audio device is open with, if audio_open
+static SDL_AudioSpec audio_spec;
+static int audio_open = 0;
+
 int OpenAudio(AVCodecContext  *aCodecCtx)
 {
-	SDL_AudioSpec *wanted_spec;
-	static SDL_AudioSpec *wanted_spec_old = NULL;
+	SDL_AudioSpec wanted_spec_s, *wanted_spec = &wanted_spec_s;
 
-	if (! (wanted_spec = malloc(sizeof(*wanted_spec)))) {
-		perror("error initializing audio");
-		return -1;
-	}
 	wanted_spec->freq = aCodecCtx->sample_rate;
 	wanted_spec->format = AUDIO_S16SYS;
 	wanted_spec->channels = aCodecCtx->channels;
@@ -383,26 +693,23 @@ int OpenAudio(AVCodecContext  *aCodecCtx)
 	printf("wanted samples:%d\n",wanted_spec->samples);
 #endif
 
-	if (wanted_spec_old && 
-	   (wanted_spec->freq == wanted_spec_old->freq) &&
-	   (wanted_spec->channels == wanted_spec_old->channels)) {	//do not reinit audio if the wanted specification is the same as before
+	if (audio_open &&
+	   (wanted_spec->freq == audio_spec.freq) &&
+	   (wanted_spec->channels == audio_spec.channels)) {	//do not reinit audio if the wanted specification is the same as before
 		return 1;
 	}
 
-	if(wanted_spec_old) {
+	if(audio_open) {
 		SDL_CloseAudio();
+		audio_open = 0;
 	}
 
-	if (! (wanted_spec_old = malloc(sizeof(*wanted_spec_old)))) {
-		perror("error initializing audio");
-		return -1;
-	}
-	memcpy(wanted_spec_old, wanted_spec, sizeof(*wanted_spec));
-
 	if (SDL_OpenAudio(wanted_spec,NULL)<0) {
 		fprintf(stderr,"SDL_OpenAudio: %s\n", SDL_GetError());
 		return -1;
 	}
+	audio_spec = *wanted_spec;
+	audio_open = 1;
 
 	CurrentAudioFreq = wanted_spec->freq;
 	CurrentAudioSamples = wanted_spec->samples;
@@ -427,7 +734,6 @@ int ChunkerPlayerCore_InitAudioCodecs(char *audio_codec, int sample_rate, short
 {
 	// some initializations
 	QueueStopped = 0;
-	AudioQueueOffset=0;
 	AVPlaying = 0;
 	GotSigInt = 0;
 	FirstTimeAudio=1;
@@ -448,11 +754,11 @@ int ChunkerPlayerCore_InitAudioCodecs(char *audio_codec, int sample_rate, short
 	//initialize the audio queue
 	PacketQueueInit(&audioq, AUDIO);
 	
-	// Init audio buffers
-	av_init_packet(&AudioPkt);
-	//printf("AVCODEC_MAX_AUDIO_FRAME_SIZE=%d\n", AVCODEC_MAX_AUDIO_FRAME_SIZE);
-	AudioPkt.data=(uint8_t *)malloc(AVCODEC_MAX_AUDIO_FRAME_SIZE);
-	if(!AudioPkt.data) return -1;
+	// Init the decoded audio ring: the look-ahead plus room for one more decoded frame
+	pcm_lookahead_bytes = (int)(audio_lookahead_ms * (dimAudioQ / deltaAudioQ));
+	PcmRingDestroy(audioq.pcm);
+	audioq.pcm = PcmRingCreate(pcm_lookahead_bytes + AVCODEC_MAX_AUDIO_FRAME_SIZE, PCM_RING_SEGMENTS);
+	if(!audioq.pcm) return -1;
 
 	return 0;
 }
@@ -486,6 +792,12 @@ int ChunkerPlayerCore_InitCodecs(char *v_codec, int width, int height, char *aud
 	av_log_set_level(AV_LOG_WARNING);
 	avcodec_init();
 	av_register_all();
+	if(!codec_cache_mutex)
+		codec_cache_mutex = SDL_CreateMutex();
+	if(!audio_wake.mutex) {
+		audio_wake.mutex = SDL_CreateMutex();
+		audio_wake.cond = SDL_CreateCond();
+	}
 
 	if (ChunkerPlayerCore_InitAudioCodecs(audio_codec, sample_rate, audio_channels) < 0) {
 		return -1;
@@ -497,130 +809,166 @@ int ChunkerPlayerCore_InitCodecs(char *v_codec, int width, int height, char *aud
 
 	av_log_set_level(AV_LOG_FATAL);
 
+	WaitingKeyframe = 1;
+	ZapSkippedFrames = 0;
+	ZapStartTicks = SDL_GetTicks();
+
 	sprintf(audio_stats, "waiting for incoming audio packets...");
 	sprintf(video_stats, "waiting for incoming video packets...");
 	ChunkerPlayerGUI_SetStatsText(audio_stats, video_stats,qoe_led ? LED_GREEN : LED_NONE);
 }
 
-int DecodeEnqueuedAudio(AVPacket *pkt, PacketQueue *q, int* size)
+/*
+ * decode a compressed audio packet into buf, AVCODEC_MAX_AUDIO_FRAME_SIZE bytes long
+ * returns the decoded size, 0 if it was not possible to decode the packet
+ */
+int DecodeEnqueuedAudio(AVPacket *pkt, int16_t *buf)
 {
-	uint16_t *audio_bufQ = NULL;
-	int16_t *dataQ = NULL;
 	int data_sizeQ = AVCODEC_MAX_AUDIO_FRAME_SIZE;
 	int lenQ;
-	int ret = 0;
 
-	//set the flag to decoded anyway	
-	pkt->convergence_duration = -1;
-
-	audio_bufQ = (uint16_t *)av_malloc(AVCODEC_MAX_AUDIO_FRAME_SIZE);
-	if(audio_bufQ) {
-#ifdef DEBUG_AUDIO_BUFFER
-		printf("AUDIO_BUFFER: about to decode packet %d, size %d, data %d\n", pkt->stream_index, pkt->size, pkt->data);
-#endif
-		//decode the packet data
-		lenQ = avcodec_decode_audio3(aCodecCtx, (int16_t *)audio_bufQ, &data_sizeQ, pkt);
-		if(lenQ > 0) {
-			dataQ = (int16_t *)av_malloc(data_sizeQ); //this will be free later at the time of playback
-			if(dataQ) {
-				memcpy(dataQ, audio_bufQ, data_sizeQ);
-				if(pkt->data != NULL)
-				{
-					//discard the old encoded bytes
-					av_free(pkt->data);
-				}
-				//subtract them from queue size
-				q->size -= pkt->size;
-				*size = pkt->size;
-				pkt->data = (uint8_t *)dataQ;
-				pkt->size = data_sizeQ;
-				//add new size to queue size
-				q->size += pkt->size;
-				ret = 1;
-			}
-			else {
 #ifdef DEBUG_AUDIO_BUFFER
-				printf("AUDIO_BUFFER: cannot alloc space for decoded packet %d\n", pkt->stream_index);
+	printf("AUDIO_BUFFER: about to decode packet %d, size %d\n", pkt->stream_index, pkt->size);
 #endif
-			}
-		}
-		else {
+	//decode the packet data
+	lenQ = avcodec_decode_audio3(aCodecCtx, buf, &data_sizeQ, pkt);
+	if(lenQ <= 0) {
 #ifdef DEBUG_AUDIO_BUFFER
-			printf("AUDIO_BUFFER: cannot decode packet %d\n", pkt->stream_index);
+		printf("AUDIO_BUFFER: cannot decode packet %d\n", pkt->stream_index);
 #endif
-		}
-		av_free(audio_bufQ);
+		return 0;
 	}
-	else {
-#ifdef DEBUG_AUDIO_BUFFER
-		printf("AUDIO_BUFFER: cannot alloc decode buffer for packet %d\n", pkt->stream_index);
-#endif
-	}
-	return ret; //problems occurred
+	return data_sizeQ;
 }
 
 /**
- * removes a packet from the list and returns the next
+ * removes a packet from the queue and returns the next
  * */
-AVPacketList *RemoveFromQueue(PacketQueue *q, AVPacketList *p)
+AVPacket *RemoveFromQueue(PacketQueue *q, AVPacket *p)
 {
-	AVPacketList *p1;
-
-	if (q->first_pkt == p) {
-		q->first_pkt = p->next;
-	}
-	if (&(p->pkt) == q->minpts_pkt) {
-		q->minpts_pkt = NULL;
-	}
+	int index = p->stream_index;
+	AVPacket *retpk = PacketQueueNext(q, p);
 
-	AVPacketList *retpk = p->next;
 	q->nb_packets--;
 	//adjust size here and not in the various cases of the dequeue
-	q->size -= p->pkt.size;
-	if(&p->pkt)
-	{
-		av_free_packet(&p->pkt);
+	q->size -= p->size;
+	av_free_packet(p);
+	p->data = NULL;
+
+	//move head and tail past the hole, nothing to move once empty
+	if (q->nb_packets == 0) {
+		return retpk;
 	}
-	if(p) {
-		av_free(p);
+	if (index == q->first_index) {
+		q->first_index = retpk->stream_index;
 	}
-
-	//updating min info
-	for (p1 = q->first_pkt; p1; p1 = p1->next) {
-		if (!q->minpts_pkt || p1->pkt.pts < q->minpts_pkt->pts) {
-			q->minpts_pkt = &(p1->pkt);
-		}
+	else if (index == q->last_index) {
+		while (!q->ring[--q->last_index & q->ring_mask].data);
 	}
 
 	return retpk;
 }
 
-AVPacketList *SeekAndDecodePacketStartingFrom(AVPacketList *p, PacketQueue *q, int* size)
+static void AudioDecodeAheadWake()
+{
+	if(!audio_wake.mutex)
+		return;
+	SDL_LockMutex(audio_wake.mutex);
+	audio_wake.pending = 1;
+	SDL_CondSignal(audio_wake.cond);
+	SDL_UnlockMutex(audio_wake.mutex);
+}
+
+/* sleep until there may be work for the decode-ahead thread. the timeout only covers stop and quit */
+static void AudioDecodeAheadWait()
+{
+	SDL_LockMutex(audio_wake.mutex);
+	if(!audio_wake.pending)
+		SDL_CondWaitTimeout(audio_wake.cond, audio_wake.mutex, 100);
+	audio_wake.pending = 0;
+	SDL_UnlockMutex(audio_wake.mutex);
+}
+
+/*
+ * keeps pcm_lookahead_bytes of decoded audio in the pcm ring of the audio
+ * queue, so that the SDL audio callback only copies samples and never
+ * runs the decoder
+ */
+int AudioDecodeAheadThread(void *params)
 {
-	while(p) {
-			//check if audio packet has been already decoded
-			if(p->pkt.convergence_duration == 0) {
-				//not decoded yet, try to decode it
-				if( !DecodeEnqueuedAudio(&(p->pkt), q, size) ) {
-					//it was not possible to decode this packet, return next one
-					p = RemoveFromQueue(q, p);
+	int16_t *buf = av_malloc(AVCODEC_MAX_AUDIO_FRAME_SIZE);
+	AVPacket work, *p;
+	unsigned int generation;
+	unsigned int flushes = decoder_flushes;
+	int data_size;
+
+	if(!buf) {
+		fprintf(stderr, "AUDIO: cannot alloc decode buffer\n");
+		return -1;
+	}
+
+	while(AVPlaying && !quit) {
+		if(flushes != decoder_flushes) {
+			flushes = decoder_flushes;
+			avcodec_flush_buffers(aCodecCtx);
+		}
+		p = NULL;
+		SDL_LockMutex(audioq.mutex);
+		if(!QueueFillingMode && !QueueStopped && PcmRingBytes(audioq.pcm) < pcm_lookahead_bytes)
+			p = PacketQueueFirst(&audioq);
+		if(p) {
+			//work on a private reference, the queue slot is freed right away
+			work = *p;
+			if(work.destruct == ChunkBufferDestructPacket)
+				ChunkBufferRefPacket((ChunkBuffer *)work.priv, &work);
+			else {
+				//av_dup_packet leaves a packet that already owns its data alone, and the slot frees it
+				work.data = av_malloc(p->size + FF_INPUT_BUFFER_PADDING_SIZE);
+				if(work.data) {
+					memcpy(work.data, p->data, p->size);
+					memset(work.data + p->size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
 				}
-				else
-					return p;
+				work.destruct = av_destruct_packet;
+				work.priv = NULL;
 			}
-			else
-				return p;
+			generation = PcmRingGeneration(audioq.pcm);
+			RemoveFromQueue(&audioq, p);
+			//update index of last frame extracted
+			audioq.last_frame_extracted = work.stream_index;
+		}
+		SDL_UnlockMutex(audioq.mutex);
+
+		if(!p) {
+			AudioDecodeAheadWait();
+			continue;
+		}
+		if(!work.data)
+			continue;
+
+		data_size = DecodeEnqueuedAudio(&work, buf);
+
+		//no queue lock, the ring is shared with the audio callback only.
+		//if the queue has been reset meanwhile the ring leaves these samples out
+		if(data_size > 0) {
+			if(PcmRingWrite(audioq.pcm, (uint8_t *)buf, data_size, work.pts, work.stream_index, work.size, generation) < 0)
+				ChunkerPlayerStats_UpdateAudioSkipHistory(&(audioq.PacketHistory), work.stream_index, work.size);
+		}
+		av_free_packet(&work);
 	}
-	return NULL;
+
+	av_free(buf);
+	return 0;
 }
 
-int PacketQueueGet(PacketQueue *q, AVPacket *pkt, short int av, int* size)
+/*
+ * dequeue the first video packet. audio is played out of the pcm ring
+ * of the audio queue, filled by AudioDecodeAheadThread
+ */
+int PacketQueueGet(PacketQueue *q, AVPacket *pkt)
 {
 	//AVPacket tmp;
-	AVPacketList *pkt1 = NULL;
+	AVPacket *pkt1 = NULL;
 	int ret=-1;
-	int SizeToCopy=0;
-	int reqsize;
 
 	SDL_LockMutex(q->mutex);
 
@@ -634,89 +982,37 @@ int PacketQueueGet(PacketQueue *q, AVPacket *pkt, short int av, int* size)
 		return -1;
 	}
 
-	if(av==1) { //somebody requested an audio packet, q is the audio queue
-		reqsize = dimAudioQ; //TODO pass this as parameter, not garanteed by SDL to be exactly dimAudioQ
-		pkt->size = 0;
-		pkt->dts = 0;
-		pkt->pts = 0;
-		//try to dequeue the first packet of the audio queue
-		pkt1 = q->first_pkt;
-		while (pkt->size < reqsize && pkt1 && SeekAndDecodePacketStartingFrom(pkt1, q, size)) {
-			AVPacketList *next = pkt1->next;	//save it here since we could delete pkt1 later
-			if (!pkt->dts) pkt->dts = pkt1->pkt.dts;
-			if (!pkt->pts) pkt->pts = pkt1->pkt.pts;
-			pkt->stream_index = pkt1->pkt.stream_index;
-			pkt->flags = 1;
-			pkt->pos = -1;
-			pkt->convergence_duration = -1;
-			if (pkt1->pkt.size - AudioQueueOffset <= reqsize - pkt->size) { //we need the whole packet
-				SizeToCopy = pkt1->pkt.size - AudioQueueOffset;	//packet might be partial
-				memcpy(pkt->data + pkt->size, pkt1->pkt.data + AudioQueueOffset, SizeToCopy);
-				pkt->size += SizeToCopy;
-				AudioQueueOffset = 0;
-				RemoveFromQueue(q, pkt1);
-			} else {
-				SizeToCopy = reqsize - pkt->size;	//partial packet remains
-				memcpy(pkt->data + pkt->size, pkt1->pkt.data + AudioQueueOffset, SizeToCopy);
-				pkt->size += SizeToCopy;
-				AudioQueueOffset += SizeToCopy;
-				pkt1->pkt.dts += SizeToCopy/(dimAudioQ/CurrentAudioSamples)/(CurrentAudioFreq/1000);
-				pkt1->pkt.pts += SizeToCopy/(dimAudioQ/CurrentAudioSamples)/(CurrentAudioFreq/1000);
-			}
-
-#ifdef DEBUG_AUDIO_BUFFER
-			printf("2: idx %d    \taqo %d    \tstc %d    \taqe %f    \tpsz %d\n", pkt1->pkt.stream_index, AudioQueueOffset, SizeToCopy, deltaAudioQError, pkt1->pkt.size);
-#endif
-
-			//update index of last frame extracted
-			//ChunkerPlayerStats_UpdateAudioLossHistory(&(q->PacketHistory), pkt->stream_index, q->last_frame_extracted);
-			q->last_frame_extracted = pkt->stream_index;
-
-			pkt1 = next;
-		}
-		ret = 1; //TODO: check some conditions
-	} else { //somebody requested a video packet, q is the video queue
-		pkt1 = q->first_pkt;
-		if(pkt1) {
-#ifdef DEBUG_QUEUE_DEEP
-			printf("  AV not 1\n");
-#endif
-			pkt->size = pkt1->pkt.size;
-			pkt->dts = pkt1->pkt.dts;
-			pkt->pts = pkt1->pkt.pts;
-			pkt->stream_index = pkt1->pkt.stream_index;
-			pkt->flags = pkt1->pkt.flags;
-			pkt->pos = pkt1->pkt.pos;
-			pkt->convergence_duration = pkt1->pkt.convergence_duration;
-			//*pkt = pkt1->pkt;
+	pkt1 = PacketQueueFirst(q);
+	if(pkt1) {
+		pkt->size = pkt1->size;
+		pkt->dts = pkt1->dts;
+		pkt->pts = pkt1->pts;
+		pkt->stream_index = pkt1->stream_index;
+		pkt->flags = pkt1->flags;
+		pkt->pos = pkt1->pos;
+		pkt->convergence_duration = pkt1->convergence_duration;
+		//*pkt = pkt1->pkt;
+		
+		if((pkt->data != NULL) && (pkt1->data != NULL))
+			memcpy(pkt->data, pkt1->data, pkt1->size);
 			
-			if((pkt->data != NULL) && (pkt1->pkt.data != NULL))
-				memcpy(pkt->data, pkt1->pkt.data, pkt1->pkt.size);
-				
-			//HINT SEE BEFORE q->size -= pkt1->pkt.size;
-			RemoveFromQueue(q, pkt1);
+		//HINT SEE BEFORE q->size -= pkt1->pkt.size;
+		RemoveFromQueue(q, pkt1);
 
-			ret = 1;
-			
-			ChunkerPlayerStats_UpdateVideoLossHistory(&(q->PacketHistory), pkt->stream_index, q->last_frame_extracted);
-			
-			//update index of last frame extracted
-			q->last_frame_extracted = pkt->stream_index;
-			last_video_frame_extracted = q->last_frame_extracted;
-		}
-#ifdef DEBUG_QUEUE
-		else {
-			printf("  VIDEO pk1 NULL!!!!\n");
-		}
-#endif
+		ret = 1;
+		
+		ChunkerPlayerStats_UpdateVideoLossHistory(&(q->PacketHistory), pkt->stream_index, q->last_frame_extracted);
+		
+		//update index of last frame extracted
+		q->last_frame_extracted = pkt->stream_index;
+		last_video_frame_extracted = q->last_frame_extracted;
 	}
-
-	if(q->nb_packets==0 && q->queueType==AUDIO) {
-		QueueFillingMode=1;
 #ifdef DEBUG_QUEUE
-		printf("QUEUE: Get FillingMode ON\n");
-#endif
+	else {
+		printf("  VIDEO pk1 NULL!!!!\n");
 	}
+#endif
+
 #ifdef DEBUG_QUEUE
 	printf("QUEUE: Get Last %s Frame Extracted = %d\n", (q->queueType==AUDIO) ? "AUDIO" : "VIDEO", q->last_frame_extracted);
 #endif
@@ -725,13 +1021,26 @@ int PacketQueueGet(PacketQueue *q, AVPacket *pkt, short int av, int* size)
 	return ret;
 }
 
-int AudioDecodeFrame(uint8_t *audio_buf, int buf_size) {
-	//struct timeval now;
-	int audio_pkt_size = 0;
-	int compressed_size = 0;
+/* stats for a segment that has been played up to its end */
+static void AudioSegmentPlayed(const PcmSegment *seg)
+{
+	ChunkerPlayerStats_UpdateAudioPlayedHistory(&(audioq.PacketHistory), seg->stream_index, seg->compressed_size);
+}
+
+/* timestamp of the next sample to be played out of a segment */
+static long long AudioSegmentPts(const PcmSegment *seg)
+{
+	return seg->pts + (long long)(seg->offset / (dimAudioQ / deltaAudioQ));
+}
+
+/*
+ * fill stream with the decoded samples due now.
+ * returns the bytes filled, -1 if the audio is not playing
+ */
+int AudioFillFromRing(uint8_t *stream, int len) {
+	int audio_size = 0;
 	long long Now;
-	short int DecodeAudio=0, SkipAudio=0;
-	//int len1, data_size;
+	PcmSegment *seg;
 
 	//gettimeofday(&now,NULL);
 	//Now = (now.tv_sec)*1000+now.tv_usec/1000;
@@ -746,11 +1055,14 @@ int AudioDecodeFrame(uint8_t *audio_buf, int buf_size) {
 		return -1;
 	}
 
-	if((FirstTime==1 || FirstTimeAudio==1) && audioq.size>0) {
-		if(audioq.first_pkt->pkt.pts>0)
+	//the pcm ring is read without the queue lock, the demux and decode-ahead threads hold it
+	seg = PcmRingFirst(audioq.pcm);
+
+	if((FirstTime==1 || FirstTimeAudio==1) && seg) {
+		if(seg->pts>0)
 		{
 			//SDL_LockMutex(timing_mutex);
-			DeltaTime=Now-(long long)(audioq.first_pkt->pkt.pts);
+			DeltaTime=Now-AudioSegmentPts(seg);
 			FirstTimeAudio = 0;
 			FirstTime = 0;
 			//SDL_UnlockMutex(timing_mutex);
@@ -761,72 +1073,49 @@ int AudioDecodeFrame(uint8_t *audio_buf, int buf_size) {
 	}
 
 #ifdef DEBUG_AUDIO 
-	if(audioq.first_pkt)
+	if(seg)
 	{
-		printf("AUDIO: audio_decode_frame - Syncro params: Delta:%lld Now:%lld pts=%lld pts+Delta=%lld ",(long long)DeltaTime,Now,(long long)audioq.first_pkt->pkt.pts,(long long)audioq.first_pkt->pkt.pts+DeltaTime);
+		printf("AUDIO: audio_decode_frame - Syncro params: Delta:%lld Now:%lld pts=%lld pts+Delta=%lld ",(long long)DeltaTime,Now,AudioSegmentPts(seg),AudioSegmentPts(seg)+DeltaTime);
 		printf("AUDIO: QueueLen=%d ",(int)audioq.nb_packets);
-		printf("AUDIO: QueueSize=%d\n",(int)audioq.size);
+		printf("AUDIO: RingBytes=%d\n",PcmRingBytes(audioq.pcm));
 	}
 	else
-		printf("AUDIO: audio_decode_frame - Empty queue\n");
+		printf("AUDIO: audio_decode_frame - Empty ring\n");
 #endif
 
-	if(audioq.nb_packets>0)
-	{
-		if((double)audioq.first_pkt->pkt.pts+DeltaTime<Now+deltaAudioQ)	//too late ... TODO: figure out the right number
-		{
-			SkipAudio = 1;
-			DecodeAudio = 0;
-		}
-		else if((double)audioq.first_pkt->pkt.pts+DeltaTime>=Now+deltaAudioQ &&	//TODO: figure out the right number
-			(double)audioq.first_pkt->pkt.pts+DeltaTime<=Now+deltaAudioQ+3*deltaAudioQ) {	//TODO: how much in future? On some systems, SDL asks for more buffers in a raw
-				SkipAudio = 0;
-				DecodeAudio = 1;
-		}
-	}
-	
-	while(SkipAudio==1 && audioq.size>0)
+	//too late ... TODO: figure out the right number
+	while(seg && (double)AudioSegmentPts(seg)+DeltaTime<Now+deltaAudioQ)
 	{
-		SkipAudio = 0;
 #ifdef DEBUG_AUDIO
- 		printf("AUDIO: skipaudio: queue size=%d\n",audioq.size);
+ 		printf("AUDIO: skipaudio: ring bytes=%d\n",PcmRingBytes(audioq.pcm));
 #endif
-		if(PacketQueueGet(&audioq,&AudioPkt,1, &compressed_size) < 0) {
-			return -1;
-		}
-		if(audioq.first_pkt)
-		{
-			ChunkerPlayerStats_UpdateAudioSkipHistory(&(audioq.PacketHistory), AudioPkt.stream_index, compressed_size);
-			
-			if((double)audioq.first_pkt->pkt.pts+DeltaTime<Now+deltaAudioQ)	//TODO: figure out the right number
-			{
-				SkipAudio = 1;
-				DecodeAudio = 0;
-			}
-			else if((double)audioq.first_pkt->pkt.pts+DeltaTime>=Now+deltaAudioQ &&	//TODO: figure out the right number
-				(double)audioq.first_pkt->pkt.pts+DeltaTime<=Now+deltaAudioQ+3*deltaAudioQ) {	//TODO: how much in future?
-					SkipAudio = 0;
-					DecodeAudio = 1;
-			}
-		}
+		ChunkerPlayerStats_UpdateAudioSkipHistory(&(audioq.PacketHistory), seg->stream_index, seg->compressed_size);
+		PcmRingDropSegment(audioq.pcm);
+		seg = PcmRingFirst(audioq.pcm);
 	}
-	if(DecodeAudio==1) {
-		if(PacketQueueGet(&audioq,&AudioPkt,1, &compressed_size) < 0) {
-			return -1;
-		}
+
+	//TODO: how much in future? On some systems, SDL asks for more buffers in a raw
+	if(seg && (double)AudioSegmentPts(seg)+DeltaTime<=Now+deltaAudioQ+3*deltaAudioQ) {
 #ifdef DEBUG_SYNC
-		fprintf(stderr, "AUDIO delay =%lld ms\n",(long long)AudioPkt.pts+DeltaTime-Now);
-#endif
-		memcpy(audio_buf,AudioPkt.data,AudioPkt.size);
-		audio_pkt_size = AudioPkt.size;
-#ifdef DEBUG_AUDIO
- 		printf("AUDIO: Decode audio\n");
+		fprintf(stderr, "AUDIO delay =%lld ms\n",AudioSegmentPts(seg)+DeltaTime-Now);
 #endif
+		audio_size = PcmRingRead(audioq.pcm, stream, len, AudioSegmentPlayed);
+		//playing, but the decoded samples were not there in time
+		if(audio_size < len)
+			audio_cb_stats.underruns++;
+	}
+	//room for more samples in the ring
+	if(PcmRingBytes(audioq.pcm) < pcm_lookahead_bytes)
+		AudioDecodeAheadWake();
 
-		ChunkerPlayerStats_UpdateAudioPlayedHistory(&(audioq.PacketHistory), AudioPkt.stream_index, compressed_size);
+	if(PcmRingBytes(audioq.pcm)==0 && audioq.nb_packets==0) {
+		QueueFillingMode=1;
+#ifdef DEBUG_QUEUE
+		printf("QUEUE: Get FillingMode ON\n");
+#endif
 	}
 
-	return audio_pkt_size;
+	return audio_size;
 }
 
 // Render a Frame to a YUV Overlay. Note that the Overlay is already bound to an SDL Surface
@@ -887,77 +1176,154 @@ int RenderOverlay2Rect(SDL_Overlay *YUVOverlay, SDL_Rect *Rect)
 }
 
 
-int VideoCallback(void *valthread)
+/*
+ * decoded pictures waiting for the presentation thread. Each slot owns a copy of
+ * the picture, as the decoder reuses (or, frame threaded, still writes) its own frames
+ */
+typedef struct VideoPicture {
+	AVFrame *frame;
+	AVPicture buffer; //allocated for width x height
+	int width, height;
+	int stream_index;
+	int size;
+	unsigned int flushes; //decoder_flushes when it was decoded
+} VideoPicture;
+
+static struct {
+	VideoPicture pics[VIDEO_PICTURE_QUEUE_SIZE];
+	int rindex, windex, size;
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+} picq;
+
+static int PictureQueueInit()
+{
+	int i;
+
+	memset(&picq, 0, sizeof(picq));
+	picq.mutex = SDL_CreateMutex();
+	picq.cond = SDL_CreateCond();
+	if(!picq.mutex || !picq.cond)
+		return -1;
+	for(i = 0; i < VIDEO_PICTURE_QUEUE_SIZE; i++) {
+		picq.pics[i].frame = avcodec_alloc_frame();
+		if(!picq.pics[i].frame)
+			return -1;
+	}
+	return 0;
+}
+
+static void PictureQueueDestroy()
+{
+	int i;
+
+	for(i = 0; i < VIDEO_PICTURE_QUEUE_SIZE; i++) {
+		if(picq.pics[i].width)
+			avpicture_free(&picq.pics[i].buffer);
+		if(picq.pics[i].frame)
+			av_free(picq.pics[i].frame);
+	}
+	if(picq.cond)
+		SDL_DestroyCond(picq.cond);
+	if(picq.mutex)
+		SDL_DestroyMutex(picq.mutex);
+	memset(&picq, 0, sizeof(picq));
+}
+
+/* decoder side: copy a decoded picture in, waiting while the queue is full. returns -1 on stop */
+static int PictureQueuePut(AVFrame *pFrame, int width, int height, int stream_index, int size, unsigned int flushes)
+{
+	VideoPicture *vp;
+
+	SDL_LockMutex(picq.mutex);
+	while(picq.size == VIDEO_PICTURE_QUEUE_SIZE && AVPlaying && !quit)
+		SDL_CondWaitTimeout(picq.cond, picq.mutex, 10);
+	SDL_UnlockMutex(picq.mutex);
+	if(!AVPlaying || quit)
+		return -1;
+
+	//only the decoder writes the slot at windex
+	vp = &picq.pics[picq.windex];
+	if(vp->width != width || vp->height != height) {
+		if(vp->width)
+			avpicture_free(&vp->buffer);
+		vp->width = vp->height = 0;
+		if(avpicture_alloc(&vp->buffer, PIX_FMT_YUV420P, width, height) < 0) {
+			printf("Memory error!!!\n");
+			return -1;
+		}
+		vp->width = width;
+		vp->height = height;
+		memcpy(vp->frame->data, vp->buffer.data, sizeof(vp->buffer.data));
+		memcpy(vp->frame->linesize, vp->buffer.linesize, sizeof(vp->buffer.linesize));
+	}
+	av_picture_copy((AVPicture *)vp->frame, (AVPicture *)pFrame, PIX_FMT_YUV420P, width, height);
+	vp->frame->pict_type = pFrame->pict_type;
+	vp->frame->pkt_pts = pFrame->pkt_pts;
+	vp->stream_index = stream_index;
+	vp->size = size;
+	vp->flushes = flushes;
+	picq.windex = (picq.windex + 1) % VIDEO_PICTURE_QUEUE_SIZE;
+
+	SDL_LockMutex(picq.mutex);
+	picq.size++;
+	SDL_CondBroadcast(picq.cond);
+	SDL_UnlockMutex(picq.mutex);
+	return 0;
+}
+
+/* presentation side: the oldest picture, or NULL after timeout_ms. Valid until PictureQueuePop */
+static VideoPicture *PictureQueuePeek(int timeout_ms)
+{
+	VideoPicture *vp = NULL;
+
+	SDL_LockMutex(picq.mutex);
+	if(picq.size == 0)
+		SDL_CondWaitTimeout(picq.cond, picq.mutex, timeout_ms);
+	if(picq.size > 0)
+		vp = &picq.pics[picq.rindex];
+	SDL_UnlockMutex(picq.mutex);
+	return vp;
+}
+
+static void PictureQueuePop()
+{
+	SDL_LockMutex(picq.mutex);
+	picq.rindex = (picq.rindex + 1) % VIDEO_PICTURE_QUEUE_SIZE;
+	picq.size--;
+	SDL_CondBroadcast(picq.cond);
+	SDL_UnlockMutex(picq.mutex);
+}
+
+/* takes the video packets out of the queue when it is time to decode them, and queues the pictures */
+int VideoDecodeThread(void *valthread)
 {
 	//AVPacket pktvideo;
 	AVCodecContext  *pCodecCtx;
-	AVCodec         *pCodec;
 	AVFrame         *pFrame;
 	int frameFinished;
 	long long Now;
-	long long Last = 0;
 	short int SkipVideo, DecodeVideo;
 	uint64_t last_pts = 0;
 	long long decode_delay = 0;
 	int queue_size_checked = 0;
-	
-#ifdef SAVE_YUV
-	static AVFrame* lastSavedFrameBuffer = NULL;
-	
-	if(!lastSavedFrameBuffer)
-		lastSavedFrameBuffer = (AVFrame*) malloc(sizeof(AVFrame));
-#endif
+	int64_t head_pts, tail_pts;
+	int head_index, tail_index, queued;
+	unsigned int flushes = decoder_flushes;
 
-	//double frame_rate = 0.0,time_between_frames=0.0;
-	//struct timeval now;
-
-	//int wait_for_sync = 1;
 	ThreadVal *tval;
 	tval = (ThreadVal *)valthread;
 
-	//frame_rate = tval->framerate;
-	//time_between_frames = 1.e6 / frame_rate;
-	//gettimeofday(&time_now,0);
-
-	//frecon = fopen("recondechunk.mpg","wb");
-
-	//setup video decoder
-	pCodec = avcodec_find_decoder_by_name(tval->video_codec);
-	if (pCodec) {
-		fprintf(stderr, "INIT: Setting VIDEO codecID to: %d\n",pCodec->id);
-	} else {
-		fprintf(stderr, "INIT: Unknown VIDEO codec: %s!\n", tval->video_codec);
-		return -1; // Codec not found
-	}
-
-	pCodecCtx=avcodec_alloc_context();
-	pCodecCtx->codec_type = CODEC_TYPE_VIDEO;
-	//pCodecCtx->debug = FF_DEBUG_DCT_COEFF;
-	pCodecCtx->codec_id = pCodec->id;
-
-	//pCodecCtx->bit_rate = 400000;
-	// resolution must be a multiple of two
-	pCodecCtx->width = tval->width;//176;//352;
-	pCodecCtx->height = tval->height;//144;//288;
-
-	// frames per second
-	//pCodecCtx->time_base = (AVRational){1,25};
-	//pCodecCtx->gop_size = 10; // emit one intra frame every ten frames
-	//pCodecCtx->max_b_frames=1;
-	pCodecCtx->pix_fmt = PIX_FMT_YUV420P;
-	pCodec=avcodec_find_decoder(pCodecCtx->codec_id);
-
-	if(pCodec==NULL) {
-		fprintf(stderr, "Unsupported codec!\n");
-		return -1; // Codec not found
-	}
-	if(avcodec_open(pCodecCtx, pCodec) < 0) {
-		fprintf(stderr, "could not open codec\n");
-		return -1; // Could not open codec
+	//setup video decoder, reusing the one of a previous channel with the same codec and size
+	pCodecCtx = CodecCacheGet(tval->video_codec, tval->width, tval->height, 0, 0);
+	if(!pCodecCtx) {
+		return -1; // Codec not found or could not open it
 	}
+	fprintf(stderr, "INIT: Setting VIDEO codecID to: %d\n",pCodecCtx->codec_id);
 	pFrame=avcodec_alloc_frame();
 	if(pFrame==NULL) {
 		printf("Memory error!!!\n");
+		CodecCacheRelease(pCodecCtx);
 		return -1;
 	}
 	
@@ -967,6 +1333,15 @@ int VideoCallback(void *valthread)
 
 	while(AVPlaying && !quit) {
 
+		//zapped to a channel with the same streams, the pictures of the old one are dropped
+		if(flushes != decoder_flushes) {
+			flushes = decoder_flushes;
+			avcodec_flush_buffers(pCodecCtx);
+			decode_delay = 0;
+			queue_size_checked = 0;
+			last_pts = 0;
+		}
+
 		if(QueueFillingMode || QueueStopped)
 		{
 			//SDL_LockMutex(timing_mutex);
@@ -979,11 +1354,12 @@ int VideoCallback(void *valthread)
 		DecodeVideo = 0;
 		SkipVideo = 0;
 		Now=(long long)SDL_GetTicks();
-		if(FirstTime==1 && videoq.size>0) {
-			if(videoq.first_pkt->pkt.pts>0)
+		queued = PacketQueueBounds(&videoq, &head_pts, &tail_pts, &head_index, &tail_index);
+		if(FirstTime==1 && queued>0) {
+			if(head_pts>0)
 			{
 				//SDL_LockMutex(timing_mutex);
-				DeltaTime=Now-(long long)videoq.first_pkt->pkt.pts;
+				DeltaTime=Now-(long long)head_pts;
 				FirstTime = 0;
 				FirstTimeAudio = 0;
 				//SDL_UnlockMutex(timing_mutex);
@@ -994,10 +1370,10 @@ int VideoCallback(void *valthread)
 		}
 
 #ifdef DEBUG_VIDEO 
-		if(videoq.first_pkt)
+		if(queued>0)
 		{
-			printf("VIDEO: VideoCallback - Syncro params: Delta:%lld Now:%lld pts=%lld pts+Delta=%lld ",(long long)DeltaTime,Now,(long long)videoq.first_pkt->pkt.pts,(long long)videoq.first_pkt->pkt.pts+DeltaTime);
-			printf("VIDEO: Index=%d ", (int)videoq.first_pkt->pkt.stream_index);
+			printf("VIDEO: VideoCallback - Syncro params: Delta:%lld Now:%lld pts=%lld pts+Delta=%lld ",(long long)DeltaTime,Now,(long long)head_pts,(long long)head_pts+DeltaTime);
+			printf("VIDEO: Index=%d ", head_index);
 			printf("VIDEO: QueueLen=%d ", (int)videoq.nb_packets);
 			printf("VIDEO: QueueSize=%d\n", (int)videoq.size);
 		}
@@ -1010,24 +1386,26 @@ int VideoCallback(void *valthread)
 #endif
 //			ChunkerPlayerStats_UpdateVideoSkipHistory(&(videoq.PacketHistory), VideoPkt.stream_index, pFrame->pict_type, VideoPkt.size, pFrame);
 
-		if(videoq.nb_packets>0) {
-			if (!queue_size_checked && videoq.last_pkt->pkt.pts - videoq.first_pkt->pkt.pts < decode_delay) {	//queue too short
+		if(queued>0) {
+			if (!queue_size_checked && tail_pts - head_pts < decode_delay) {	//queue too short
 #ifdef DEBUG_SYNC
-				fprintf(stderr, "VIDEO queue too short,diff(%lld) < decode_delay(%lld), increasing delta from \n",videoq.last_pkt->pkt.pts - videoq.first_pkt->pkt.pts, decode_delay, DeltaTime);
+				fprintf(stderr, "VIDEO queue too short,diff(%lld) < decode_delay(%lld), increasing delta from \n",(long long)(tail_pts - head_pts), decode_delay, DeltaTime);
 #endif
-				DeltaTime += decode_delay - (videoq.last_pkt->pkt.pts - videoq.first_pkt->pkt.pts);
+				DeltaTime += decode_delay - (tail_pts - head_pts);
 				queue_size_checked = 1;	//make sure we do not increase the delay several times bacause of the same frame
 			}
-			if (videoq.first_pkt->pkt.pts + DeltaTime - Now < decode_delay) {	//time to decode, should be based on DTS
-			    if (PacketQueueGet(&videoq,&VideoPkt,0, NULL) > 0) {
+			//decode a little ahead, the picture queue holds it until its playback time
+			if (head_pts + DeltaTime - Now < decode_delay + VIDEO_DECODE_AHEAD_MS) {	//time to decode, should be based on DTS
+			    if (PacketQueueGet(&videoq,&VideoPkt) > 0) {
 				queue_size_checked = 0;
 				avcodec_decode_video2(pCodecCtx, pFrame, &frameFinished, &VideoPkt);
 #ifdef DEBUG_SYNC
-				fprintf(stderr, "VIDEO delta =%lld ms; dt=%lld \n",(long long) pFrame->pkt_pts - last_pts, Now - Last);
+				fprintf(stderr, "VIDEO delta =%lld ms\n",(long long) pFrame->pkt_pts - last_pts);
 #endif
 				last_pts = pFrame->pkt_pts;
+				//reordering and frame threading both show up as output lagging behind input
 				if (pFrame->pkt_pts) decode_delay = MAX(decode_delay, VideoPkt.pts - pFrame->pkt_pts);	//TODO: base this on dts
-				decode_delay = MIN(decode_delay, 40 * 5);	//TODO, this workaround would not be needed if decode_delay would be based on DTS
+				decode_delay = MIN(decode_delay, 40 * (5 + decoder_threads - 1));	//TODO, this workaround would not be needed if decode_delay would be based on DTS
 #ifdef DEBUG_SYNC
 				fprintf(stderr, "VIDEO t=%lld ms ptsin=%lld ptsout=%lld \n",Now, (long long)VideoPkt.pts+DeltaTime, pFrame->pkt_pts+DeltaTime);
 				fprintf(stderr, "VIDEO delay =%lld ms ; %lld ms \n",(long long)VideoPkt.pts+DeltaTime-Now, pFrame->pkt_pts+DeltaTime-Now);
@@ -1036,9 +1414,6 @@ int VideoCallback(void *valthread)
 				if(frameFinished)
 				{ // it must be true all the time else error
 
-					long long target_pts = pFrame->pkt_pts + DeltaTime;
-					long long earlier = target_pts - Now;
-
 #ifdef DEBUG_VIDEO
 					printf("VIDEO: FrameFinished\n");
 #endif
@@ -1053,65 +1428,10 @@ int VideoCallback(void *valthread)
 						tval->width, tval->height);
 #endif
 
-#ifdef SAVE_YUV
-					if(LastSavedVFrame == -1)
-					{
-						memcpy(lastSavedFrameBuffer, pFrame, sizeof(AVFrame));
-						SaveFrame(pFrame, pCodecCtx->width, pCodecCtx->height);
-						LastSavedVFrame = VideoPkt.stream_index;
-					}
-					else if(LastSavedVFrame == (VideoPkt.stream_index-1))
-					{
-						memcpy(lastSavedFrameBuffer, pFrame, sizeof(AVFrame));
-						SaveFrame(pFrame, pCodecCtx->width, pCodecCtx->height);
-						LastSavedVFrame = VideoPkt.stream_index;
-					}
-					else if(LastSavedVFrame >= 0)
-					{
-						while(LastSavedVFrame < (VideoPkt.stream_index-1))
-						{
-							SaveFrame(lastSavedFrameBuffer, pCodecCtx->width, pCodecCtx->height);
-						}
-
-						memcpy(lastSavedFrameBuffer, pFrame, sizeof(AVFrame));
-						SaveFrame(pFrame, pCodecCtx->width, pCodecCtx->height);
-						LastSavedVFrame = VideoPkt.stream_index;
-					}
-#endif
-					ChunkerPlayerStats_UpdateVideoPlayedHistory(&(videoq.PacketHistory), VideoPkt.stream_index, pFrame->pict_type, VideoPkt.size, pFrame);
-
-					if(SilentMode)
-						continue;
-
-					SDL_LockMutex(OverlayMutex);
-					if (RenderFrame2Overlay(pFrame, pCodecCtx->width, pCodecCtx->height, YUVOverlay) < 0){
-						SDL_UnlockMutex(OverlayMutex);
-						continue;
-					}
-
-					//wait for the playback time
-#ifdef DEBUG_SYNC
-					fprintf(stderr, "VIDEO earlier =%lld ms\n",earlier);
-#endif
-					if (earlier > 0) {
-						usleep(MIN(earlier,1000) * 1000);
-//					} else if (earlier < 0) {
-//						fprintf(stderr, "should increase delay2 : pFrame->pkt_pts=%lld, DeltaTime=%lld, Now=%lld, earlier=%lld\n", pFrame->pkt_pts, DeltaTime, Now, earlier);
-//						DeltaTime -= earlier;
-					}
-
-					Last = Now;
-
-					if (RenderOverlay2Rect(YUVOverlay, ChunkerPlayerGUI_GetMainOverlayRect()) < 0) {
-						SDL_UnlockMutex(OverlayMutex);
-						continue;
-					}
-					SDL_UnlockMutex(OverlayMutex);
-
-					//redisplay logo
-					/**SDL_BlitSurface(image, NULL, MainScreen, &dest);*/
-					/* Update the screen area just changed */
-					/**SDL_UpdateRects(MainScreen, 1, &dest);*/
+					//the presentation thread waits for the playback time
+					if (PictureQueuePut(pFrame, pCodecCtx->width, pCodecCtx->height, VideoPkt.stream_index, VideoPkt.size, flushes) < 0)
+						break;
+					continue;
 				} //if FrameFinished
 				else
 				{
@@ -1123,9 +1443,142 @@ int VideoCallback(void *valthread)
 		}
 		usleep(5000);
 	}
-	avcodec_close(pCodecCtx);
-	av_free(pCodecCtx);
+	CodecCacheRelease(pCodecCtx);
 	av_free(pFrame);
+
+	return 0;
+}
+
+/* wait until the playback time target (SDL ticks), unless playback stops or the decoders are flushed */
+static void PresenterWait(long long target, unsigned int flushes)
+{
+	long long left;
+
+	SDL_LockMutex(picq.mutex);
+	while(AVPlaying && !quit && flushes == decoder_flushes && (left = target - (long long)SDL_GetTicks()) > 0)
+		SDL_CondWaitTimeout(picq.cond, picq.mutex, MIN(left, 100));
+	SDL_UnlockMutex(picq.mutex);
+}
+
+/* presents the decoded pictures at pkt_pts + DeltaTime, dropping those that are already late */
+int VideoCallback(void *valthread)
+{
+	long long Now;
+	long long target_time;
+	VideoPicture *vp;
+	unsigned int vp_flushes;
+	AVFrame *pFrame;
+	SDL_Thread *decode_thread;
+	
+#ifdef SAVE_YUV
+	static AVFrame* lastSavedFrameBuffer = NULL;
+	
+	if(!lastSavedFrameBuffer)
+		lastSavedFrameBuffer = (AVFrame*) malloc(sizeof(AVFrame));
+#endif
+
+	//frecon = fopen("recondechunk.mpg","wb");
+
+	if(PictureQueueInit() < 0) {
+		printf("Memory error!!!\n");
+		PictureQueueDestroy();
+		return -1;
+	}
+	decode_thread = SDL_CreateThread(VideoDecodeThread, valthread);
+
+	while(AVPlaying && !quit) {
+		vp = PictureQueuePeek(10);
+		if(!vp)
+			continue;
+		//decoded before a zap
+		if(vp->flushes != decoder_flushes) {
+			PictureQueuePop();
+			continue;
+		}
+		vp_flushes = vp->flushes;
+		pFrame = vp->frame;
+		Now=(long long)SDL_GetTicks();
+		target_time = pFrame->pkt_pts + DeltaTime;
+
+		//too late to be shown: the next picture is due already
+		if(Now - target_time > VIDEO_LATE_DROP_MS) {
+#ifdef DEBUG_SYNC
+			fprintf(stderr, "VIDEO dropping picture %d, %lld ms late\n", vp->stream_index, Now - target_time);
+#endif
+			ChunkerPlayerStats_UpdateVideoSkipHistory(&(videoq.PacketHistory), vp->stream_index, pFrame->pict_type, vp->size, pFrame);
+			ChunkerPlayerStats_UpdatePresentationDrop(Now - target_time);
+			PictureQueuePop();
+			continue;
+		}
+
+#ifdef SAVE_YUV
+		if(LastSavedVFrame == -1)
+		{
+			memcpy(lastSavedFrameBuffer, pFrame, sizeof(AVFrame));
+			SaveFrame(pFrame, vp->width, vp->height);
+			LastSavedVFrame = vp->stream_index;
+		}
+		else if(LastSavedVFrame == (vp->stream_index-1))
+		{
+			memcpy(lastSavedFrameBuffer, pFrame, sizeof(AVFrame));
+			SaveFrame(pFrame, vp->width, vp->height);
+			LastSavedVFrame = vp->stream_index;
+		}
+		else if(LastSavedVFrame >= 0)
+		{
+			while(LastSavedVFrame < (vp->stream_index-1))
+			{
+				SaveFrame(lastSavedFrameBuffer, vp->width, vp->height);
+			}
+
+			memcpy(lastSavedFrameBuffer, pFrame, sizeof(AVFrame));
+			SaveFrame(pFrame, vp->width, vp->height);
+			LastSavedVFrame = vp->stream_index;
+		}
+#endif
+		ChunkerPlayerStats_UpdateVideoPlayedHistory(&(videoq.PacketHistory), vp->stream_index, pFrame->pict_type, vp->size, pFrame);
+
+		if(ZapStartTicks) {
+			printf("ZAP: first picture after %u ms, %d frames before the first I frame dropped\n", SDL_GetTicks() - ZapStartTicks, ZapSkippedFrames);
+			ZapStartTicks = 0;
+		}
+
+		if(SilentMode) {
+			PictureQueuePop();
+			continue;
+		}
+
+		//the picture is in the overlay now, its slot can go back to the decoder
+		SDL_LockMutex(OverlayMutex);
+		if (RenderFrame2Overlay(pFrame, vp->width, vp->height, YUVOverlay) < 0){
+			PictureQueuePop();
+			SDL_UnlockMutex(OverlayMutex);
+			continue;
+		}
+		SDL_UnlockMutex(OverlayMutex);
+		PictureQueuePop();
+
+		//wait for the playback time
+#ifdef DEBUG_SYNC
+		fprintf(stderr, "VIDEO earlier =%lld ms\n", target_time - Now);
+#endif
+		PresenterWait(target_time, vp_flushes);
+
+		SDL_LockMutex(OverlayMutex);
+		ChunkerPlayerStats_UpdatePresentation((long long)SDL_GetTicks() - target_time);
+		if (RenderOverlay2Rect(YUVOverlay, ChunkerPlayerGUI_GetMainOverlayRect()) < 0) {
+			SDL_UnlockMutex(OverlayMutex);
+			continue;
+		}
+		SDL_UnlockMutex(OverlayMutex);
+
+		//redisplay logo
+		/**SDL_BlitSurface(image, NULL, MainScreen, &dest);*/
+		/* Update the screen area just changed */
+		/**SDL_UpdateRects(MainScreen, 1, &dest);*/
+	}
+	SDL_WaitThread(decode_thread, NULL);
+	PictureQueueDestroy();
 	//fclose(frecon);
 #ifdef DEBUG_VIDEO
  	printf("VIDEO: video callback end\n");
@@ -1145,19 +1598,48 @@ void AudioCallback(void *userdata, Uint8 *stream, int len)
 {
 	//AVCodecContext *aCodecCtx = (AVCodecContext *)userdata;
 	int audio_size;
+	struct timeval now;
+	long long start_us, run_us;
+
+	gettimeofday(&now, NULL);
+	start_us = now.tv_sec * 1000000LL + now.tv_usec;
+	if(audio_cb_stats.last_us) {
+		double jitter = fabs((start_us - audio_cb_stats.last_us) / 1000.0 - deltaAudioQ);
+		audio_cb_stats.jitter_sum_ms += jitter;
+		if(jitter > audio_cb_stats.jitter_max_ms)
+			audio_cb_stats.jitter_max_ms = jitter;
+	}
+	audio_cb_stats.last_us = start_us;
+	audio_cb_stats.callbacks++;
+
+	audio_size = AudioFillFromRing(stream, len);
+	if(audio_size < 0)
+		audio_size = 0;
+
+	if(SilentMode >= 2) {
+		memset(stream, CurrentAudioSilence, len);
+	} else if(audio_size < len) {
+		//silence only what is missing
+		memset(stream + audio_size, CurrentAudioSilence, len - audio_size);
+	}
 
-	static uint8_t audio_buf[AVCODEC_MAX_AUDIO_FRAME_SIZE];
+	gettimeofday(&now, NULL);
+	run_us = now.tv_sec * 1000000LL + now.tv_usec - start_us;
+	audio_cb_stats.run_sum_us += run_us;
+	if(run_us > audio_cb_stats.run_max_us)
+		audio_cb_stats.run_max_us = run_us;
+}
 
-	memset(audio_buf, CurrentAudioSilence, sizeof(audio_buf));
-	audio_size = AudioDecodeFrame(audio_buf, sizeof(audio_buf));
-	
-	if(SilentMode < 2) {
-		if(audio_size != len) {
-			memset(stream, CurrentAudioSilence, len);
-		} else {
-			memcpy(stream, (uint8_t *)audio_buf, len);
-		}
-	}
+void PrintAudioCallbackStats()
+{
+	AudioCallbackStats *st = &audio_cb_stats;
+
+	if(st->callbacks == 0)
+		return;
+	fprintf(stderr, "AUDIO: %ld callbacks, %ld underruns, interval jitter avg %.2f ms max %.2f ms, run time avg %lld us max %lld us\n",
+		st->callbacks, st->underruns, st->jitter_sum_ms / st->callbacks, st->jitter_max_ms,
+		st->run_sum_us / st->callbacks, st->run_max_us);
+	memset(st, 0, sizeof(AudioCallbackStats));
 }
 
 void SaveFrame(AVFrame *pFrame, int width, int height)
@@ -1197,6 +1679,7 @@ void ChunkerPlayerCore_Play()
 	if(AVPlaying) return;
 	AVPlaying = 1;
 	
+	audio_decode_thread = SDL_CreateThread(AudioDecodeAheadThread, NULL);
 	SDL_PauseAudio(0);
 	video_thread = SDL_CreateThread(VideoCallback, &VideoCallbackThreadParams);
 	ChunkerPlayerStats_Init(&VideoCallbackThreadParams);
@@ -1211,11 +1694,15 @@ void ChunkerPlayerCore_Stop()
 	if(!AVPlaying) return;
 	
 	AVPlaying = 0;
+	AudioDecodeAheadWake();
 	
 	// Stop audio&video playback
 	SDL_WaitThread(video_thread, NULL);
 	SDL_WaitThread(stats_thread, NULL);
+	SDL_WaitThread(audio_decode_thread, NULL);
 	SDL_PauseAudio(1);	
+	PrintAudioCallbackStats();
+	ChunkerPlayerStats_PrintPresentation();
 	
 	if(YUVOverlay != NULL)
 	{
@@ -1226,9 +1713,8 @@ void ChunkerPlayerCore_Stop()
 	PacketQueueReset(&audioq);
 	PacketQueueReset(&videoq);
 	
-	avcodec_close(aCodecCtx);
-	av_free(aCodecCtx);
-	free(AudioPkt.data);
+	CodecCacheRelease(aCodecCtx);
+	aCodecCtx = NULL;
 	free(VideoPkt.data);
 	free(outbuf_audio);
 	
@@ -1252,6 +1738,8 @@ void ChunkerPlayerCore_Finalize()
 	}
 
 	SDL_CloseAudio();
+	audio_open = 0;
+	CodecCacheFree();
 }
 
 void ChunkerPlayerCore_Pause()
@@ -1259,18 +1747,42 @@ void ChunkerPlayerCore_Pause()
 	if(!AVPlaying) return;
 	
 	AVPlaying = 0;
+	AudioDecodeAheadWake();
 	
 	// Stop audio&video playback
 	SDL_WaitThread(video_thread, NULL);
+	SDL_WaitThread(audio_decode_thread, NULL);
 	SDL_PauseAudio(1);
 	
 	PacketQueueReset(&audioq);
 	PacketQueueReset(&videoq);
+	WaitingKeyframe = 1;
 }
 
 int ChunkerPlayerCore_AudioEnded()
 {
-	return (audioq.nb_packets==0 && audioq.last_frame_extracted>0);
+	return (audioq.nb_packets==0 && PcmRingBytes(audioq.pcm)==0 && audioq.last_frame_extracted>0);
+}
+
+/*
+ * zap to a channel with the same codecs and size while playing: the threads, the
+ * overlay and the audio device are kept, the queues are emptied and the decoding
+ * threads flush their decoders. the caller has already switched the ring the
+ * demux thread reads
+ */
+void ChunkerPlayerCore_FlushDecoders()
+{
+	__sync_add_and_fetch(&decoder_flushes, 1);
+	PacketQueueReset(&audioq);
+	PacketQueueReset(&videoq);
+	WaitingKeyframe = 1;
+	ZapSkippedFrames = 0;
+	ZapStartTicks = SDL_GetTicks();
+	AudioDecodeAheadWake();
+	//stop waiting for the playback time of an old picture
+	SDL_LockMutex(picq.mutex);
+	SDL_CondBroadcast(picq.cond);
+	SDL_UnlockMutex(picq.mutex);
 }
 
 void ChunkerPlayerCore_ResetAVQueues()
@@ -1282,7 +1794,8 @@ void ChunkerPlayerCore_ResetAVQueues()
 	PacketQueueReset(&videoq);
 }
 
-int ChunkerPlayerCore_EnqueueBlocks(const uint8_t *block, const int block_size)
+//whether the next chunk is lost, following the schedule of _chunklossrate.conf
+int ChunkerPlayerCore_EmulatedChunkLoss()
 {
 #ifdef EMULATE_CHUNK_LOSS
 	static time_t loss_cycle_start_time = 0, now = 0;
@@ -1313,7 +1826,7 @@ int ChunkerPlayerCore_EnqueueBlocks(const uint8_t *block, const int block_size)
 		if(clp_frames > 0)
 		{
 			clp_frames--;
-			return PLAYER_FAIL_RETURN;
+			return 1;
 		}
 		if((rand() % 100) < random_threshold)
 		{
@@ -1322,21 +1835,24 @@ int ChunkerPlayerCore_EnqueueBlocks(const uint8_t *block, const int block_size)
             else
             {
                 clp_frames=early_losses=(ScheduledChunkLosses[CurrChunkLossIndex].Burstiness-1);
-                return PLAYER_FAIL_RETURN;
+                return 1;
             }
 		}
 	}
 #endif
+	return 0;
+}
 
-	Chunk *gchunk = NULL;
+int ChunkerPlayerCore_EnqueueBlocks(const uint8_t *block, const int block_size)
+{
+	Chunk chunk, *gchunk = &chunk;
+	ChunkBuffer *cb = NULL;
 	int decoded_size = -1;
 	uint8_t *tempdata, *buffer;
 	int j;
-	Frame *frame = NULL;
+	Frame frame_s, *frame = &frame_s;
 	AVPacket packet, packetaudio;
 
-	uint16_t *audio_bufQ = NULL;
-
 	//the frame.h gets encoded into 5 slots of 32bits (3 ints plus 2 more for the timeval struct
 	static int sizeFrameHeader = 5*sizeof(int32_t);
 	//the following we dont need anymore
@@ -1345,21 +1861,20 @@ int ChunkerPlayerCore_EnqueueBlocks(const uint8_t *block, const int block_size)
 	static int chunks_out_of_order = 0;
 	static int last_chunk_id = -1;
 
-	audio_bufQ = (uint16_t *)av_malloc(AVCODEC_MAX_AUDIO_FRAME_SIZE);
-	if(!audio_bufQ) {
-		printf("Memory error in audio_bufQ!\n");
+	//payload and attributes are left in the receive buffer, the queue makes the only copy
+	decoded_size = decodeChunkInPlace(gchunk, block, block_size);
+  if(decoded_size < 0) {
+		printf("chunk probably corrupted!\n");
 		return PLAYER_FAIL_RETURN;
 	}
 
-	gchunk = (Chunk *)malloc(sizeof(Chunk));
-	if(!gchunk) {
-		printf("Memory error in gchunk!\n");
-		av_free(audio_bufQ);
+	//one copy for the whole chunk, shared by the packets of its frames
+	cb = ChunkBufferCreate(gchunk->data, gchunk->size);
+	if(!cb) {
+		printf("Memory error in chunk buffer!\n");
 		return PLAYER_FAIL_RETURN;
 	}
 
-	decoded_size = decodeChunk(gchunk, block, block_size);
-
 	if(last_chunk_id == -1)
 		last_chunk_id = gchunk->id;
 
@@ -1371,31 +1886,10 @@ int ChunkerPlayerCore_EnqueueBlocks(const uint8_t *block, const int block_size)
 #ifdef DEBUG_CHUNKER
 	printf("CHUNKER: enqueueBlock: id %d decoded_size %d target size %d - out_of_order %d\n", gchunk->id, decoded_size, GRAPES_ENCODED_CHUNK_HEADER_SIZE + ExternalChunk_header_size + gchunk->size, chunks_out_of_order);
 #endif
-  if(decoded_size < 0) {
-		//HINT here i should differentiate between various return values of the decode
-		//in order to free what has been allocated there
-		printf("chunk probably corrupted!\n");
-		av_free(audio_bufQ);
-		free(gchunk);
-		return PLAYER_FAIL_RETURN;
-	}
 
-	frame = (Frame *)malloc(sizeof(Frame));
-	if(!frame) {
-		printf("Memory error in Frame!\n");
-		if(gchunk) {
-			if(gchunk->attributes) {
-				free(gchunk->attributes);
-			}
-			free(gchunk);
-		}
-		av_free(audio_bufQ);
-		return PLAYER_FAIL_RETURN;
-	}
-
-	tempdata = gchunk->data; //let it point to first frame of payload
+	tempdata = cb->data; //let it point to first frame of payload
 	j=gchunk->size;
-	while(j>0 && !quit) {
+	while(j>=sizeFrameHeader && !quit) {
 		frame->number = bit32_encoded_pull(tempdata);
 		tempdata += CHUNK_TRANSCODING_INT_SIZE;
 		frame->timestamp.tv_sec = bit32_encoded_pull(tempdata);
@@ -1407,10 +1901,21 @@ int ChunkerPlayerCore_EnqueueBlocks(const uint8_t *block, const int block_size)
 		frame->type = bit32_encoded_pull(tempdata);
 		tempdata += CHUNK_TRANSCODING_INT_SIZE;
 
+		//the payload is not copied anymore, never read past its end
+		if(frame->size > j - sizeFrameHeader) {
+			printf("SOURCE: Corrupt frames (size %d) in chunk. Skipping it...\n", frame->size);
+			break;
+		}
+
 		buffer = tempdata; // here coded frame information
 		tempdata += frame->size; //let it point to the next frame
 
-		if(frame->type < 5) { // video frame
+		//the decoder cannot use anything before the first I frame, do not queue it
+		if(frame->type < 5 && frame->type != 1 && WaitingKeyframe) {
+			ZapSkippedFrames++;
+		}
+		else if(frame->type < 5) { // video frame
+			WaitingKeyframe = 0;
 			av_init_packet(&packet);
 			packet.data = buffer;//video_bufQ;
 			packet.size = frame->size;
@@ -1419,7 +1924,8 @@ int ChunkerPlayerCore_EnqueueBlocks(const uint8_t *block, const int block_size)
 			packet.stream_index = frame->number; // use of stream_index for number frame
 			//packet.duration = frame->timestamp.tv_sec;
 			if(packet.size > 0) {
-				int ret = ChunkerPlayerCore_PacketQueuePut(&videoq, &packet); //the _put makes a copy of the packet
+				ChunkBufferRefPacket(cb, &packet);
+				int ret = ChunkerPlayerCore_PacketQueuePut(&videoq, &packet); //the queue takes the chunk reference
 				if (ret == 1) {	//TODO: check and correct return values
 					fprintf(stderr, "late chunk received, increasing delay to %lld\n", DeltaTime);
 					DeltaTime += 5;	//TODO: handle audio skip; verify this value
@@ -1446,7 +1952,8 @@ int ChunkerPlayerCore_EnqueueBlocks(const uint8_t *block, const int block_size)
 
 			// insert the audio frame into the queue
 			if(packetaudio.size > 0) {
-				int ret = ChunkerPlayerCore_PacketQueuePut(&audioq, &packetaudio);//makes a copy of the packet so i can free here
+				ChunkBufferRefPacket(cb, &packetaudio);
+				int ret = ChunkerPlayerCore_PacketQueuePut(&audioq, &packetaudio);//the queue takes the chunk reference
 				if (ret == 1) {	//TODO: check and correct return values
 					fprintf(stderr, "late chunk received, increasing delay to %lld\n", DeltaTime);
 					DeltaTime += 5;	//TODO: handle audio skip; verify this value
@@ -1467,19 +1974,8 @@ int ChunkerPlayerCore_EnqueueBlocks(const uint8_t *block, const int block_size)
 			j = -1;
 		}
 	}
-	//chunk ingestion terminated!
-	if(gchunk) {
-		if(gchunk->attributes) {
-			free(gchunk->attributes);
-		}
-		if(gchunk->data)
-			free(gchunk->data);
-		free(gchunk);
-	}
-	if(frame)
-		free(frame);
-	if(audio_bufQ)
-		av_free(audio_bufQ);
+	//chunk ingestion terminated! the buffer lives on until its last frame is dequeued
+	ChunkBufferUnref(cb);
 		
 	return PLAYER_OK_RETURN;
 }
@@ -1539,6 +2035,8 @@ int CollectStatisticsThread(void *params)
 	int sleep_time = STATS_THREAD_GRANULARITY*1000;
 	int audio_avg_bitrate = 0;
 	int video_avg_bitrate = 0;
+	int64_t first_pts, last_pts;
+	int first_index, last_index, queued;
 	
 	while(AVPlaying && !quit)
 	{
@@ -1568,18 +2066,18 @@ int CollectStatisticsThread(void *params)
 #endif
 
 			// QUEUE DENSITY EVALUATION
-			if((audioq.last_pkt != NULL) && (audioq.first_pkt != NULL))
-				if(audioq.last_pkt->pkt.stream_index >= audioq.first_pkt->pkt.stream_index)
+			if((queued = PacketQueueBounds(&audioq, &first_pts, &last_pts, &first_index, &last_index)) > 0)
+				if(last_index >= first_index)
 				{
 					//plus 1 because if they are adjacent (difference 1) there really should be 2 packets in the queue
-					audio_qdensity = (double)audioq.nb_packets / (double)(audioq.last_pkt->pkt.stream_index - audioq.first_pkt->pkt.stream_index + 1) * 100.0;
+					audio_qdensity = (double)queued / (double)(last_index - first_index + 1) * 100.0;
 				}
 			
-			if((videoq.last_pkt != NULL) && (videoq.first_pkt != NULL))
-				if(videoq.last_pkt->pkt.stream_index >= videoq.first_pkt->pkt.stream_index)
+			if((queued = PacketQueueBounds(&videoq, &first_pts, &last_pts, &first_index, &last_index)) > 0)
+				if(last_index >= first_index)
 				{
 					// plus 1 because if they are adjacent (difference 1) there really should be 2 packets in the queue
-					video_qdensity = (double)videoq.nb_packets / (double)(videoq.last_pkt->pkt.stream_index - videoq.first_pkt->pkt.stream_index + 1) * 100.0;
+					video_qdensity = (double)queued / (double)(last_index - first_index + 1) * 100.0;
 				}
 			
 			if(LogTraces)
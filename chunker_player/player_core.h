@@ -17,7 +17,9 @@ void ChunkerPlayerCore_Pause();
 void ChunkerPlayerCore_Play();
 int ChunkerPlayerCore_IsRunning();
 void ChunkerPlayerCore_ResetAVQueues();
+void ChunkerPlayerCore_FlushDecoders();
 int ChunkerPlayerCore_EnqueueBlocks(const uint8_t *block, const int block_size);
+int ChunkerPlayerCore_EmulatedChunkLoss();
 void ChunkerPlayerCore_SetupOverlay(int width, int height);
 void ChunkerPlayerCore_ChangeDelay(int ms); // positive to increase delay
 
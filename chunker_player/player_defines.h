@@ -20,7 +20,19 @@
 #define AUDIO	1
 #define VIDEO	2
 #define QUEUE_MAX_GROW_FACTOR 200
+#define CHUNK_RING_SLOTS 64 //received chunks waiting for the demux thread, power of two
+#define AUDIO_LOOKAHEAD_MS_DEFAULT 200 //decoded audio kept ahead of playback
+#define PCM_RING_SEGMENTS 4096 //decoded frames the pcm ring can hold, power of two
 #define CHANNEL_SCORE_HISTORY_SIZE 1000
+#define PREWARM_FEED_SLOTS 64 //chunks of a prewarmed channel the player can receive, power of two
+#define PREWARM_FEED_CHUNKS 32 //newest chunks of a prewarmed channel kept ready for a zap
+#define PREWARM_NICE 10 //priority of the streamers of prewarmed channels
+#define VIDEO_PICTURE_QUEUE_SIZE 3 //decoded pictures waiting for presentation
+#define VIDEO_DECODE_AHEAD_MS 40 //decode this much before the playback time
+#define VIDEO_LATE_DROP_MS 40 //pictures later than this are dropped, not shown
+#define DECODER_THREADS_DEFAULT 1
+#define CODEC_CACHE_SIZE 4 //opened decoders kept across channel switches
+#define UDP_BATCH_DEFAULT 32 //datagrams per recvmmsg of the UDP input
 
 #define FULLSCREEN_ICON_FILE "icons/fullscreen32.png"
 #define NOFULLSCREEN_ICON_FILE "icons/nofullscreen32.png"
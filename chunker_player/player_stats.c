@@ -21,6 +21,7 @@ void ChunkerPlayerStats_Init(ThreadVal *params)
 {
 	VideoCallbackThreadParams = params;
 	LastIFrameNumber = -1;
+	memset(&PresentationStats, 0, sizeof(PresentationStats));
 	LastQualityEstimation = 0.5f;
 	qoe_adjust_factor = sqrt(VideoCallbackThreadParams->height*VideoCallbackThreadParams->width);
 	
@@ -537,3 +538,70 @@ int ChunkerPlayerStats_PrintHistoryTrace(SHistory* history, char* tracefilename)
 	SDL_UnlockMutex(history->Mutex);
 	return counter;
 }
+
+static int PresentationBucket(long long ms)
+{
+	int b = 0;
+
+	while(b < PRESENTATION_HISTOGRAM_BUCKETS - 1 && ms >= (1LL << b))
+		b++;
+	return b;
+}
+
+// only the presentation thread updates these
+void ChunkerPlayerStats_UpdatePresentation(long long late_ms)
+{
+	PresentationStats.Presented++;
+	PresentationStats.Jitter[PresentationBucket(late_ms)]++;
+}
+
+void ChunkerPlayerStats_UpdatePresentationDrop(long long late_ms)
+{
+	PresentationStats.Dropped++;
+	PresentationStats.Lateness[PresentationBucket(late_ms)]++;
+}
+
+static void PrintPresentationHistogram(const char *name, long int *h)
+{
+	int b;
+
+	printf("VIDEO: %s ms:", name);
+	for(b = 0; b < PRESENTATION_HISTOGRAM_BUCKETS; b++) {
+		if(h[b] == 0)
+			continue;
+		if(b == 0)
+			printf(" 0:%ld", h[b]);
+		else if(b < PRESENTATION_HISTOGRAM_BUCKETS - 1)
+			printf(" <%d:%ld", 1 << b, h[b]);
+		else
+			printf(" >=%d:%ld", 1 << (b - 1), h[b]);
+	}
+	printf("\n");
+}
+
+void ChunkerPlayerStats_PrintPresentation()
+{
+	printf("VIDEO: %ld pictures presented, %ld dropped late\n", PresentationStats.Presented, PresentationStats.Dropped);
+	PrintPresentationHistogram("presentation jitter", PresentationStats.Jitter);
+	if(PresentationStats.Dropped)
+		PrintPresentationHistogram("dropped pictures lateness", PresentationStats.Lateness);
+}
+
+void ChunkerPlayerStats_UpdateTransport(long int fragments, long int duplicates, long int expected, long int chunks, long int incomplete)
+{
+	TransportStats.Fragments += fragments;
+	TransportStats.Duplicates += duplicates;
+	TransportStats.Expected += expected;
+	TransportStats.Chunks += chunks;
+	TransportStats.Incomplete += incomplete;
+}
+
+void ChunkerPlayerStats_PrintTransport()
+{
+	long int lost = TransportStats.Expected - TransportStats.Chunks;
+
+	printf("TRANSPORT: %ld chunks of %ld reassembled from %ld fragments (%ld duplicate)\n",
+		TransportStats.Chunks, TransportStats.Expected, TransportStats.Fragments, TransportStats.Duplicates);
+	printf("TRANSPORT: %ld chunks lost (%.2f%%), %ld of them given up with fragments missing\n",
+		lost, TransportStats.Expected ? lost * 100.0 / TransportStats.Expected : 0.0, TransportStats.Incomplete);
+}
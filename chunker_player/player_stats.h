@@ -51,6 +51,30 @@ typedef struct SHistory
 	SDL_mutex *Mutex;
 } SHistory;
 
+//presentation of the decoded pictures: bucket b counts up to 2^b - 1 ms, the last one the rest
+#define PRESENTATION_HISTOGRAM_BUCKETS 9
+typedef struct SPresentationStats
+{
+	long int Presented;
+	long int Dropped;
+	long int Jitter[PRESENTATION_HISTOGRAM_BUCKETS]; // shown this late, in ms
+	long int Lateness[PRESENTATION_HISTOGRAM_BUCKETS]; // dropped this late, in ms
+} SPresentationStats;
+
+SPresentationStats PresentationStats;
+
+//chunks received over a datagram transport, only its receive thread updates them
+typedef struct STransportStats
+{
+	long int Fragments;
+	long int Duplicates; // fragments received twice, or after their chunk was given up
+	long int Expected; // chunks sent, from the transport sequence numbers
+	long int Chunks; // reassembled
+	long int Incomplete; // given up with fragments missing
+} STransportStats;
+
+STransportStats TransportStats;
+
 char VideoTraceFilename[1024];
 char AudioTraceFilename[1024];
 char QoETraceFileName[1024];
@@ -85,4 +109,11 @@ int ChunkerPlayerStats_GetMeanVideoQuality(SHistory* history, int real_bitrate ,
 
 int ChunkerPlayerStats_GetStats(SHistory* history, SStats* statistics);
 
+void ChunkerPlayerStats_UpdatePresentation(long long late_ms);
+void ChunkerPlayerStats_UpdatePresentationDrop(long long late_ms);
+void ChunkerPlayerStats_PrintPresentation();
+
+void ChunkerPlayerStats_UpdateTransport(long int fragments, long int duplicates, long int expected, long int chunks, long int incomplete);
+void ChunkerPlayerStats_PrintTransport();
+
 #endif
@@ -23,54 +23,575 @@
 #endif
 #include <unistd.h>
 #include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
 
 //handle threads through SDL
 #include <SDL.h>
 #include <SDL_thread.h>
 
 #include "chunker_player.h"
+#include "chunk_ring.h"
 
+//largest chunk accepted, larger frames are skipped
 #define TCP_BUF_SIZE 65536*16
+//bytes read per recv: as many framed chunks as fit are parsed out of one read
+#define PULLER_STAGE_SIZE 65536
+//chunks held back while the ring slot is taken, more are dropped
+#define PULLER_PENDING_MAX 16
 
-static int accept_fd = -1;
-static int socket_fd = -1;
-static int isRunning = 0;
-static int isReceving = 0;
-static SDL_Thread *AcceptThread;
-static SDL_Thread *RecvThread;
+#ifdef __linux__
+//all the listening sockets and all the pushers are served by one epoll thread
+#define PULLER_MAX_EVENTS 32
+//recv calls on one connection before the others get their turn
+#define PULLER_READS_PER_EVENT 16
+#define PULLER_STATS_INTERVAL_MS 10000
+#endif
 
-static int RecvThreadProc(void* params);
-static int AcceptThreadProc(void* params);
+struct ChunkPuller;
 
-int initChunkPuller(const int port)
+typedef enum { CONN_LISTEN, CONN_LENGTH, CONN_BODY, CONN_SKIP } ConnState;
+
+//a pushing connection and the framing state of the chunk it is sending
+typedef struct PullerConn {
+	int fd;
+	struct ChunkPuller *puller;
+	ConnState state;
+	uint8_t length[sizeof(uint32_t)];
+	uint32_t size; //payload size of the chunk being received
+	uint32_t got; //bytes of the length or of the payload received so far
+	uint8_t *buffer; //where the payload goes
+	int in_ring; //buffer is the reserved slot of the ring
+	uint8_t *own; //used while another connection holds the ring slot
+	uint32_t own_size;
+	uint8_t *stage; //what the last recv returned, parsed into chunks
+	uint64_t bytes;
+	unsigned int chunks;
+	unsigned int dropped;
+	unsigned int recvs;
+	struct PullerConn *next;
+} PullerConn;
+
+//a chunk completed while another connection held the ring slot
+typedef struct PendingChunk {
+	uint8_t *data;
+	uint32_t size;
+	PullerConn *conn; //NULL once the connection is gone
+	struct PendingChunk *next;
+} PendingChunk;
+
+//a listening socket and the streamers feeding it
+typedef struct ChunkPuller {
+	int accept_fd;
+	int port;
+	ChunkRing *ring; //where chunks go, NULL for the demux ring of the player
+	PullerConn *reserving; //the ring takes one reservation at a time
+	PendingChunk *pending; //pushed in order once the reservation is committed
+	int pending_num;
+#ifdef __linux__
+	PullerConn *listener;
+#else
+	int socket_fd;
+	int isRunning;
+	int isReceving;
+	SDL_Thread *AcceptThread;
+	SDL_Thread *RecvThread;
+#endif
+} ChunkPuller;
+
+static ChunkPuller main_puller = { -1, 0, NULL };
+//side feeds of prewarmed channels
+static ChunkPuller *feed_pullers[MAX_CHANNELS_NUM];
+static int feed_pullers_num = 0;
+
+static void finalizePuller(ChunkPuller *p);
+
+static uint8_t *pullerReserve(ChunkPuller *p, int size)
+{
+	return p->ring ? ChunkRingReserve(p->ring, size) : reserveBlock(size);
+}
+
+static void pullerCommit(ChunkPuller *p, int size)
+{
+	if(p->ring)
+		ChunkRingCommit(p->ring, size);
+	else
+		commitBlock(size);
+}
+
+static int pullerPush(ChunkPuller *p, const uint8_t *data, int size)
+{
+	return p->ring ? ChunkRingPush(p->ring, data, size) : enqueueBlock(data, size);
+}
+
+//a push would reserve the very slot being filled: queue the chunk, the buffer goes with it
+static int pullerDefer(ChunkPuller *p, PullerConn *c)
+{
+	PendingChunk *pc, **last;
+
+	if(p->pending_num >= PULLER_PENDING_MAX || !(pc = malloc(sizeof(PendingChunk))))
+		return -1;
+	pc->data = c->own;
+	pc->size = c->size;
+	pc->conn = c;
+	pc->next = NULL;
+	for(last = &p->pending; *last; last = &(*last)->next)
+		;
+	*last = pc;
+	p->pending_num++;
+	c->own = NULL;
+	c->own_size = 0;
+	return 0;
+}
+
+static void pullerFlush(ChunkPuller *p)
+{
+	PendingChunk *pc;
+
+	while((pc = p->pending) && !p->reserving) {
+		if(pullerPush(p, pc->data, pc->size) < 0 && pc->conn)
+			pc->conn->dropped++;
+		p->pending = pc->next;
+		p->pending_num--;
+		free(pc->data);
+		free(pc);
+	}
+}
+
+static uint64_t total_bytes = 0;
+static unsigned int total_chunks = 0;
+static unsigned int total_syscalls = 0;
+
+static PullerConn *ConnCreate(int fd, ChunkPuller *p)
+{
+	PullerConn *c = calloc(1, sizeof(PullerConn));
+
+	if(!c)
+		return NULL;
+	c->stage = (uint8_t*) malloc(PULLER_STAGE_SIZE);
+	if(!c->stage) {
+		free(c);
+		return NULL;
+	}
+	c->fd = fd;
+	c->puller = p;
+	c->state = CONN_LENGTH;
+	return c;
+}
+
+static void ConnFree(PullerConn *c)
+{
+	PendingChunk *pc;
+
+	for(pc = c->puller->pending; pc; pc = pc->next)
+		if(pc->conn == c)
+			pc->conn = NULL;
+	//a reserved but uncommitted slot is simply taken again by the next reservation
+	if(c->puller->reserving == c) {
+		c->puller->reserving = NULL;
+		pullerFlush(c->puller);
+	}
+	free(c->own);
+	free(c->stage);
+	free(c);
+}
+
+//the length is known: decide where the payload goes
+static void ConnStartBody(PullerConn *c)
+{
+	ChunkPuller *p = c->puller;
+
+	memcpy(&c->size, c->length, sizeof(uint32_t));
+	c->size = ntohl(c->size);
+	c->got = 0;
+	c->in_ring = 0;
+	if (c->size == 0) {	//strange, but valid
+		c->state = CONN_LENGTH;
+		return;
+	}
+	if (c->size > TCP_BUF_SIZE) {
+		//keep the connection, the frame is read off and thrown away
+		fprintf(stderr, "TCP-INPUT-MODULE: skipping a chunk of %u bytes on fd %d\n", c->size, c->fd);
+		c->state = CONN_SKIP;
+		return;
+	}
+	c->state = CONN_BODY;
+	if(!p->reserving) {
+		//receive straight into the ring
+		c->buffer = pullerReserve(p, c->size);
+		if(c->buffer) {
+			c->in_ring = 1;
+			p->reserving = c;
+			return;
+		}
+	} else {
+		//another connection of this port is filling the slot, copy in later
+		if(c->own_size < c->size) {
+			uint8_t *tmp = realloc(c->own, c->size);
+			if(tmp) {
+				c->own = tmp;
+				c->own_size = c->size;
+			}
+		}
+		if(c->own_size >= c->size) {
+			c->buffer = c->own;
+			return;
+		}
+	}
+	fprintf(stderr, "TCP-INPUT-MODULE: could not enqueue a received chunk!! \n");
+	c->state = CONN_SKIP;
+}
+
+static void ConnEndBody(PullerConn *c)
+{
+	ChunkPuller *p = c->puller;
+	int dropped = (c->state == CONN_SKIP);
+
+	if(c->in_ring) {
+		pullerCommit(p, c->size);
+		p->reserving = NULL;
+		pullerFlush(p);
+	} else if(!dropped && p->reserving)
+		dropped = pullerDefer(p, c) < 0;
+	else if(!dropped)
+		dropped = pullerPush(p, c->buffer, c->size) < 0;
+	if(dropped)
+		c->dropped++;
+	c->chunks++;
+	total_chunks++;
+	c->state = CONN_LENGTH;
+	c->got = 0;
+}
+
+//split what was read into length prefixes and payloads
+static void ConnParse(PullerConn *c, const uint8_t *data, uint32_t n)
+{
+	uint32_t take;
+
+	while(n > 0) {
+		if(c->state == CONN_LENGTH) {
+			take = sizeof(uint32_t) - c->got;
+			if(take > n)
+				take = n;
+			memcpy(c->length + c->got, data, take);
+			c->got += take;
+			if(c->got == sizeof(uint32_t))
+				ConnStartBody(c);
+		} else {
+			take = c->size - c->got;
+			if(take > n)
+				take = n;
+			if(c->state == CONN_BODY)
+				memcpy(c->buffer + c->got, data, take);
+			c->got += take;
+			if(c->got == c->size)
+				ConnEndBody(c);
+		}
+		data += take;
+		n -= take;
+	}
+}
+
+/**
+ * one recv: the rest of a large payload goes straight to its buffer,
+ * anything else is read in a batch and parsed. drained tells that the
+ * socket had less than asked for
+ */
+static int ConnRecv(PullerConn *c, int *drained)
+{
+	uint32_t want;
+	int direct = (c->state == CONN_BODY && c->size - c->got >= PULLER_STAGE_SIZE);
+	int n;
+
+	if(direct) {
+		want = c->size - c->got;
+		n = recv(c->fd, c->buffer + c->got, want, 0);
+	} else {
+		want = PULLER_STAGE_SIZE;
+		n = recv(c->fd, c->stage, want, 0);
+	}
+	c->recvs++;
+	total_syscalls++;
+	*drained = (n < (int)want);
+	if(n <= 0)
+		return n;
+	c->bytes += n;
+	total_bytes += n;
+	if(!direct)
+		ConnParse(c, c->stage, n);
+	else if((c->got += n) == c->size)
+		ConnEndBody(c);
+	return n;
+}
+
+#ifdef __linux__
+static int epoll_fd = -1;
+static volatile int epoll_running = 0;
+static SDL_Thread *EpollThread = NULL;
+static PullerConn *conns = NULL;
+static int conns_num = 0;
+
+static uint64_t last_bytes = 0;
+static unsigned int last_chunks = 0;
+static Uint32 last_stats = 0;
+
+static int EpollThreadProc(void* params);
+
+static int setNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	if(flags < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int startEpoll()
+{
+	epoll_fd = epoll_create(PULLER_MAX_EVENTS);
+	if(epoll_fd < 0) {
+		perror("TCP-INPUT-MODULE: epoll_create");
+		return -1;
+	}
+	last_stats = SDL_GetTicks();
+	epoll_running = 1;
+	if((EpollThread = SDL_CreateThread(&EpollThreadProc, NULL)) == 0)
+	{
+		fprintf(stderr,"TCP-INPUT-MODULE: could not start receiving thread!!\n");
+		epoll_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static int startPuller(ChunkPuller *p, const int port)
 {
 	struct sockaddr_in servaddr;
+	struct epoll_event ev;
 	int r;
 
-#ifdef _WIN32
-	{
-		WORD wVersionRequested;
-		WSADATA wsaData;
-		int err;
+	p->port = port;
+	p->accept_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (p->accept_fd < 0) {
+		perror("cannot create socket!\n");
+		return -1;
+	}
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	servaddr.sin_port = htons(port);
+	r = bind(p->accept_fd, (struct sockaddr *)&servaddr, sizeof(servaddr));
+	if (r < 0) {
+		perror("cannot bind to port!\n");
+		return -1;
+	}
+	if(listen(p->accept_fd, 10) < 0 || setNonBlocking(p->accept_fd) < 0) {
+		perror("TCP-INPUT-MODULE: cannot listen");
+		return -1;
+	}
 
-		wVersionRequested = MAKEWORD(2, 2);
-		err = WSAStartup(wVersionRequested, &wsaData);
-		if (err != 0) {
-			fprintf(stderr, "WSAStartup failed with error: %d\n", err);
-			return -1;
+	if(epoll_fd < 0 && startEpoll() < 0)
+		return -1;
+
+	p->listener = calloc(1, sizeof(PullerConn));
+	if(!p->listener)
+		return -1;
+	p->listener->fd = p->accept_fd;
+	p->listener->puller = p;
+	p->listener->state = CONN_LISTEN;
+	ev.events = EPOLLIN;
+	ev.data.ptr = p->listener;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, p->accept_fd, &ev) < 0) {
+		perror("TCP-INPUT-MODULE: epoll_ctl");
+		return -1;
+	}
+
+	fprintf(stderr,"listening on port %d\n", port);
+
+	return p->accept_fd;
+}
+
+static void ConnClose(PullerConn *c)
+{
+	PullerConn **pc;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	for(pc = &conns; *pc; pc = &(*pc)->next)
+		if(*pc == c) {
+			*pc = c->next;
+			break;
+		}
+	conns_num--;
+	fprintf(stderr,"TCP-INPUT-MODULE: fd %d closed after %u chunks, %d connections left\n", c->fd, c->chunks, conns_num);
+	ConnFree(c);
+}
+
+static void ConnAccept(ChunkPuller *p)
+{
+	struct epoll_event ev;
+	PullerConn *c;
+	int fd;
+
+	for(;;) {
+		fd = accept(p->accept_fd, NULL, NULL);
+		if (fd < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("TCP-INPUT-MODULE: accept error");
+			return;
+		}
+		c = setNonBlocking(fd) < 0 ? NULL : ConnCreate(fd, p);
+		if(!c) {
+			fprintf(stderr,"TCP-INPUT-MODULE: cannot serve fd %d\n", fd);
+			close(fd);
+			continue;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("TCP-INPUT-MODULE: epoll_ctl");
+			ConnFree(c);
+			close(fd);
+			continue;
 		}
+		c->next = conns;
+		conns = c;
+		conns_num++;
+		fprintf(stderr,"TCP-INPUT-MODULE: accept: fd =%d on port %d, %d connections\n", fd, p->port, conns_num);
 	}
-#endif
-  
-	accept_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (accept_fd < 0) {
+}
+
+static void ConnRead(PullerConn *c)
+{
+	int reads, n, drained;
+
+	for(reads = 0; reads < PULLER_READS_PER_EVENT; reads++) {
+		n = ConnRecv(c, &drained);
+		if(n > 0) {
+			//level triggered: if more arrives epoll tells again, no need for a recv that fails
+			if(drained)
+				return;
+			continue;
+		}
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			perror("TCP-INPUT-MODULE: recv error:");
+		} else if(c->state != CONN_LENGTH || c->got > 0)
+			fprintf(stderr, "TCP-INPUT-MODULE: close during chunk receive\n");
+		ConnClose(c);
+		return;
+	}
+}
+
+//aggregate throughput since the last call and the backlog of every pusher
+static void PrintPullerStats(Uint32 now)
+{
+	PullerConn *c;
+	Uint32 elapsed = now - last_stats;
+	int queued;
+
+	if(elapsed == 0)
+		elapsed = 1;
+	fprintf(stderr, "TCP-INPUT-MODULE: %d connections, %.1f kbit/s, %.1f chunks/s, %llu bytes and %u chunks in total, %.2f syscalls per chunk\n",
+		conns_num, (total_bytes - last_bytes) * 8.0 / elapsed, (total_chunks - last_chunks) * 1000.0 / elapsed,
+		(unsigned long long)total_bytes, total_chunks, total_chunks ? (double)total_syscalls / total_chunks : 0.0);
+	for(c = conns; c; c = c->next) {
+		//bytes waiting in the socket plus the part of the current chunk not yet read
+		if(ioctl(c->fd, FIONREAD, &queued) < 0)
+			queued = 0;
+		fprintf(stderr, "TCP-INPUT-MODULE:   fd %d port %d: %llu bytes, %u chunks, %u dropped, %u recv, backlog %d bytes queued, %u/%u of the current chunk\n",
+			c->fd, c->puller->port, (unsigned long long)c->bytes, c->chunks, c->dropped, c->recvs, queued,
+			c->state == CONN_LENGTH ? 0 : c->got, c->state == CONN_LENGTH ? 0 : c->size);
+	}
+	last_bytes = total_bytes;
+	last_chunks = total_chunks;
+	last_stats = now;
+}
+
+static int EpollThreadProc(void* params)
+{
+	struct epoll_event events[PULLER_MAX_EVENTS];
+	PullerConn *c;
+	Uint32 now;
+	int i, n;
+
+	fprintf(stderr,"TCP-INPUT-MODULE: receive thread created\n");
+
+	while(epoll_running) {
+		n = epoll_wait(epoll_fd, events, PULLER_MAX_EVENTS, 100);
+		total_syscalls++;
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("TCP-INPUT-MODULE: epoll_wait");
+			break;
+		}
+		for(i = 0; i < n; i++) {
+			c = (PullerConn *)events[i].data.ptr;
+			if(c->state == CONN_LISTEN)
+				ConnAccept(c->puller);
+			else
+				ConnRead(c);
+		}
+		now = SDL_GetTicks();
+		if(now - last_stats >= PULLER_STATS_INTERVAL_MS)
+			PrintPullerStats(now);
+	}
+
+	return 0;
+}
+
+static void finalizePuller(ChunkPuller *p)
+{
+	if(p->accept_fd >= 0)
+		close(p->accept_fd);
+	p->accept_fd = -1;
+	free(p->listener);
+	p->listener = NULL;
+}
+
+static void stopEpoll()
+{
+	if(epoll_fd < 0)
+		return;
+	epoll_running = 0;
+	if(EpollThread)
+		SDL_WaitThread(EpollThread, NULL);
+	EpollThread = NULL;
+	PrintPullerStats(SDL_GetTicks());
+	while(conns)
+		ConnClose(conns);
+	close(epoll_fd);
+	epoll_fd = -1;
+}
+#else
+static int RecvThreadProc(void* params);
+static int AcceptThreadProc(void* params);
+
+static int startPuller(ChunkPuller *p, const int port)
+{
+	struct sockaddr_in servaddr;
+	int r;
+
+	p->port = port;
+	p->socket_fd = -1;
+	p->accept_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (p->accept_fd < 0) {
 		perror("cannot create socket!\n");
 		return -1;
 	}
 	servaddr.sin_family = AF_INET;
 	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
 	servaddr.sin_port = htons(port);
-	r = bind(accept_fd, (struct sockaddr *)&servaddr, sizeof(servaddr));
+	r = bind(p->accept_fd, (struct sockaddr *)&servaddr, sizeof(servaddr));
 	if (r < 0) {
 		perror("cannot bind to port!\n");
 		return -1;
@@ -78,42 +599,86 @@ int initChunkPuller(const int port)
 	
 	fprintf(stderr,"listening on port %d\n", port);
 	
-	if((AcceptThread = SDL_CreateThread(&AcceptThreadProc, NULL)) == 0)
+	if((p->AcceptThread = SDL_CreateThread(&AcceptThreadProc, p)) == 0)
 	{
 		fprintf(stderr,"TCP-INPUT-MODULE: could not start accepting thread!!\n");
 		return -1;
 	}
 	
-	return accept_fd;
+	return p->accept_fd;
+}
+#endif
+
+int initChunkPuller(const int port)
+{
+#ifdef _WIN32
+	{
+		WORD wVersionRequested;
+		WSADATA wsaData;
+		int err;
+
+		wVersionRequested = MAKEWORD(2, 2);
+		err = WSAStartup(wVersionRequested, &wsaData);
+		if (err != 0) {
+			fprintf(stderr, "WSAStartup failed with error: %d\n", err);
+			return -1;
+		}
+	}
+#endif
+  
+	return startPuller(&main_puller, port);
+}
+
+int initFeedPuller(const int port, ChunkRing *ring)
+{
+	ChunkPuller *p;
+
+	if(feed_pullers_num >= MAX_CHANNELS_NUM)
+		return -1;
+	p = calloc(1, sizeof(ChunkPuller));
+	if(!p)
+		return -1;
+	p->accept_fd = -1;
+	p->ring = ring;
+	if(startPuller(p, port) < 0) {
+		//nothing refers to p yet, the caller drops the ring
+		finalizePuller(p);
+		free(p);
+		return -1;
+	}
+	feed_pullers[feed_pullers_num++] = p;
+	return p->accept_fd;
 }
 
+#ifndef __linux__
 static int AcceptThreadProc(void* params)
 {
+    ChunkPuller *p = (ChunkPuller *)params;
     int fd = -1;
     
-    isRunning = 1;
+    p->isRunning = 1;
 
-    listen(accept_fd, 10);
+    listen(p->accept_fd, 10);
     
-    while(isRunning)
+    while(p->isRunning)
     {
 		fprintf(stderr,"TCP-INPUT-MODULE: waiting for connection...\n");
-		fd = accept(accept_fd, NULL, NULL);
+		fd = accept(p->accept_fd, NULL, NULL);
 		if (fd < 0) {
 			perror("TCP-INPUT-MODULE: accept error");
 			continue;
 		}
 		fprintf(stderr,"TCP-INPUT-MODULE: accept: fd =%d\n", fd);
-		if(socket_fd != -1)
+		if(p->socket_fd != -1)
 		{
-			isReceving = 0;
+			p->isReceving = 0;
 			fprintf(stderr,"TCP-INPUT-MODULE: waiting for receive thread to terminate...\n");
-			SDL_WaitThread(RecvThread, NULL);
+			SDL_WaitThread(p->RecvThread, NULL);
 			fprintf(stderr,"TCP-INPUT-MODULE: receive thread terminated\n");
 		}
-		socket_fd = fd;
-		isReceving = 1;
-		if((RecvThread = SDL_CreateThread(&RecvThreadProc, NULL)) == 0)
+		p->socket_fd = fd;
+		p->isReceving = 1;
+		if((p->RecvThread = SDL_CreateThread(&RecvThreadProc, p)) == 0)
 		{
 			fprintf(stderr,"TCP-INPUT-MODULE: could not start receveing thread!!\n");
 			return 0;
@@ -125,18 +690,15 @@ static int AcceptThreadProc(void* params)
 
 static int RecvThreadProc(void* params)
 {
+	ChunkPuller *p = (ChunkPuller *)params;
+	PullerConn *c = ConnCreate(p->socket_fd, p);
 	int ret = -1;
-	uint32_t fragment_size = 0;
-	uint8_t* buffer = (uint8_t*) malloc(TCP_BUF_SIZE);
+	int drained;
 
 	fprintf(stderr,"TCP-INPUT-MODULE: receive thread created\n");
 
-	while(isReceving) {
-		int b;
-
-		ret=recv(socket_fd, &fragment_size, sizeof(uint32_t), 0);
-		fragment_size = ntohl(fragment_size);
-
+	while(c && p->isReceving) {
+		ret = ConnRecv(c, &drained);
 		if(ret < 0) {
 			perror("TCP-INPUT-MODULE: recv error:");
 			break;
@@ -144,45 +706,43 @@ static int RecvThreadProc(void* params)
 			fprintf(stderr, "TCP-INPUT-MODULE: connection closed\n");
 			break;
 		}
-		//fprintf(stderr, "TCP-INPUT-MODULE: received %d bytes. Fragment size: %u\n", ret, fragment_size);
-
-		if (fragment_size > TCP_BUF_SIZE) {
-			fprintf(stderr, "TCP-INPUT-MODULE: buffer too small or some corruption, closing connection ... "); //TODO, handle this better
-			break;
-		} else if (fragment_size == 0) {	//strange, but valid
-			continue;
-		}
-
-		b = 0;
-		while(b < fragment_size) {
-			ret = recv(socket_fd, buffer + b, fragment_size - b, 0);
-			if (ret <= 0) {
-				break;
-			}
-			b += ret;
-		}
-		if (ret <= 0) {
-			fprintf(stderr, "TCP-INPUT-MODULE: error or close during chunk receive, closing connection ...");
-		}
-		//fprintf(stderr, "TCP-INPUT-MODULE: received %d bytes.\n", ret);
-		
-		if(enqueueBlock(buffer, fragment_size))
-			fprintf(stderr, "TCP-INPUT-MODULE: could not enqueue a received chunk!! \n");
 	}
-	free(buffer);
-	close(socket_fd);
-	socket_fd = -1;
+	if(c) {
+		fprintf(stderr, "TCP-INPUT-MODULE: %u chunks in %u recv\n", c->chunks, c->recvs);
+		ConnFree(c);
+	}
+	close(p->socket_fd);
+	p->socket_fd = -1;
 
 	return 0;
 }
 
-void finalizeChunkPuller()
+static void finalizePuller(ChunkPuller *p)
 {
-	isRunning = 0;
-	SDL_KillThread(AcceptThread);
+	p->isRunning = 0;
+	if(p->AcceptThread)
+		SDL_KillThread(p->AcceptThread);
 	
-	if(socket_fd > 0)
-		close(socket_fd);
+	if(p->socket_fd > 0)
+		close(p->socket_fd);
+
+	close(p->accept_fd);
+}
 
-	close(accept_fd);
+#endif
+
+void finalizeChunkPuller()
+{
+	int i;
+
+#ifdef __linux__
+	//no more events once the thread is gone, the listeners can go
+	stopEpoll();
+#endif
+	finalizePuller(&main_puller);
+	for(i = 0; i < feed_pullers_num; i++) {
+		finalizePuller(feed_pullers[i]);
+		free(feed_pullers[i]);
+	}
+	feed_pullers_num = 0;
 }
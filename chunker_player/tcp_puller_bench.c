@@ -0,0 +1,297 @@
+/*
+ *  Copyright (c) 2009-2011 Carmelo Daniele, Dario Marchese, Diego Reforgiato, Giuseppe Tropea
+ *  developed for the Napa-Wine EU project. See www.napa-wine.eu
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+/*
+ * loopback driver for the TCP puller. a pusher thread sends a mix of small
+ * (audio) and large (video) chunks, framed as the streamer frames them: a 32
+ * bits length then the chunk, in one sendmsg. the same stream is received
+ * twice: by the old framing, a recv for the length then recv calls for the
+ * payload until EAGAIN, and by the puller. both count their recv and
+ * epoll_wait calls per chunk.
+ * usage: ./tcp_puller_bench [chunks] [video_bytes] [audio_bytes] [audio_per_video] [pace_us]
+ * pace_us is the pause after every chunk, 0 sends as fast as possible
+ */
+
+//the syscall and chunk counters of the puller are static
+#include "tcp_chunk_puller.c"
+
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#define BENCH_PORT 6190
+#define BENCH_RING_SLOTS 256
+#define BENCH_TIMEOUT_MS 30000
+
+static int chunks_num = 20000;
+static int video_bytes = 60000;
+static int audio_bytes = 1200;
+static int audio_per_video = 4;
+static int pace_us = 0;
+
+static ChunkRing *bench_ring;
+static volatile unsigned int received;
+static volatile unsigned int corrupted;
+static volatile int draining;
+
+//the puller of a player hands its chunks over through these
+int enqueueBlock(const uint8_t *block, const int block_size)
+{
+	return ChunkRingPush(bench_ring, block, block_size);
+}
+
+uint8_t *reserveBlock(const int block_size)
+{
+	return ChunkRingReserve(bench_ring, block_size);
+}
+
+void commitBlock(const int block_size)
+{
+	ChunkRingCommit(bench_ring, block_size);
+}
+
+static int chunkSize(int i)
+{
+	return i % (audio_per_video + 1) == 0 ? video_bytes : audio_bytes;
+}
+
+//every chunk starts with its number and is filled with its low byte
+static void chunkFill(uint8_t *chunk, int size, uint32_t i)
+{
+	memset(chunk, (uint8_t)i, size);
+	memcpy(chunk, &i, sizeof(i));
+}
+
+static void chunkCheck(const uint8_t *chunk, int size)
+{
+	uint32_t i;
+
+	memcpy(&i, chunk, sizeof(i));
+	if(i >= (uint32_t)chunks_num || size != chunkSize(i) || chunk[size - 1] != (uint8_t)i)
+		corrupted++;
+}
+
+static int PusherThreadProc(void *params)
+{
+	int port = *(int *)params;
+	struct sockaddr_in addr;
+	struct msghdr msg;
+	struct iovec iov[2];
+	uint8_t *chunk = malloc(video_bytes > audio_bytes ? video_bytes : audio_bytes);
+	uint32_t length;
+	int fd, i;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if(!chunk || fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("BENCH: cannot connect");
+		free(chunk);
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	for(i = 0; i < chunks_num; i++) {
+		int size = chunkSize(i);
+		int sent = 0, n;
+
+		chunkFill(chunk, size, i);
+		length = htonl(size);
+		iov[0].iov_base = &length;
+		iov[0].iov_len = sizeof(length);
+		iov[1].iov_base = chunk;
+		iov[1].iov_len = size;
+		while(sent < (int)sizeof(length) + size) {
+			n = sendmsg(fd, &msg, 0);
+			if(n < 0) {
+				perror("BENCH: send");
+				goto out;
+			}
+			sent += n;
+			//move the vector past what went out
+			while(n > 0 && msg.msg_iovlen > 0) {
+				if((size_t)n < msg.msg_iov[0].iov_len) {
+					msg.msg_iov[0].iov_base = (uint8_t *)msg.msg_iov[0].iov_base + n;
+					msg.msg_iov[0].iov_len -= n;
+					n = 0;
+				} else {
+					n -= msg.msg_iov[0].iov_len;
+					msg.msg_iov++;
+					msg.msg_iovlen--;
+				}
+			}
+		}
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		if(pace_us)
+			usleep(pace_us);
+	}
+out:
+	close(fd);
+	free(chunk);
+	return 0;
+}
+
+static int DrainThreadProc(void *params)
+{
+	const uint8_t *chunk;
+	int size;
+
+	while(draining) {
+		chunk = ChunkRingPeek(bench_ring, &size, 100);
+		if(!chunk)
+			continue;
+		chunkCheck(chunk, size);
+		received++;
+		ChunkRingRelease(bench_ring);
+	}
+	return 0;
+}
+
+//throughput includes the handover to the consumer, a ring and a thread for the puller
+static void printResult(const char *name, unsigned int chunks, unsigned int syscalls, unsigned int dropped, Uint32 ms)
+{
+	unsigned long long bytes = 0;
+	unsigned int i;
+
+	for(i = 0; i < chunks; i++)
+		bytes += chunkSize(i);
+	printf("%-14s %6u chunks %8u syscalls %6.2f per chunk %8.1f Mbit/s %u dropped %u corrupted\n",
+		name, chunks, syscalls, chunks ? (double)syscalls / chunks : 0.0,
+		ms ? bytes * 8.0 / ms / 1000.0 : 0.0, dropped, corrupted);
+}
+
+//the receive loop of the puller before the framing was batched
+static void runOldFraming(int port)
+{
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	SDL_Thread *pusher;
+	uint8_t length[sizeof(uint32_t)];
+	uint8_t *payload = malloc(TCP_BUF_SIZE);
+	uint32_t size = 0, got = 0;
+	int in_length = 1;
+	unsigned int recvs = 0, waits = 0;
+	int listen_fd, fd, efd, one = 1, n, reads;
+	Uint32 start;
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if(!payload || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0) {
+		perror("BENCH: cannot listen");
+		exit(1);
+	}
+	corrupted = 0;
+	start = SDL_GetTicks();
+	pusher = SDL_CreateThread(&PusherThreadProc, &port);
+	fd = accept(listen_fd, NULL, NULL);
+	setNonBlocking(fd);
+	efd = epoll_create(1);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+
+	received = 0;
+	while(received < (unsigned int)chunks_num) {
+		n = epoll_wait(efd, &ev, 1, 100);
+		waits++;
+		if(n <= 0)
+			continue;
+		for(reads = 0; reads < PULLER_READS_PER_EVENT; reads++) {
+			if(in_length)
+				n = recv(fd, length + got, sizeof(uint32_t) - got, 0);
+			else
+				n = recv(fd, payload + got, size - got, 0);
+			recvs++;
+			if(n <= 0)
+				break;
+			got += n;
+			if(in_length && got == sizeof(uint32_t)) {
+				memcpy(&size, length, sizeof(size));
+				size = ntohl(size);
+				in_length = 0;
+				got = 0;
+			} else if(!in_length && got == size) {
+				chunkCheck(payload, size);
+				received++;
+				in_length = 1;
+				got = 0;
+			}
+		}
+		if(n == 0)
+			break;
+	}
+	printResult("old framing", received, recvs + waits, 0, SDL_GetTicks() - start);
+	SDL_WaitThread(pusher, NULL);
+	close(efd);
+	close(fd);
+	close(listen_fd);
+	free(payload);
+}
+
+static void runPuller(int port)
+{
+	SDL_Thread *pusher, *drain;
+	Uint32 start;
+
+	bench_ring = ChunkRingCreate(BENCH_RING_SLOTS);
+	if(!bench_ring || initFeedPuller(port, bench_ring) < 0) {
+		fprintf(stderr, "BENCH: cannot start the puller on port %d\n", port);
+		exit(1);
+	}
+	received = 0;
+	corrupted = 0;
+	draining = 1;
+	drain = SDL_CreateThread(&DrainThreadProc, NULL);
+	//leave out the calls made while nothing was connected
+	total_syscalls = 0;
+	total_chunks = 0;
+	start = SDL_GetTicks();
+	pusher = SDL_CreateThread(&PusherThreadProc, &port);
+	//chunks that find the ring full are dropped, as they would be in the player
+	while(received + ChunkRingDropped(bench_ring) < (unsigned int)chunks_num
+		&& SDL_GetTicks() - start < BENCH_TIMEOUT_MS)
+		usleep(1000);
+	printResult("batched puller", total_chunks, total_syscalls, ChunkRingDropped(bench_ring), SDL_GetTicks() - start);
+	SDL_WaitThread(pusher, NULL);
+	draining = 0;
+	SDL_WaitThread(drain, NULL);
+	finalizeChunkPuller();
+	ChunkRingDestroy(bench_ring);
+}
+
+int main(int argc, char *argv[])
+{
+	if(argc > 1)
+		chunks_num = atoi(argv[1]);
+	if(argc > 2)
+		video_bytes = atoi(argv[2]);
+	if(argc > 3)
+		audio_bytes = atoi(argv[3]);
+	if(argc > 4)
+		audio_per_video = atoi(argv[4]);
+	if(argc > 5)
+		pace_us = atoi(argv[5]);
+	if(chunks_num <= 0 || video_bytes < (int)sizeof(uint32_t) || audio_bytes < (int)sizeof(uint32_t) || audio_per_video < 0
+		|| video_bytes > TCP_BUF_SIZE || audio_bytes > TCP_BUF_SIZE) {
+		fprintf(stderr, "usage: %s [chunks] [video_bytes] [audio_bytes] [audio_per_video] [pace_us]\n", argv[0]);
+		return 1;
+	}
+	printf("%d chunks: one of %d bytes every %d of %d bytes, %d us between chunks\n",
+		chunks_num, video_bytes, audio_per_video, audio_bytes, pace_us);
+	runOldFraming(BENCH_PORT + 1);
+	runPuller(BENCH_PORT);
+	return 0;
+}
@@ -0,0 +1,25 @@
+#!/bin/bash
+# packets/s and CPU per Gbit of the UDP output and input over loopback, for 1, 2 and 4 quality levels
+# usage: ./udp_bench.sh [rounds] [fec]
+# build the driver first: make udp_loopback_bench
+
+ROUNDS=${1:-2000}
+FEC=${2:-0}
+
+cd `dirname $0`
+[ -x ./udp_loopback_bench ] || { echo "build udp_loopback_bench first (make udp_loopback_bench)"; exit 1; }
+
+#packets/s and ms CPU per Gbit from the lines both ends print on close
+run() {
+	./udp_loopback_bench $1 $2 $3 $4 $FEC $ROUNDS 2>&1 | sed -n \
+		-e 's/^UDP OUTPUT MODULE: .* \([0-9]*\) packets\/s, .*, \([0-9.]*\) ms CPU per Gbit$/\1 \2/p' \
+		-e 's/^UDP-INPUT-MODULE: .* \([0-9.]*\) ms per Gbit$/\1/p' | tr '\n' ' '
+}
+
+printf "%-8s %-24s %-12s %-16s %-16s\n" "levels" "send" "packets/s" "send ms/Gbit" "recv ms/Gbit"
+for q in 1 2 4; do
+	for mode in "1 0 0 one per call" "32 0 0 sendmmsg 32" "32 1 0 GSO" "32 1 1 GSO and GRO"; do
+		set -- $mode
+		printf "%-8s %-24s %-12s %-16s %-16s\n" $q "${*:4}" `run $q $1 $2 $3`
+	done
+done
@@ -0,0 +1,433 @@
+/*
+ *  Copyright (c) 2009-2011 Carmelo Daniele, Dario Marchese, Diego Reforgiato, Giuseppe Tropea
+ *  developed for the Napa-Wine EU project. See www.napa-wine.eu
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+#include <unistd.h>
+#include <time.h>
+#ifdef __linux__
+#include <netinet/udp.h>
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+//handle threads through SDL
+#include <SDL.h>
+#include <SDL_thread.h>
+
+#include "external_chunk_transcoding.h"
+#include "chunker_player.h"
+#include "player_stats.h"
+
+//largest encoded chunk accepted, as for the TCP input
+#define UDP_MAX_CHUNK_SIZE 65536*16
+#define UDP_DATAGRAM_SIZE 65536
+//without GRO a datagram carries a single fragment
+#define UDP_FRAGMENT_DATAGRAM_SIZE 2048
+//a burst of large chunks must not overflow the socket
+#define UDP_RECV_BUFFER_SIZE (4*1024*1024)
+//chunks being reassembled at the same time
+#define UDP_REASSEMBLY_SLOTS 16
+//a chunk still missing fragments after this long is given up
+#define UDP_REASSEMBLY_TIMEOUT_MS 500
+//sequences remembered as finished, late fragments of them are ignored
+#define UDP_SEQ_WINDOW 1024
+
+typedef struct Reassembly {
+	int in_use;
+	uint32_t seq;
+	uint32_t size;
+	uint16_t count;
+	uint16_t received;
+	Uint32 first_ticks; //arrival of the first fragment
+	uint8_t *data;
+	uint32_t data_capacity;
+	uint8_t *have; //one flag per fragment
+	uint16_t have_capacity;
+} Reassembly;
+
+static int fd = -1;
+static volatile int isRunning = 0;
+static SDL_Thread *RecvThread = NULL;
+static Reassembly table[UDP_REASSEMBLY_SLOTS];
+static int seq_started = 0;
+static uint32_t highest_seq;
+static uint32_t done_seq[UDP_SEQ_WINDOW];
+
+static unsigned long long datagrams_received = 0;
+static unsigned long long fragments_received = 0;
+static unsigned long long bytes_received = 0;
+static unsigned long long recv_calls = 0;
+static Uint32 first_packet_ticks = 0;
+static Uint32 last_packet_ticks = 0;
+
+static void FinishSeq(uint32_t seq)
+{
+	done_seq[seq % UDP_SEQ_WINDOW] = seq;
+}
+
+static void GiveUp(Reassembly *r)
+{
+	r->in_use = 0;
+	FinishSeq(r->seq);
+	ChunkerPlayerStats_UpdateTransport(0, 0, 0, 0, 1);
+}
+
+static void EvictStale(Uint32 now)
+{
+	int i;
+
+	for(i = 0; i < UDP_REASSEMBLY_SLOTS; i++)
+		if(table[i].in_use && now - table[i].first_ticks > UDP_REASSEMBLY_TIMEOUT_MS)
+			GiveUp(&table[i]);
+}
+
+//the entry of seq, a new one if needed: when the table is full the oldest chunk is given up
+static Reassembly *GetReassembly(uint32_t seq, uint32_t size, uint16_t count, Uint32 now)
+{
+	Reassembly *r, *free_slot = NULL, *oldest = NULL;
+	int i;
+
+	for(i = 0; i < UDP_REASSEMBLY_SLOTS; i++) {
+		r = &table[i];
+		if(!r->in_use) {
+			if(!free_slot)
+				free_slot = r;
+			continue;
+		}
+		if(r->seq == seq)
+			return (r->size == size && r->count == count) ? r : NULL;
+		if(!oldest || now - r->first_ticks > now - oldest->first_ticks)
+			oldest = r;
+	}
+	r = free_slot ? free_slot : oldest;
+	if(r->in_use)
+		GiveUp(r);
+
+	//buffers are kept and grown, the steady state allocates nothing
+	if(r->data_capacity < size) {
+		uint8_t *tmp = realloc(r->data, size);
+		if(!tmp)
+			return NULL;
+		r->data = tmp;
+		r->data_capacity = size;
+	}
+	if(r->have_capacity < count) {
+		uint8_t *tmp = realloc(r->have, count);
+		if(!tmp)
+			return NULL;
+		r->have = tmp;
+		r->have_capacity = count;
+	}
+	memset(r->have, 0, count);
+	r->in_use = 1;
+	r->seq = seq;
+	r->size = size;
+	r->count = count;
+	r->received = 0;
+	r->first_ticks = now;
+	return r;
+}
+
+//forget everything about the previous sender, e.g. after a streamer restart
+static void Resync(uint32_t seq)
+{
+	int i;
+
+	for(i = 0; i < UDP_REASSEMBLY_SLOTS; i++)
+		if(table[i].in_use)
+			GiveUp(&table[i]);
+	//a value no sequence of the new window can take
+	for(i = 0; i < UDP_SEQ_WINDOW; i++)
+		done_seq[i] = seq - UDP_SEQ_WINDOW;
+	highest_seq = seq - 1;
+	seq_started = 1;
+}
+
+static void HandleFragment(const uint8_t *datagram, int len, Uint32 now)
+{
+	uint32_t seq, size, fragment_size, offset, expected_len;
+	uint16_t index, count;
+	int32_t ahead;
+	Reassembly *r;
+
+	chunkFragmentHeaderPull(datagram, &seq, &index, &count, &size);
+	datagram += CHUNK_FRAGMENT_HEADER_SIZE;
+	len -= CHUNK_FRAGMENT_HEADER_SIZE;
+	if(count == 0 || index >= count || size > UDP_MAX_CHUNK_SIZE) {
+		fprintf(stderr, "UDP-INPUT-MODULE: bad fragment %u/%u of chunk %u\n", index, count, seq);
+		return;
+	}
+	fragment_size = chunkFragmentPayloadSize(size, count);
+	offset = index * fragment_size;
+	expected_len = (index == count - 1) ? size - offset : fragment_size;
+	if(offset > size || len != expected_len) {
+		fprintf(stderr, "UDP-INPUT-MODULE: fragment %u/%u of chunk %u has %d bytes instead of %u\n", index, count, seq, len, expected_len);
+		return;
+	}
+
+	ahead = (int32_t)(seq - highest_seq);
+	if(!seq_started || ahead >= UDP_SEQ_WINDOW || ahead <= -UDP_SEQ_WINDOW) {
+		if(seq_started)
+			fprintf(stderr, "UDP-INPUT-MODULE: sequence jumped from %u to %u, new sender?\n", highest_seq, seq);
+		Resync(seq);
+		ahead = 1;
+	}
+	if(ahead > 0) {
+		//the chunks skipped are expected too, they count as lost unless they show up late
+		ChunkerPlayerStats_UpdateTransport(0, 0, ahead, 0, 0);
+		highest_seq = seq;
+	} else if(done_seq[seq % UDP_SEQ_WINDOW] == seq) {
+		ChunkerPlayerStats_UpdateTransport(1, 1, 0, 0, 0);
+		return;
+	}
+
+	r = GetReassembly(seq, size, count, now);
+	if(!r) {
+		ChunkerPlayerStats_UpdateTransport(1, 1, 0, 0, 0);
+		return;
+	}
+	if(r->have[index]) {
+		ChunkerPlayerStats_UpdateTransport(1, 1, 0, 0, 0);
+		return;
+	}
+	r->have[index] = 1;
+	r->received++;
+	memcpy(r->data + offset, datagram, len);
+	ChunkerPlayerStats_UpdateTransport(1, 0, 0, 0, 0);
+
+	if(r->received == r->count) {
+		if(enqueueBlock(r->data, r->size) < 0)
+			fprintf(stderr, "UDP-INPUT-MODULE: could not enqueue a received chunk!! \n");
+		r->in_use = 0;
+		FinishSeq(seq);
+		ChunkerPlayerStats_UpdateTransport(0, 0, 0, 1, 0);
+	}
+}
+
+//a datagram coalesced by GRO holds fragments of segment_size bytes, the last one possibly shorter
+static void HandleDatagram(const uint8_t *datagram, int len, int segment_size, Uint32 now)
+{
+	int l;
+
+	if(datagrams_received++ == 0)
+		first_packet_ticks = now;
+	last_packet_ticks = now;
+	bytes_received += len;
+	if(segment_size <= 0)
+		segment_size = len;
+	while(len > 0) {
+		l = len < segment_size ? len : segment_size;
+		if(l >= CHUNK_FRAGMENT_HEADER_SIZE)
+			HandleFragment(datagram, l, now);
+		fragments_received++;
+		datagram += l;
+		len -= l;
+	}
+}
+
+#ifdef __linux__
+static int GroSegmentSize(struct msghdr *msg)
+{
+	struct cmsghdr *cm;
+
+	for(cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm))
+		if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+			return *(int *)CMSG_DATA(cm);
+	return 0;
+}
+#endif
+
+static void PrintReceiveStats()
+{
+	double elapsed = (last_packet_ticks - first_packet_ticks) / 1000.0;
+#ifdef __linux__
+	struct timespec cpu;
+	double cpu_ms;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+	cpu_ms = cpu.tv_sec * 1000.0 + cpu.tv_nsec / 1e6;
+#endif
+	if(elapsed <= 0)
+		elapsed = 1;
+	fprintf(stderr, "UDP-INPUT-MODULE: %llu fragments in %llu datagrams and %llu recv calls, %.0f packets/s, %.1f Mbit/s\n",
+		fragments_received, datagrams_received, recv_calls, fragments_received / elapsed, bytes_received * 8 / elapsed / 1e6);
+#ifdef __linux__
+	if(bytes_received)
+		fprintf(stderr, "UDP-INPUT-MODULE: receive thread used %.1f ms CPU, %.1f ms per Gbit\n", cpu_ms, cpu_ms / (bytes_received * 8 / 1e9));
+#endif
+}
+
+static int RecvThreadProc(void* params)
+{
+	int batch = udp_batch < 1 ? 1 : udp_batch;
+	int buffer_size = udp_gro ? UDP_DATAGRAM_SIZE : UDP_FRAGMENT_DATAGRAM_SIZE;
+	uint8_t *buffers;
+	Uint32 now, last_eviction = SDL_GetTicks();
+	int n;
+#ifdef __linux__
+	//one buffer, iovec and control block per datagram of a batch
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	char *controls;
+	const int control_size = CMSG_SPACE(sizeof(int));
+	int k;
+
+	if(batch > UIO_MAXIOV)
+		batch = UIO_MAXIOV;
+	msgs = calloc(batch, sizeof(struct mmsghdr));
+	iovs = calloc(batch, sizeof(struct iovec));
+	controls = calloc(batch, control_size);
+	if(!msgs || !iovs || !controls)
+		return -1;
+#else
+	batch = 1;
+#endif
+	buffers = (uint8_t*) malloc(batch * buffer_size);
+	if(!buffers)
+		return -1;
+	fprintf(stderr,"UDP-INPUT-MODULE: receive thread created, %d datagrams per recv%s\n", batch, udp_gro ? ", GRO" : "");
+
+	while(isRunning) {
+#ifdef __linux__
+		for(k = 0; k < batch; k++) {
+			iovs[k].iov_base = buffers + k * buffer_size;
+			iovs[k].iov_len = buffer_size;
+			memset(&msgs[k].msg_hdr, 0, sizeof(struct msghdr));
+			msgs[k].msg_hdr.msg_iov = &iovs[k];
+			msgs[k].msg_hdr.msg_iovlen = 1;
+			msgs[k].msg_hdr.msg_control = controls + k * control_size;
+			msgs[k].msg_hdr.msg_controllen = control_size;
+		}
+		//waits for the first datagram only, then takes what is already queued
+		n = recvmmsg(fd, msgs, batch, MSG_WAITFORONE, NULL);
+		recv_calls++;
+		now = SDL_GetTicks();
+		for(k = 0; k < n; k++)
+			HandleDatagram(buffers + k * buffer_size, msgs[k].msg_len, GroSegmentSize(&msgs[k].msg_hdr), now);
+#else
+		n = recv(fd, buffers, buffer_size, 0);
+		recv_calls++;
+		now = SDL_GetTicks();
+		if(n > 0)
+			HandleDatagram(buffers, n, 0, now);
+#endif
+		if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			perror("UDP-INPUT-MODULE: recv error");
+			SDL_Delay(100);
+		}
+		if(now - last_eviction >= UDP_REASSEMBLY_TIMEOUT_MS / 4) {
+			EvictStale(now);
+			last_eviction = now;
+		}
+	}
+	PrintReceiveStats();
+	free(buffers);
+#ifdef __linux__
+	free(msgs);
+	free(iovs);
+	free(controls);
+#endif
+
+	return 0;
+}
+
+int initChunkPuller(const int port)
+{
+	struct sockaddr_in servaddr;
+	int rcvbuf = UDP_RECV_BUFFER_SIZE;
+#ifdef _WIN32
+	DWORD timeout = 100;
+	{
+		WORD wVersionRequested;
+		WSADATA wsaData;
+		int err;
+
+		wVersionRequested = MAKEWORD(2, 2);
+		err = WSAStartup(wVersionRequested, &wsaData);
+		if (err != 0) {
+			fprintf(stderr, "WSAStartup failed with error: %d\n", err);
+			return -1;
+		}
+	}
+#else
+	//wake up now and then to give up stale chunks and to notice the end
+	struct timeval timeout = { 0, 100000 };
+#endif
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("cannot create socket!\n");
+		return -1;
+	}
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	servaddr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+		perror("cannot bind to port!\n");
+		return -1;
+	}
+	if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (const char *)&rcvbuf, sizeof(rcvbuf)) < 0)
+		perror("UDP-INPUT-MODULE: cannot enlarge the receive buffer");
+	if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) < 0)
+		perror("UDP-INPUT-MODULE: cannot set the receive timeout");
+#ifdef __linux__
+	if(udp_gro) {
+		int one = 1;
+		if(setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0) {
+			perror("UDP-INPUT-MODULE: no GRO, one datagram per fragment");
+			udp_gro = 0;
+		}
+	}
+#else
+	udp_gro = 0;
+#endif
+
+	fprintf(stderr,"listening on UDP port %d\n", port);
+
+	isRunning = 1;
+	if((RecvThread = SDL_CreateThread(&RecvThreadProc, NULL)) == 0)
+	{
+		fprintf(stderr,"UDP-INPUT-MODULE: could not start receiving thread!!\n");
+		isRunning = 0;
+		return -1;
+	}
+
+	return fd;
+}
+
+void finalizeChunkPuller()
+{
+	int i;
+
+	isRunning = 0;
+	if(RecvThread)
+		SDL_WaitThread(RecvThread, NULL);
+	RecvThread = NULL;
+	if(fd >= 0)
+		close(fd);
+	fd = -1;
+	for(i = 0; i < UDP_REASSEMBLY_SLOTS; i++) {
+		free(table[i].data);
+		free(table[i].have);
+	}
+	memset(table, 0, sizeof(table));
+	ChunkerPlayerStats_PrintTransport();
+}
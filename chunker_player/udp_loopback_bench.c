@@ -0,0 +1,156 @@
+/*
+ *  Copyright (c) 2009-2011 Carmelo Daniele, Dario Marchese, Diego Reforgiato, Giuseppe Tropea
+ *  developed for the Napa-Wine EU project. See www.napa-wine.eu
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+/*
+ * loopback driver of the UDP output of the streamer and the UDP input of the
+ * player. chunks go through pushChunkUDP as the streamer sends them: every
+ * round one audio chunk and one video chunk per quality level, a third of the
+ * bytes of the level above, as the encoders of --qualitylevels are set up.
+ * both ends print on close their packets/s, Mbit/s and CPU per Gbit, the
+ * driver checks the chunks delivered.
+ * usage: ./udp_loopback_bench [qualitylevels] [udp_batch] [udp_gso 0/1] [udp_gro 0/1] [fec n] [rounds] [pace_us]
+ * udp_batch is used by both ends, pace_us is the pause after every round
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "external_chunk_transcoding.h"
+#include "chunk_fec.h"
+#include "chunker_metadata.h"
+#include "chunk_pusher.h"
+#include "chunker_player.h"
+#include "chunk_puller.h"
+
+#define BENCH_PORT 6199
+#define BENCH_VIDEO_BYTES 60000
+#define BENCH_AUDIO_BYTES 1200
+#define BENCH_QUALITYLEVELS_MAX 4
+//left to the puller to drain the socket before it is closed
+#define BENCH_DRAIN_US 500000
+
+//what the streamer defines and the UDP output uses
+ChunkerMetadata *cmeta;
+int udp_gso;
+int fec_window;
+
+static int *chunk_sizes; //by sequence number
+static int chunks_num;
+static FecDecoder fec;
+static unsigned int delivered;
+static unsigned int corrupted;
+static unsigned int incomplete;
+
+//the player counts its transport losses through this
+void ChunkerPlayerStats_UpdateTransport(long int fragments, long int duplicates, long int expected, long int chunks, long int incomplete_chunks)
+{
+	incomplete += incomplete_chunks;
+}
+
+void ChunkerPlayerStats_PrintTransport()
+{
+}
+
+//every payload is filled with the low byte of its sequence number
+static void deliverChunk(const uint8_t *block, int block_size, void *arg)
+{
+	struct chunk c;
+
+	if(decodeChunkInPlace(&c, block, block_size) < 0 || c.id < 0 || c.id >= chunks_num
+		|| c.size != chunk_sizes[c.id] || c.data[0] != (uint8_t)c.id || c.data[c.size - 1] != (uint8_t)c.id) {
+		corrupted++;
+		return;
+	}
+	delivered++;
+}
+
+int enqueueBlock(const uint8_t *block, const int block_size)
+{
+	if(fec_window)
+		fecDecode(&fec, block, block_size, deliverChunk, NULL);
+	else
+		deliverChunk(block, block_size, NULL);
+	return 0;
+}
+
+static int pushChunk(ExternalChunk *echunk, int seq, int size)
+{
+	echunk->seq = seq;
+	echunk->payload_len = size;
+	memset(echunk->data, (uint8_t)seq, size);
+	chunk_sizes[seq] = size;
+	return pushChunkUDP(echunk);
+}
+
+int main(int argc, char *argv[])
+{
+	ChunkerMetadata meta;
+	ExternalChunk echunk;
+	int qualitylevels = 1, rounds = 2000, pace_us = 0;
+	int seq = 0, i, q, size;
+
+	udp_batch = UDP_BATCH_DEFAULT;
+	if(argc > 1)
+		qualitylevels = atoi(argv[1]);
+	if(argc > 2)
+		udp_batch = atoi(argv[2]);
+	if(argc > 3)
+		udp_gso = atoi(argv[3]);
+	if(argc > 4)
+		udp_gro = atoi(argv[4]);
+	if(argc > 5)
+		fec_window = atoi(argv[5]);
+	if(argc > 6)
+		rounds = atoi(argv[6]);
+	if(argc > 7)
+		pace_us = atoi(argv[7]);
+	if(qualitylevels < 1 || qualitylevels > BENCH_QUALITYLEVELS_MAX || rounds <= 0) {
+		fprintf(stderr, "usage: %s [qualitylevels] [udp_batch] [udp_gso 0/1] [udp_gro 0/1] [fec n] [rounds] [pace_us]\n", argv[0]);
+		return 1;
+	}
+
+	memset(&meta, 0, sizeof(meta));
+	cmeta = &meta; //chunk ids are the sequence numbers
+	memset(&echunk, 0, sizeof(echunk));
+	echunk.frames_num = 1;
+	echunk.data = malloc(BENCH_VIDEO_BYTES);
+	chunks_num = rounds * (qualitylevels + 1);
+	chunk_sizes = calloc(chunks_num, sizeof(int));
+	if(!echunk.data || !chunk_sizes) {
+		fprintf(stderr, "BENCH: cannot allocate %d chunks\n", chunks_num);
+		return 1;
+	}
+	fecDecoderInit(&fec);
+	if(initChunkPuller(BENCH_PORT) < 0)
+		return 1;
+	initUDPPush("127.0.0.1", BENCH_PORT);
+
+	for(i = 0; i < rounds; i++) {
+		pushChunk(&echunk, seq++, BENCH_AUDIO_BYTES);
+		for(q = 0, size = BENCH_VIDEO_BYTES; q < qualitylevels; q++, size /= 3)
+			pushChunk(&echunk, seq++, size);
+		if(pace_us)
+			usleep(pace_us);
+	}
+
+	//the fragments sent are already queued at the puller, the send rate ends here
+	finalizeUDPChunkPusher();
+	usleep(BENCH_DRAIN_US);
+	finalizeChunkPuller();
+	fecDecoderFree(&fec);
+	printf("%d quality levels, batch %d%s%s, FEC %d: %d chunks sent, %u delivered, %u incomplete, %u corrupted",
+		qualitylevels, udp_batch, udp_gso ? ", GSO" : "", udp_gro ? ", GRO" : "", fec_window,
+		chunks_num, delivered, incomplete, corrupted);
+	if(fec_window)
+		printf(", %llu rebuilt, %llu lost", fec.recovered, fec.lost);
+	printf("\n");
+	free(chunk_sizes);
+	free(echunk.data);
+	return corrupted ? 1 : 0;
+}
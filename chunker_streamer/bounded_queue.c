@@ -0,0 +1,113 @@
+/*
+ *  Copyright (c) 2009-2011 Carmelo Daniele, Dario Marchese, Diego Reforgiato, Giuseppe Tropea
+ *  Copyright (c) 2010-2011 Csaba Kiraly
+ *  developed for the Napa-Wine EU project. See www.napa-wine.eu
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "bounded_queue.h"
+
+int boundedQueueInit(BoundedQueue *q, int size)
+{
+	memset(q, 0, sizeof(BoundedQueue));
+	q->items = malloc(size * sizeof(void *));
+	if(!q->items)
+		return -1;
+	q->size = size;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	return 0;
+}
+
+void boundedQueueDestroy(BoundedQueue *q)
+{
+	if(!q->items)
+		return;
+	free(q->items);
+	q->items = NULL;
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+}
+
+int boundedQueuePush(BoundedQueue *q, void *item)
+{
+	pthread_mutex_lock(&q->lock);
+	while(q->count == q->size && !q->closed)
+		pthread_cond_wait(&q->not_full, &q->lock);
+	if(q->closed) {
+		pthread_mutex_unlock(&q->lock);
+		return -1;
+	}
+	q->items[(q->head + q->count) % q->size] = item;
+	q->count++;
+	q->pushes++;
+	q->depth_sum += q->count;
+	if(q->count > q->max_depth)
+		q->max_depth = q->count;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+void *boundedQueuePop(BoundedQueue *q)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while(q->count == 0 && !q->closed)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	if(q->count > 0) {
+		item = q->items[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return item;
+}
+
+void boundedQueueClose(BoundedQueue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_cond_broadcast(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void stageStatsAdd(StageStats *s, const struct timeval *start)
+{
+	struct timeval now;
+	long long us;
+
+	gettimeofday(&now, NULL);
+	us = (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_usec - start->tv_usec);
+	s->items++;
+	s->busy_us += us;
+	if(us > s->max_us)
+		s->max_us = us;
+}
+
+void stageStatsPrint(const char *name, StageStats *s, BoundedQueue *q)
+{
+	fprintf(stderr, "STAGE %s: %ld items, service time avg %lld us max %lld us",
+		name, s->items, s->items ? s->busy_us / s->items : 0, s->max_us);
+	if(q) {
+		pthread_mutex_lock(&q->lock);
+		fprintf(stderr, ", queue depth avg %.1f max %d of %d",
+			q->pushes ? (double)q->depth_sum / q->pushes : 0.0, q->max_depth, q->size);
+		q->pushes = 0;
+		q->depth_sum = 0;
+		q->max_depth = 0;
+		pthread_mutex_unlock(&q->lock);
+	}
+	fprintf(stderr, "\n");
+	memset(s, 0, sizeof(StageStats));
+}
@@ -0,0 +1,55 @@
+/*
+ *  Copyright (c) 2009-2011 Carmelo Daniele, Dario Marchese, Diego Reforgiato, Giuseppe Tropea
+ *  Copyright (c) 2010-2011 Csaba Kiraly
+ *  developed for the Napa-Wine EU project. See www.napa-wine.eu
+ *
+ *  This is free software; see lgpl-2.1.txt
+ */
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <pthread.h>
+#include <sys/time.h>
+
+/*
+ * fixed size FIFO of pointers shared between threads.
+ * push waits while the queue is full, pop while it is empty
+ */
+typedef struct BoundedQueue {
+	void **items;
+	int size;
+	int head; //next item to pop
+	int count;
+	int closed; //no more pushes, pop returns NULL once empty
+	//depth statistics, sampled at every push
+	long pushes;
+	long long depth_sum;
+	int max_depth;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} BoundedQueue;
+
+int boundedQueueInit(BoundedQueue *q, int size);
+void boundedQueueDestroy(BoundedQueue *q);
+//returns -1 if the queue has been closed
+int boundedQueuePush(BoundedQueue *q, void *item);
+//returns NULL if the queue has been closed and is empty
+void *boundedQueuePop(BoundedQueue *q);
+//wake up everybody waiting, pop drains what is left
+void boundedQueueClose(BoundedQueue *q);
+
+/* service time of a pipeline stage */
+typedef struct StageStats {
+	long items;
+	long long busy_us;
+	long long max_us;
+} StageStats;
+
+//account for one item processed since start
+void stageStatsAdd(StageStats *s, const struct timeval *start);
+//print and reset the stage counters, q is the input queue of the stage or NULL
+void stageStatsPrint(const char *name, StageStats *s, BoundedQueue *q);
+
+#endif
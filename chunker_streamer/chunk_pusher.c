@@ -10,8 +10,10 @@
 #include <string.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "external_chunk_transcoding.h"
 #include "chunker_streamer.h"
@@ -23,12 +25,16 @@
 
 extern ChunkerMetadata *cmeta;
 
+int sendViaCurl(Chunk gchunk, uint8_t *buffer, int buffer_size, char *url);
+int sendViaTcp(struct output *o, Chunk gchunk, uint32_t buffer_size);
+
 struct output {
     char* peer_ip;
     int peer_port;
     int tcp_fd;
     bool tcp_fd_connected;
     long long int counter;
+    ChunkArena arena;	//scratch space for attributes and wire encoding, reused for every chunk
 };
 static bool exit_on_connect_failure = false;
 static bool connect_on_data = true;
@@ -74,6 +80,7 @@ struct output *initTCPPush(char* ip, int port)
 	o->tcp_fd = -1;
 	o->tcp_fd_connected = false;
 	o->counter = 0;
+	chunkArenaInit(&o->arena);
 
 	connectTCP(o);
 
@@ -87,23 +94,42 @@ void finalizeTCPChunkPusher(struct output *o)
 		close(o->tcp_fd);
 		o->tcp_fd = -1;
 	}
+	fprintf(stderr, "TCP OUTPUT MODULE: %s:%d chunk arena grew %u times up to %zu bytes\n", o->peer_ip, o->peer_port, o->arena.grow_count, o->arena.size);
+	chunkArenaFree(&o->arena);
+}
+
+unsigned int getTCPChunkPusherArenaGrowCount(struct output *o)
+{
+	return o->arena.grow_count;
 }
 
 int pushChunkHttp(struct output *o, ExternalChunk *echunk, char *url) {
 
 	Chunk gchunk;
 	void *grapes_chunk_attributes_block = NULL;
+	uint8_t *wire_buffer = NULL;
 	int ret = STREAMER_FAIL_RETURN;
 	//we need to pack 5 int32s + 2 timeval structs + 1 double
 	static size_t ExternalChunk_header_size = 5*CHUNK_TRANSCODING_INT_SIZE + 2*CHUNK_TRANSCODING_INT_SIZE + 2*CHUNK_TRANSCODING_INT_SIZE + 1*CHUNK_TRANSCODING_INT_SIZE*2;
+	/* 20 bytes are needed to put the chunk header info on the wire + attributes size + payload */
+	size_t wire_size = GRAPES_ENCODED_CHUNK_HEADER_SIZE + ExternalChunk_header_size + echunk->payload_len;
 	
 	//update the chunk len here because here we know the external chunk header size
 	echunk->len = echunk->payload_len + ExternalChunk_header_size;
 
+	/* attributes block and wire buffer both live in the per output arena */
+	if(chunkArenaReset(&o->arena, CHUNK_ARENA_ALIGN(ExternalChunk_header_size) + wire_size) < 0)
+		return ret;
+	grapes_chunk_attributes_block = chunkArenaAlloc(&o->arena, ExternalChunk_header_size);
+	wire_buffer = chunkArenaAlloc(&o->arena, wire_size);
+
 	/* first pack the chunk info that we get from the streamer into an "attributes" block of a regular GRAPES chunk */
-	if(	(grapes_chunk_attributes_block = packExternalChunkToAttributes(echunk, ExternalChunk_header_size)) != NULL ) {
+	if(grapes_chunk_attributes_block && wire_buffer) {
 		struct timeval now;
 
+		if(packExternalChunkToAttributesBuffer(echunk, grapes_chunk_attributes_block, ExternalChunk_header_size) < 0)
+			return ret;
+
 		/* then fill-up a proper GRAPES chunk */
 		gchunk.size = echunk->payload_len;
 		/* then fill the timestamp */
@@ -137,13 +163,11 @@ int pushChunkHttp(struct output *o, ExternalChunk *echunk, char *url) {
 #ifdef NHIO
 		write_chunk(&gchunk);
 #else
-		/* 20 bytes are needed to put the chunk header info on the wire + attributes size + payload */
-		ret = sendViaCurl(gchunk, GRAPES_ENCODED_CHUNK_HEADER_SIZE + gchunk.attributes_size + gchunk.size, url);
+		ret = sendViaCurl(gchunk, wire_buffer, wire_size, url);
 		//~ if(ChunkerStreamerTestMode)
-			//~ ret = sendViaCurl(gchunk, GRAPES_ENCODED_CHUNK_HEADER_SIZE + gchunk.attributes_size + gchunk.size, "http://localhost:5557/externalplayer");
+			//~ ret = sendViaCurl(gchunk, wire_buffer, wire_size, "http://localhost:5557/externalplayer");
 #endif
 
-		free(grapes_chunk_attributes_block);
 		return ret;
 	}
 	return ret;
@@ -168,10 +192,17 @@ int pushChunkTcp(struct output *o, ExternalChunk *echunk)
 	//update the chunk len here because here we know the external chunk header size
 	echunk->len = echunk->payload_len + ExternalChunk_header_size;
 
+	/* the payload goes out in place, only the attributes block needs room in the arena */
+	if(chunkArenaReset(&o->arena, ExternalChunk_header_size) < 0)
+		return ret;
+
 	/* first pack the chunk info that we get from the streamer into an "attributes" block of a regular GRAPES chunk */
-	if(	(grapes_chunk_attributes_block = packExternalChunkToAttributes(echunk, ExternalChunk_header_size)) != NULL ) {
+	if(	(grapes_chunk_attributes_block = chunkArenaAlloc(&o->arena, ExternalChunk_header_size)) != NULL ) {
 		struct timeval now;
 
+		if(packExternalChunkToAttributesBuffer(echunk, grapes_chunk_attributes_block, ExternalChunk_header_size) < 0)
+			return ret;
+
 		/* then fill-up a proper GRAPES chunk */
 		gchunk.size = echunk->payload_len;
 		/* then fill the timestamp */
@@ -209,7 +240,6 @@ int pushChunkTcp(struct output *o, ExternalChunk *echunk)
 		ret = sendViaTcp(o,gchunk, GRAPES_ENCODED_CHUNK_HEADER_SIZE + gchunk.attributes_size + gchunk.size);
 #endif
 
-		free(grapes_chunk_attributes_block);
 		return ret;
 	}
 	return ret;
@@ -217,7 +247,15 @@ int pushChunkTcp(struct output *o, ExternalChunk *echunk)
 
 int sendViaTcp(struct output *o, Chunk gchunk, uint32_t buffer_size)
 {
-	uint8_t *buffer=NULL;
+	/* only the length prefix and the GRAPES header are written here, */
+	/* payload and attributes go out from where they already are */
+	uint8_t header[4 + GRAPES_ENCODED_CHUNK_HEADER_SIZE];
+	struct iovec iov[1 + GRAPES_ENCODED_CHUNK_IOV_MAX];
+	struct msghdr msg;
+	size_t left = 4 + buffer_size;
+	size_t sent = 0;
+	int iovcnt, flags = 0;
+	ssize_t tmp;
 
 	int ret = STREAMER_FAIL_RETURN;
 	
@@ -227,41 +265,55 @@ int sendViaTcp(struct output *o, Chunk gchunk, uint32_t buffer_size)
 		return ret;
 	}
 
-	if( (buffer = malloc(4 + buffer_size)) != NULL) {
-		/* encode the GRAPES chunk into network bytes */
-		encodeChunk(&gchunk, buffer + 4, buffer_size);
-		*(uint32_t*)buffer = htonl(buffer_size);
+	bit32_encoded_push(buffer_size, header);
+	iov[0].iov_base = header;
+	iov[0].iov_len = 4;
+	/* encode the GRAPES chunk header into network bytes */
+	iovcnt = encodeChunkIov(&gchunk, header + 4, iov + 1, GRAPES_ENCODED_CHUNK_IOV_MAX);
+	if (iovcnt < 0) {
+		return ret;
+	}
+	iovcnt++;
 
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
 #ifdef MSG_NOSIGNAL
-		int ret = send(o->tcp_fd, buffer, 4 + buffer_size, exit_on_send_error ? 0 : MSG_NOSIGNAL); //TODO: better handling of exit_on_send_error
-#else
-		int ret = send(o->tcp_fd, buffer, 4 + buffer_size, 0); //TODO: better handling of exit_on_send_error
+	flags = exit_on_send_error ? 0 : MSG_NOSIGNAL; //TODO: better handling of exit_on_send_error
 #endif
-		//fprintf(stderr, "TCP IO-MODULE: sending %d bytes, %d sent\n", buffer_size, ret);
-		if (ret < 0) {
-			if (errno != EAGAIN && errno != EWOULDBLOCK) {
-				fprintf(stderr, "TCP IO-MODULE: closing connection\n");
-				close(o->tcp_fd);
-				o->tcp_fd = -1;
-				o->tcp_fd_connected = false;
+
+	while(left > 0)
+	{
+		tmp = sendmsg(o->tcp_fd, &msg, flags);
+		//fprintf(stderr, "TCP IO-MODULE: sending %zu bytes, %zd sent\n", left, tmp);
+		if (tmp < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			/* nothing went out yet: the stream is still in sync, keep it */
+			if (sent == 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return ret;
 			}
+			fprintf(stderr, "TCP IO-MODULE: closing connection\n");
+			close(o->tcp_fd);
+			o->tcp_fd = -1;
+			o->tcp_fd_connected = false;
 			return ret;
 		}
-		int tmp;
-		while(ret != buffer_size)
-		{
-#ifdef MSG_NOSIGNAL
-			tmp = send(o->tcp_fd, buffer+ret, 4 + buffer_size - ret, exit_on_send_error ? 0 : MSG_NOSIGNAL);
-#else
-			tmp = send(o->tcp_fd, buffer+ret, 4 + buffer_size - ret, 0);
-#endif
-			if(tmp > 0)
-				ret += tmp;
-			else
-				break;
+		sent += tmp;
+		left -= tmp;
+
+		/* resume a partial write: skip the iovecs already sent, trim the current one */
+		while (msg.msg_iovlen > 0 && (size_t)tmp >= msg.msg_iov->iov_len) {
+			tmp -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + tmp;
+			msg.msg_iov->iov_len -= tmp;
 		}
-		
-		free(buffer);
 	}
-	return ret;
+
+	return sent;
 }
@@ -14,5 +14,13 @@ struct output;
 struct output *initTCPPush(char* ip, int port);
 void finalizeTCPChunkPusher(struct output *o);
 int pushChunkTcp(struct output *o, ExternalChunk *echunk);
+//how many times the per output chunk arena had to grow
+unsigned int getTCPChunkPusherArenaGrowCount(struct output *o);
+
+//datagram output, chunks are fragmented to fit
+void initUDPPush(char* peer_ip, int peer_port);
+void finalizeUDPChunkPusher();
+int pushChunkUDP(ExternalChunk *echunk);
+unsigned int getUDPChunkPusherArenaGrowCount();
 
 #endif
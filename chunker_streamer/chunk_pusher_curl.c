@@ -12,7 +12,7 @@
 
 void initChunkPusher();
 void finalizeChunkPusher();
-int sendViaCurl(Chunk gchunk, int buffer_size, char *url);
+int sendViaCurl(Chunk gchunk, uint8_t *buffer, int buffer_size, char *url);
 
 //MAKE THE CURL EASY HANDLE GLOBAL TO REUSE IT CONNECTIONS
 CURL *curl_handle = 0;
@@ -32,15 +32,14 @@ void finalizeChunkPusher() {
 	curl_global_cleanup();
 }
 
-int sendViaCurl(Chunk gchunk, int buffer_size, char *url) {
+/* buffer is provided by the caller, at least buffer_size bytes */
+int sendViaCurl(Chunk gchunk, uint8_t *buffer, int buffer_size, char *url) {
 	struct curl_slist *headers=NULL;
-	uint8_t *buffer=NULL;
 
 	int ret = STREAMER_FAIL_RETURN;
 
-	if( (buffer = malloc(buffer_size)) != NULL) {
-		/* encode the GRAPES chunk into network bytes */
-		encodeChunk(&gchunk, buffer, buffer_size);
+	/* encode the GRAPES chunk into network bytes */
+	if(encodeChunk(&gchunk, buffer, buffer_size) > 0) {
 
 		if(curl_handle) {
 			curl_easy_setopt(curl_handle, CURLOPT_URL, url);
@@ -64,8 +63,6 @@ int sendViaCurl(Chunk gchunk, int buffer_size, char *url) {
 			curl_slist_free_all(headers); /* free the header list */
 			ret = STREAMER_OK_RETURN;
 		}
-
-		free(buffer);
 	}
 	return ret;
 }
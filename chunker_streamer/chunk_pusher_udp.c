@@ -5,25 +5,75 @@
  *  This is free software; see lgpl-2.1.txt
  */
 
+//sendmmsg and struct mmsghdr
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
+#include <errno.h>
+#ifdef __linux__
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#endif
 
 #include "external_chunk_transcoding.h"
+#include "chunk_fec.h"
 #include "chunker_streamer.h"
+#include "chunk_pusher.h"
 
 //#define DEBUG_PUSHER
 
+//room for the fragments of a few large chunks while the player catches up
+#define UDP_SEND_BUFFER_SIZE (4*1024*1024)
+//a GSO send is split by the kernel in at most 64 datagrams, all within one UDP payload
+#define UDP_GSO_SEGMENTS_MAX 64
+#define UDP_GSO_BYTES_MAX 65000
 
-int pushChunkHttp(ExternalChunk *echunk, char *url);
-int pushChunkTcp(ExternalChunk *echunk);
+#ifdef __linux__
+typedef struct mmsghdr BatchMsg;
+#define BATCH_MSG_HDR(m) (&(m)->msg_hdr)
+#else
+//no sendmmsg: the batch goes out one sendmsg at a time
+typedef struct msghdr BatchMsg;
+#define BATCH_MSG_HDR(m) (m)
+#endif
 
 extern ChunkerMetadata *cmeta;
+extern int udp_batch;
+extern int udp_gso;
+extern int fec_window;
 static long long int counter = 0;
 static int fd = -1;
+//scratch space for attributes and wire encoding, reused for every chunk
+static ChunkArena arena;
+//transport sequence of the chunks sent, the player reassembles and counts losses on it
+static uint32_t fragment_seq;
+static unsigned long long chunks_sent = 0;
+static unsigned long long fragments_sent = 0;
+static unsigned long long bytes_sent = 0;
+static unsigned long long send_calls = 0;
+static long long send_cpu_ns = 0; //thread CPU time spent fragmenting and sending
+static struct timeval first_send = {0, 0};
+//one message, two iovec and a header per fragment of a batch
+static BatchMsg *msgs = NULL;
+static struct iovec *iovs = NULL;
+static uint8_t (*headers)[CHUNK_FRAGMENT_HEADER_SIZE] = NULL;
+static int batch_slots = 0;
+//parity of the chunks sent, every fec_window of them
+static FecEncoder fec;
+static unsigned long long parity_sent = 0;
+
+int sendViaUDP(Chunk gchunk, uint8_t *buffer, int buffer_size);
 
 void initUDPPush(char* peer_ip, int peer_port)
 {
@@ -41,6 +91,35 @@ void initUDPPush(char* peer_ip, int peer_port)
 			fprintf(stderr, "UDP OUTPUT MODULE: could not connect to the peer!\n");
 			exit(1);
 		}
+		int sndbuf = UDP_SEND_BUFFER_SIZE;
+		if(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0)
+			perror("UDP OUTPUT MODULE: cannot enlarge the send buffer");
+		//a restarted streamer must not look like old chunks to the player
+		fragment_seq = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+		chunkArenaInit(&arena);
+
+		if(udp_batch < 1)
+			udp_batch = 1;
+#ifdef __linux__
+		if(udp_batch > UIO_MAXIOV)
+			udp_batch = UIO_MAXIOV;
+#else
+		udp_gso = 0;
+#endif
+		batch_slots = udp_batch > UDP_GSO_SEGMENTS_MAX ? udp_batch : UDP_GSO_SEGMENTS_MAX;
+		msgs = calloc(batch_slots, sizeof(BatchMsg));
+		iovs = calloc(2 * batch_slots, sizeof(struct iovec));
+		headers = calloc(batch_slots, CHUNK_FRAGMENT_HEADER_SIZE);
+		if(!msgs || !iovs || !headers) {
+			fprintf(stderr, "UDP OUTPUT MODULE: cannot allocate %d send slots\n", batch_slots);
+			exit(1);
+		}
+		//seeded as the fragments, a restarted streamer starts from another group
+		if(fec_window && fecEncoderInit(&fec, fec_window, fragment_seq) < 0) {
+			fprintf(stderr, "UDP OUTPUT MODULE: FEC window must be between %d and %d chunks\n", FEC_WINDOW_MIN, FEC_WINDOW_MAX);
+			exit(1);
+		}
+		fprintf(stderr, "UDP OUTPUT MODULE: %d fragments per send call%s\n", udp_batch, udp_gso ? ", GSO" : "");
 	}
 }
 
@@ -51,23 +130,69 @@ void finalizeUDPChunkPusher()
 		close(fd);
 		fd = -1;
 	}
+	if(fragments_sent) {
+		struct timeval now;
+		double elapsed;
+
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - first_send.tv_sec) + (now.tv_usec - first_send.tv_usec) / 1e6;
+		if(elapsed <= 0)
+			elapsed = 1;
+		fprintf(stderr, "UDP OUTPUT MODULE: %llu chunks sent in %llu fragments and %llu send calls, %.0f packets/s, %.1f Mbit/s, %.1f ms CPU per Gbit\n",
+			chunks_sent, fragments_sent, send_calls, fragments_sent / elapsed, bytes_sent * 8 / elapsed / 1e6,
+			send_cpu_ns / 1e6 / (bytes_sent * 8 / 1e9));
+	}
+	if(fec_window) {
+		if(fec.data_bytes)
+			fprintf(stderr, "UDP OUTPUT MODULE: FEC %d+1, %llu parity chunks sent, %.1f%% overhead\n",
+				fec_window, parity_sent, 100.0 * fec.parity_bytes / fec.data_bytes);
+		fecEncoderFree(&fec);
+	}
+	free(msgs);
+	free(iovs);
+	free(headers);
+	msgs = NULL;
+	iovs = NULL;
+	headers = NULL;
+	fprintf(stderr, "UDP OUTPUT MODULE: chunk arena grew %u times up to %zu bytes\n", arena.grow_count, arena.size);
+	chunkArenaFree(&arena);
+}
+
+unsigned int getUDPChunkPusherArenaGrowCount()
+{
+	return arena.grow_count;
 }
 
 int pushChunkUDP(ExternalChunk *echunk) {
 
 	Chunk gchunk;
 	void *grapes_chunk_attributes_block = NULL;
+	uint8_t *wire_buffer = NULL;
 	int ret = STREAMER_FAIL_RETURN;
 	//we need to pack 5 int32s + 2 timeval structs + 1 double
 	static size_t ExternalChunk_header_size = 5*CHUNK_TRANSCODING_INT_SIZE + 2*CHUNK_TRANSCODING_INT_SIZE + 2*CHUNK_TRANSCODING_INT_SIZE + 1*CHUNK_TRANSCODING_INT_SIZE*2;
+	/* 20 bytes are needed to put the chunk header info on the wire + attributes size + payload */
+	size_t wire_size = GRAPES_ENCODED_CHUNK_HEADER_SIZE + ExternalChunk_header_size + echunk->payload_len;
+	//the FEC header goes in front of the encoded chunk
+	if(fec_window)
+		wire_size += FEC_HEADER_SIZE;
 	
 	//update the chunk len here because here we know the external chunk header size
 	echunk->len = echunk->payload_len + ExternalChunk_header_size;
 
+	/* attributes block and datagram both live in the arena */
+	if(chunkArenaReset(&arena, CHUNK_ARENA_ALIGN(ExternalChunk_header_size) + wire_size) < 0)
+		return ret;
+	grapes_chunk_attributes_block = chunkArenaAlloc(&arena, ExternalChunk_header_size);
+	wire_buffer = chunkArenaAlloc(&arena, wire_size);
+
 	/* first pack the chunk info that we get from the streamer into an "attributes" block of a regular GRAPES chunk */
-	if(	(grapes_chunk_attributes_block = packExternalChunkToAttributes(echunk, ExternalChunk_header_size)) != NULL ) {
+	if(grapes_chunk_attributes_block && wire_buffer) {
 		struct timeval now;
 
+		if(packExternalChunkToAttributesBuffer(echunk, grapes_chunk_attributes_block, ExternalChunk_header_size) < 0)
+			return ret;
+
 		/* then fill-up a proper GRAPES chunk */
 		gchunk.size = echunk->payload_len;
 		/* then fill the timestamp */
@@ -98,43 +223,179 @@ int pushChunkUDP(ExternalChunk *echunk) {
 		gchunk.attributes_size = ExternalChunk_header_size;
 		gchunk.data = echunk->data;
 
-		/* 20 bytes are needed to put the chunk header info on the wire + attributes size + payload */
-		ret = sendViaUDP(gchunk, GRAPES_ENCODED_CHUNK_HEADER_SIZE + gchunk.attributes_size + gchunk.size);
+		ret = sendViaUDP(gchunk, wire_buffer, wire_size);
 
-		free(grapes_chunk_attributes_block);
 		return ret;
 	}
 	return ret;
 }
 
-int sendViaUDP(Chunk gchunk, int buffer_size)
+//header and payload of fragments first..first+n-1 into the iovec pairs of the batch
+static void prepareFragments(uint32_t seq, uint8_t *buffer, int buffer_size, int first, int n, int count, uint32_t fragment_size)
 {
-	uint8_t *buffer=NULL;
+	uint32_t offset;
+	int k;
+
+	for(k = 0; k < n; k++) {
+		offset = (first + k) * fragment_size;
+		chunkFragmentHeaderPush(headers[k], seq, first + k, count, buffer_size);
+		iovs[2*k].iov_base = headers[k];
+		iovs[2*k].iov_len = CHUNK_FRAGMENT_HEADER_SIZE;
+		iovs[2*k+1].iov_base = buffer + offset;
+		iovs[2*k+1].iov_len = (first + k == count - 1) ? buffer_size - offset : fragment_size;
+		bytes_sent += CHUNK_FRAGMENT_HEADER_SIZE + iovs[2*k+1].iov_len;
+	}
+}
+
+//one datagram per message, as many messages per system call as the platform allows
+static int sendBatch(int n)
+{
+	int k, sent = 0, ret;
+
+	for(k = 0; k < n; k++) {
+		memset(BATCH_MSG_HDR(&msgs[k]), 0, sizeof(struct msghdr));
+		BATCH_MSG_HDR(&msgs[k])->msg_iov = &iovs[2*k];
+		BATCH_MSG_HDR(&msgs[k])->msg_iovlen = 2;
+	}
+	while(sent < n) {
+#ifdef __linux__
+		ret = sendmmsg(fd, msgs + sent, n - sent, 0);
+#else
+		ret = sendmsg(fd, BATCH_MSG_HDR(&msgs[sent]), 0) < 0 ? -1 : 1;
+#endif
+		send_calls++;
+		if(ret < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		sent += ret;
+	}
+	return 0;
+}
+
+#ifdef __linux__
+/*
+ * one system call for up to UDP_GSO_SEGMENTS_MAX fragments: the kernel cuts the
+ * gathered buffer in datagrams of segment_size bytes, the last one possibly shorter
+ */
+static int sendGSO(int n, int segment_size)
+{
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = iovs;
+	msg.msg_iovlen = 2 * n;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	*(uint16_t *)CMSG_DATA(cm) = segment_size;
+	do {
+		ret = sendmsg(fd, &msg, 0);
+		send_calls++;
+	} while(ret < 0 && errno == EINTR);
+	return ret < 0 ? -1 : 0;
+}
+#endif
+
+/*
+ * the block at buffer is cut into fragments that fit a datagram, each one
+ * sent with its fragment header in front, without copying the payload.
+ * fragments go out udp_batch at a time, or in GSO super-datagrams
+ */
+static int sendBlock(uint8_t *buffer, int buffer_size)
+{
+	uint32_t seq, fragment_size;
+	int count, i, n, per_call;
+
+	count = chunkFragmentCount(buffer_size, CHUNK_FRAGMENT_PAYLOAD_MAX);
+	if(count > CHUNK_FRAGMENT_COUNT_MAX) {
+		fprintf(stderr, "UDP OUTPUT MODULE: chunk of %d bytes too large to fragment\n", buffer_size);
+		return -1;
+	}
+	fragment_size = chunkFragmentPayloadSize(buffer_size, count);
+	seq = fragment_seq++;
+
+	for(i = 0; i < count; i += n) {
+		if(udp_gso) {
+			per_call = UDP_GSO_BYTES_MAX / (CHUNK_FRAGMENT_HEADER_SIZE + fragment_size);
+			if(per_call > UDP_GSO_SEGMENTS_MAX)
+				per_call = UDP_GSO_SEGMENTS_MAX;
+		} else
+			per_call = udp_batch;
+		n = count - i < per_call ? count - i : per_call;
+		prepareFragments(seq, buffer, buffer_size, i, n, count, fragment_size);
+#ifdef __linux__
+		if(udp_gso) {
+			if(sendGSO(n, CHUNK_FRAGMENT_HEADER_SIZE + fragment_size) == 0) {
+				fragments_sent += n;
+				continue;
+			}
+			if(errno == ECONNREFUSED)
+				return -1;
+			//no GSO in this kernel or on this route, stay with plain batches
+			perror("UDP OUTPUT MODULE: GSO send failed, disabling it");
+			udp_gso = 0;
+		}
+#endif
+		if(sendBatch(n) < 0) {
+			//nobody listening yet: the rest of the chunk would fail the same way
+			if(errno != ECONNREFUSED)
+				perror("UDP OUTPUT MODULE: sendmmsg");
+			return -1;
+		}
+		fragments_sent += n;
+	}
+	return 0;
+}
+
+/*
+ * buffer is provided by the caller, at least buffer_size bytes, the first
+ * FEC_HEADER_SIZE of them left for the FEC header when FEC is on.
+ * the GRAPES chunk is encoded after it and sent, followed by the parity
+ * chunk when it completes a group
+ */
+int sendViaUDP(Chunk gchunk, uint8_t *buffer, int buffer_size)
+{
+	struct timespec cpu_start, cpu_end;
+	int headroom = fec_window ? FEC_HEADER_SIZE : 0;
+	int parity_size = 0, sent;
 
-	int ret = STREAMER_FAIL_RETURN;
-	
 	if(!(fd > 0))
 	{
 		fprintf(stderr, "IO-MODULE: trying to send data to a not connected socket!!!\n");
-		return ret;
+		return STREAMER_FAIL_RETURN;
 	}
 
-	if( (buffer = malloc(buffer_size)) != NULL) {
-		/* encode the GRAPES chunk into network bytes */
-		encodeChunk(&gchunk, buffer, buffer_size);
-		
-		int ret = send(fd, buffer, buffer_size, 0);
-		int tmp;
-		while(ret != buffer_size)
-		{
-			tmp = send(fd, buffer+ret, buffer_size-ret, 0);
-			if(tmp > 0)
-				ret += tmp;
-			else
-				break;
+	/* encode the GRAPES chunk into network bytes */
+	if(encodeChunk(&gchunk, buffer + headroom, buffer_size - headroom) <= 0)
+		return STREAMER_FAIL_RETURN;
+	if(fec_window) {
+		parity_size = fecEncodeData(&fec, buffer + headroom, buffer_size - headroom, buffer);
+		if(parity_size < 0) {
+			fprintf(stderr, "UDP OUTPUT MODULE: cannot allocate the FEC parity\n");
+			return STREAMER_FAIL_RETURN;
 		}
-		
-		free(buffer);
 	}
-	return ret;
+
+	if(first_send.tv_sec == 0)
+		gettimeofday(&first_send, NULL);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+	sent = sendBlock(buffer, buffer_size);
+	//the parity covers this chunk even if it was not sent
+	if(parity_size > 0 && sendBlock(fecEncoderParity(&fec), parity_size) == 0)
+		parity_sent++;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+	send_cpu_ns += (cpu_end.tv_sec - cpu_start.tv_sec) * 1000000000LL + (cpu_end.tv_nsec - cpu_start.tv_nsec);
+	if(sent < 0)
+		return STREAMER_FAIL_RETURN;
+	chunks_sent++;
+	return buffer_size;
 }
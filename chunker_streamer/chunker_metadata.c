@@ -8,18 +8,22 @@
 #include "chunker_metadata.h"
 
 
-/* Read config file for chunk strategy [numframes:num|size:num] and create a new chunk_buffer object
+/* Read config file for chunk strategy [numframes:num|size:num|latency:ms,num] and create a new chunk_buffer object
 	numframes:num	fill each chunk with the same number of frame
 	size:num	fill each chunk with the size of bytes no bigger than num
+	latency:ms,num	close each chunk at ms of media, num bytes or a new GOP, whichever comes first
 */
 struct chunker_metadata *chunkerInit() {
 	ChunkerMetadata *cmeta=NULL;
 	cfg_opt_t opts[] =
 	{
-		CFG_STR("strategyType", "frames", CFGF_NONE), //"frames" or "size"
+		CFG_STR("strategyType", "frames", CFGF_NONE), //"frames", "size" or "latency"
 		CFG_INT("audioFramesPerChunk", 1, CFGF_NONE),
 		CFG_INT("videoFramesPerChunk", 1, CFGF_NONE),
 		CFG_INT("targetChunkSize", 1024, CFGF_NONE),
+		CFG_INT("targetChunkDuration", 200, CFGF_NONE),
+		CFG_INT("maxChunkSize", 65536, CFGF_NONE),
+		CFG_BOOL("gopAlignedChunks", cfg_false, CFGF_NONE),
 		CFG_STR("chunkID", "sequence", CFGF_NONE), //"sequence" or "starttime" or "monotonic"
 		CFG_STR("outsideWorldUrl", "http://localhost:5557/externalplayer", CFGF_NONE),
 		CFG_END()
@@ -52,11 +56,24 @@ struct chunker_metadata *chunkerInit() {
 		cmeta->targetChunkSize = cfg_getint(cfg, "targetChunkSize");
 		fprintf(stderr, "CONFIG: Will pack %d BYTES in each chunk\n", cmeta->targetChunkSize);
 	}
+	else if(!(strcmp(cfg_getstr(cfg, "strategyType"), "latency")) || !(strcmp(cfg_getstr(cfg, "strategyType"), "adaptive"))) {
+		// chunks bounded in duration and size, video chunks start at a GOP
+		cmeta->strategy = 2;
+		cmeta->targetChunkDuration = cfg_getint(cfg, "targetChunkDuration");
+		cmeta->maxChunkSize = cfg_getint(cfg, "maxChunkSize");
+		fprintf(stderr, "CONFIG: Will pack up to %d MS or %d BYTES in each chunk, starting a new one at each GOP\n", cmeta->targetChunkDuration, cmeta->maxChunkSize);
+	}
 	else {
 		fprintf(stderr, "CONFIG: Unknown strategyType in config file chunker.conf. Exiting.\n");
 		exit(-1);
 	}
 
+	// the latency strategy always cuts at GOPs, the others only if asked to
+	cmeta->gopAligned = cmeta->strategy == 2 || cfg_getbool(cfg, "gopAlignedChunks");
+	if(cmeta->gopAligned) {
+		fprintf(stderr, "CONFIG: Will start each VIDEO chunk at an I frame\n");
+	}
+
 	if(!(strcmp(cfg_getstr(cfg, "chunkID"), "sequence"))) {
 		// the chunkID is an increasing sequence of integers
 		cmeta->cid = 0;
@@ -22,6 +22,11 @@ typedef struct chunker_metadata {
 	char outside_world_url[1000];
 	int framesPerChunk[2]; // 0 = AUDIO; 1 = VIDEO
 	int targetChunkSize;
+	//latency strategy: close at this duration (ms), this size (bytes) or a new GOP
+	int targetChunkDuration;
+	int maxChunkSize;
+	//start every video chunk at an I frame
+	int gopAligned;
 } ChunkerMetadata;
 
 
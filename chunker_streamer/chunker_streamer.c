@@ -20,17 +20,66 @@
 #endif
 
 #include "chunk_pusher.h"
+#include "bounded_queue.h"
+
+/*
+ * a chunk on its way to the output stage. It goes back to the pool of
+ * its producer once all the outputs it was queued to have sent it
+ */
+typedef struct OutgoingChunk {
+	ExternalChunk *chunk;
+	BoundedQueue *pool;
+	volatile int refcnt;
+} OutgoingChunk;
+
+typedef struct ChunkPool {
+	OutgoingChunk slots[CHUNK_POOL_LEN];
+	BoundedQueue free;
+} ChunkPool;
 
 struct outstream {
 	struct output *output;
-	ExternalChunk *chunk;
+	ExternalChunk *chunk; //the chunk being filled, out->chunk
+	OutgoingChunk *out;
+	ChunkPool chunks;
 	AVCodecContext *pCodecCtxEnc;
+	//output stage: sends the chunks of this outstream and the audio chunks
+	pthread_t sender;
+	int sender_running;
+	BoundedQueue send_queue;
+	StageStats send_stats;
+	//encode jobs of the transcoded outstreams, shared decoded pictures run by the encode pool
+	BoundedQueue queue;
+	int pending; //jobs queued, under encode_pool.lock
+	int busy; //a worker is encoding for this outstream, under encode_pool.lock
+	//scaler and scaled picture, kept for the lifetime of the encoder
+	struct SwsContext *img_convert_ctx;
+	AVFrame *scaled_frame;
+	uint8_t *scaled_buffer;
+	AVFrame *picture; //this outstream's view of the picture being encoded
+	uint8_t *video_outbuf;
+	Frame frame;
+	int frame_count; //frames emitted, numbers them
+	int keyframe_requests; //requests served with an I frame
+	StageStats encode_stats;
+	StageStats scale_stats;
+	struct SwsContext *ladder_ctx; //scaling ladder step towards this outstream, used by the decode stage
 };
 #define QUALITYLEVELS_MAX 9
 struct outstream outstream[1+QUALITYLEVELS_MAX+1];
 int qualitylevels = 1;
 int indexchannel = 0;
 int passthrough = 0;
+//scale every level from the previous, smaller one instead of from the decoded picture
+int scaling_ladder = 0;
+int ladder_filters[1+QUALITYLEVELS_MAX+1];
+int ladder_filters_num = 0;
+int encode_threads = 0; //0: one per transcoded outstream
+int udp_batch = UDP_BATCH_DEFAULT; //fragments per send call of the UDP output
+int udp_gso = 0; //let the kernel segment the UDP fragments
+int fec_window = 0; //data chunks per XOR parity chunk of the UDP output, 0: no FEC
+int loop_mode = LOOP_MODE; //reopen the input when it ends
+volatile sig_atomic_t keyframe_requests = 0; //SIGUSR1 asks every encoder for an I frame
 
 #define DEBUG
 #define DEBUG_AUDIO_FRAMES  false
@@ -51,10 +100,12 @@ int seq_current_chunk = 1; //chunk numbering starts from 1; HINT do i need more
 
 #define AUDIO_CHUNK 0
 #define VIDEO_CHUNK 1
+#define CHUNK_CATEGORY_KEYFRAME 1 //video chunk starting with an I frame
 
 void SaveFrame(AVFrame *pFrame, int width, int height);
 void SaveEncodedFrame(Frame* frame, uint8_t *video_outbuf);
 int update_chunk(ExternalChunk *chunk, Frame *frame, uint8_t *outbuf);
+void addFrameToOutstream(struct outstream *os, Frame *frame, uint8_t *video_outbuf);
 void bit32_encoded_push(uint32_t v, uint8_t *p);
 
 int video_record_count = 0;
@@ -96,20 +147,152 @@ int chunkFilledSizeStrategy(ExternalChunk *echunk, int chunkType)
 	return 0;
 }
 
+// media time between the first and the last frame of the chunk, in ms
+long long chunkDuration(ExternalChunk *echunk)
+{
+	if((int)echunk->start_time.tv_sec == -1)
+		return 0;
+	//the usec field of the frame timestamps carries milliseconds
+	return ((long long)echunk->end_time.tv_sec - echunk->start_time.tv_sec) * 1000 + echunk->end_time.tv_usec - echunk->start_time.tv_usec;
+}
+
+// Latency budget: close the chunk when it covers the target duration or reaches the maximum size.
+// Video chunks are also closed before a new GOP, see addFrameToOutstream.
+int chunkFilledLatencyStrategy(ExternalChunk *echunk, int chunkType)
+{
+	dcprintf(DEBUG_CHUNKER, "CHUNKER: check if chunk duration %lld >= %d or size %d >= %d in chunk %d\n", chunkDuration(echunk), cmeta->targetChunkDuration, echunk->payload_len, cmeta->maxChunkSize, echunk->seq);
+	if(chunkDuration(echunk) >= cmeta->targetChunkDuration || echunk->payload_len >= cmeta->maxChunkSize)
+		return 1;
+
+	return 0;
+}
+
 // Performace optimization.
 // The chunkFilled function has been splitted into two functions (one for each strategy).
 // Instead of continuously check the strategy flag (which is constant),
 // we change the callback just once according to the current strategy (look at the switch statement in the main in which this function pointer is set)
 int (*chunkFilled)(ExternalChunk *echunk, int chunkType);
 
+int chunk_payload_reallocs = 0; //how many times any chunk payload buffer had to grow
+
+/*
+ * distribution of the duration and size of the chunks sent, one per chunk type.
+ * Bucket b holds durations below 10ms<<b and sizes below 512B<<b, the last one the rest
+ */
+#define CHUNK_SHAPE_BUCKETS 12
+typedef struct ChunkShape {
+	int chunks;
+	long long duration_sum;
+	long long size_sum;
+	int duration[CHUNK_SHAPE_BUCKETS];
+	int size[CHUNK_SHAPE_BUCKETS];
+} ChunkShape;
+
+ChunkShape chunk_shape[2]; // 0 = AUDIO; 1 = VIDEO
+
+int chunkShapeBucket(long long v, long long first) {
+	int b = 0;
+
+	while(b < CHUNK_SHAPE_BUCKETS - 1 && v >= first << b)
+		b++;
+	return b;
+}
+
+/* chunks of several outstreams may be closed concurrently by the encoder threads */
+void chunkShapeAdd(ChunkShape *s, ExternalChunk *chunk) {
+	long long duration = chunkDuration(chunk);
+
+	__sync_fetch_and_add(&s->chunks, 1);
+	__sync_fetch_and_add(&s->duration_sum, duration);
+	__sync_fetch_and_add(&s->size_sum, (long long)chunk->payload_len);
+	__sync_fetch_and_add(&s->duration[chunkShapeBucket(duration, 10)], 1);
+	__sync_fetch_and_add(&s->size[chunkShapeBucket(chunk->payload_len, 512)], 1);
+}
+
+/* print and reset the distribution */
+void chunkShapePrint(const char *name, ChunkShape *s) {
+	int b;
+
+	if(s->chunks == 0)
+		return;
+	fprintf(stderr, "CHUNKS: %s %d chunks, avg %lld ms %lld bytes\n", name, s->chunks, s->duration_sum / s->chunks, s->size_sum / s->chunks);
+	fprintf(stderr, "CHUNKS: %s duration ms:", name);
+	for (b = 0; b < CHUNK_SHAPE_BUCKETS; b++) {
+		if(s->duration[b] == 0)
+			continue;
+		if(b < CHUNK_SHAPE_BUCKETS - 1)
+			fprintf(stderr, " <%d:%d", 10 << b, s->duration[b]);
+		else
+			fprintf(stderr, " >=%d:%d", 10 << (b - 1), s->duration[b]);
+	}
+	fprintf(stderr, "\nCHUNKS: %s size bytes:", name);
+	for (b = 0; b < CHUNK_SHAPE_BUCKETS; b++) {
+		if(s->size[b] == 0)
+			continue;
+		if(b < CHUNK_SHAPE_BUCKETS - 1)
+			fprintf(stderr, " <%d:%d", 512 << b, s->size[b]);
+		else
+			fprintf(stderr, " >=%d:%d", 512 << (b - 1), s->size[b]);
+	}
+	fprintf(stderr, "\n");
+	memset(s, 0, sizeof(*s));
+}
+
+/*
+ * make room for at least needed bytes of payload in the chunk,
+ * growing geometrically so that a chunk is built with O(log) reallocs
+ */
+int reserveChunkPayload(ExternalChunk *chunk, int32_t needed) {
+	int32_t capacity;
+	uint8_t *tmp;
+
+	if(needed <= chunk->data_capacity)
+		return 0;
+
+	capacity = chunk->data_capacity ? chunk->data_capacity : 4096;
+	while(capacity < needed)
+		capacity *= 2;
+	tmp = (uint8_t *)realloc(chunk->data, capacity);
+	if(!tmp)
+		return -1;
+	chunk->data = tmp;
+	chunk->data_capacity = capacity;
+	__sync_fetch_and_add(&chunk_payload_reallocs, 1);
+	return 0;
+}
+
+/*
+ * allocate and reset a chunk structure, the payload buffer is allocated lazily
+ */
+ExternalChunk *createChunk() {
+	ExternalChunk *chunk = (ExternalChunk *)malloc(sizeof(ExternalChunk));
+	if(!chunk)
+		return NULL;
+	memset(chunk, 0, sizeof(ExternalChunk));
+	return chunk;
+}
+
+void freeChunk(ExternalChunk *chunk) {
+	if(!chunk)
+		return;
+	free(chunk->data);
+	free(chunk);
+}
+
 void initChunk(ExternalChunk *chunk, int *seq_num) {
-	chunk->seq = (*seq_num)++;
+	//remember how big the chunks of this stream are, and keep the buffer
+	if(chunk->frames_num > 0) {
+		chunk->payload_len_avg = chunk->payload_len_avg ? (chunk->payload_len_avg * 7 + chunk->payload_len) / 8 : chunk->payload_len;
+	}
+	//leave some room above the average for I frames
+	if(reserveChunkPayload(chunk, chunk->payload_len_avg + chunk->payload_len_avg / 4) < 0) {
+		fprintf(stderr, "Memory error in chunk!!!\n");
+	}
+	//chunks of all the outstreams share the numbering
+	chunk->seq = __sync_fetch_and_add(seq_num, 1);
 	chunk->frames_num = 0;
 	chunk->payload_len = 0;
 	chunk->len=0;
-  if(chunk->data != NULL)
-    free(chunk->data);
-	chunk->data = NULL;
 	chunk->start_time.tv_sec = -1;
 	chunk->start_time.tv_usec = -1;
 	chunk->end_time.tv_sec = -1;
@@ -127,6 +310,11 @@ void sigproc()
 	quit = 1;
 }
 
+void sigForceKeyframe()
+{
+	keyframe_requests++;
+}
+
 static void print_usage(int argc, char *argv[])
 {
   fprintf (stderr,
@@ -151,28 +339,414 @@ static void print_usage(int argc, char *argv[])
     "\t[--audio_stream]:set audio_stream ID in input\n"
     "\t[--avfilter]:set input filter (default: yadif\n"
     "\t[--passthrough 0/1]: turn off/on generation of passthrough channel\n"
+    "\t[--loop 0/1]: exit at the end of the input / reopen it (default: 1)\n"
     "\t[--indexchannel 0/1]: turn off/on generation of index channel\n"
     "\t[--qualitylevels q]:set number of quality levels to q\n"
+    "\t[--encode_threads n]: encoder threads shared by the quality levels (default: one per level)\n"
+    "\t[--udp_batch n]: UDP fragments sent per system call (default: 32)\n"
+    "\t[--udp_gso 0/1]: turn off/on UDP segmentation offload, where the kernel supports it\n"
+    "\t[--fec n]: send a parity chunk every n chunks over UDP, the player rebuilds one lost chunk per group (2-32, default: off)\n"
+    "\t[--scaling_ladder f1,f2,...]: scale each quality level from the previous one, using filter fN (bicubic, bilinear, fast_bilinear, area, point) for level N, the last one for the rest\n"
     "\n"
     "Codec options:\n"
     "\t[-g GOP]: gop size\n"
     "\t[-b frames]: max number of consecutive b frames\n"
     "\t[-x extas]: extra video codec options (e.g. -x me_method=hex,flags2=+dct8x8+wpred+bpyrami+mixed_refs)\n"
     "\n"
+    "Send SIGUSR1 to have every encoder emit an I frame (e.g. when a player zaps to the channel)\n"
+    "\n"
     "=======================================================\n", argv[0]
     );
   }
 
-int sendChunk(struct output *output, ExternalChunk *chunk) {
+int sendChunk(struct outstream *os, ExternalChunk *chunk) {
+	int ret = -1;
+#ifndef TCPIO
+	//a single connection is shared by the senders of all the outstreams
+	static pthread_mutex_t shared_output_lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_mutex_t *lock = &shared_output_lock;
+
+	pthread_mutex_lock(lock);
+#endif
 #ifdef HTTPIO
-						return pushChunkHttp(chunk, outside_world_url);
+						ret = pushChunkHttp(chunk, outside_world_url);
 #endif
 #ifdef TCPIO
-						return pushChunkTcp(output, chunk);
+						ret = pushChunkTcp(os->output, chunk);
 #endif
 #ifdef UDPIO
-						return pushChunkUDP(chunk);
+						ret = pushChunkUDP(chunk);
+#endif
+#ifndef TCPIO
+	pthread_mutex_unlock(lock);
 #endif
+	return ret;
+}
+
+int initChunkPool(ChunkPool *p) {
+	int i;
+
+	if(boundedQueueInit(&p->free, CHUNK_POOL_LEN) < 0)
+		return -1;
+	for(i = 0; i < CHUNK_POOL_LEN; i++) {
+		p->slots[i].chunk = createChunk();
+		if(!p->slots[i].chunk)
+			return -1;
+		p->slots[i].pool = &p->free;
+		boundedQueuePush(&p->free, &p->slots[i]);
+	}
+	return 0;
+}
+
+void freeChunkPool(ChunkPool *p) {
+	int i;
+
+	for(i = 0; i < CHUNK_POOL_LEN; i++) {
+		freeChunk(p->slots[i].chunk);
+		p->slots[i].chunk = NULL;
+	}
+	boundedQueueDestroy(&p->free);
+}
+
+/* take an empty chunk, waiting for the output stage if all of them are in flight */
+OutgoingChunk *getFreeChunk(ChunkPool *p) {
+	return boundedQueuePop(&p->free);
+}
+
+void releaseChunk(OutgoingChunk *oc) {
+	if(__sync_sub_and_fetch(&oc->refcnt, 1) == 0) {
+		oc->chunk->seq = 0; //signal that we need an increase
+		boundedQueuePush(oc->pool, oc);
+	}
+}
+
+/* hand a filled chunk to the output stage of outstreams first..last-1 */
+void queueChunk(OutgoingChunk *oc, int first, int last) {
+	int i;
+
+	oc->refcnt = 1;
+	for (i = first; i < last; i++) {
+		__sync_fetch_and_add(&oc->refcnt, 1);
+		if (boundedQueuePush(&outstream[i].send_queue, oc) < 0)
+			releaseChunk(oc);
+	}
+	releaseChunk(oc);
+}
+
+/* output stage: a slow peer only stalls its own sender */
+void *senderThread(void *arg)
+{
+	struct outstream *os = (struct outstream *)arg;
+	OutgoingChunk *oc;
+	struct timeval start;
+
+	while((oc = boundedQueuePop(&os->send_queue)) != NULL) {
+		gettimeofday(&start, NULL);
+		sendChunk(os, oc->chunk);
+		stageStatsAdd(&os->send_stats, &start);
+		releaseChunk(oc);
+	}
+	return NULL;
+}
+
+int startSenderThread(struct outstream *os) {
+	if(boundedQueueInit(&os->send_queue, CHUNK_POOL_LEN * 2) < 0)
+		return -1;
+	if(initChunkPool(&os->chunks) < 0) {
+		fprintf(stderr, "INIT: Memory error alloc chunk!!!\n");
+		return -1;
+	}
+	os->out = getFreeChunk(&os->chunks);
+	os->chunk = os->out->chunk;
+	if(pthread_create(&os->sender, NULL, senderThread, os) != 0) {
+		fprintf(stderr, "INIT: cannot start sender thread\n");
+		return -1;
+	}
+	os->sender_running = 1;
+	return 0;
+}
+
+/* send what is queued, then stop the sender */
+void stopSenderThread(struct outstream *os, const char *name) {
+	if(os->sender_running) {
+		boundedQueueClose(&os->send_queue);
+		pthread_join(os->sender, NULL);
+		os->sender_running = 0;
+	}
+	stageStatsPrint(name, &os->send_stats, &os->send_queue);
+	boundedQueueDestroy(&os->send_queue);
+	freeChunkPool(&os->chunks);
+	os->out = NULL;
+	os->chunk = NULL;
+}
+
+/* demux stage: reads ahead of the decoder, so that stalls downstream do not delay reading */
+BoundedQueue demux_queue;
+pthread_t demuxer;
+StageStats demux_stats;
+StageStats decode_stats;
+
+void *demuxThread(void *arg)
+{
+	AVFormatContext *pFormatCtx = (AVFormatContext *)arg;
+	AVPacket *packet;
+	struct timeval start;
+
+	while(!quit) {
+		packet = av_malloc(sizeof(AVPacket));
+		if(!packet)
+			break;
+		gettimeofday(&start, NULL);
+		if(av_read_frame(pFormatCtx, packet) < 0) {
+			av_free(packet);
+			break;
+		}
+		//the packet may point into the demuxer buffers, make it own its data
+		if(av_dup_packet(packet) < 0) {
+			av_free_packet(packet);
+			av_free(packet);
+			continue;
+		}
+		stageStatsAdd(&demux_stats, &start);
+		if(boundedQueuePush(&demux_queue, packet) < 0) {
+			av_free_packet(packet);
+			av_free(packet);
+			break;
+		}
+	}
+	//end of input
+	boundedQueueClose(&demux_queue);
+	return NULL;
+}
+
+int startDemuxThread(AVFormatContext *pFormatCtx) {
+	if(boundedQueueInit(&demux_queue, DEMUX_QUEUE_LEN) < 0)
+		return -1;
+	if(pthread_create(&demuxer, NULL, demuxThread, pFormatCtx) != 0) {
+		fprintf(stderr, "INIT: cannot start demux thread\n");
+		boundedQueueDestroy(&demux_queue);
+		return -1;
+	}
+	return 0;
+}
+
+void stopDemuxThread() {
+	AVPacket *packet;
+
+	boundedQueueClose(&demux_queue);
+	pthread_join(demuxer, NULL);
+	stageStatsPrint("demux", &demux_stats, NULL);
+	stageStatsPrint("decode", &decode_stats, &demux_queue);
+	while((packet = boundedQueuePop(&demux_queue)) != NULL) {
+		av_free_packet(packet);
+		av_free(packet);
+	}
+	boundedQueueDestroy(&demux_queue);
+}
+
+/*
+ * a decoded picture handed to the encoder threads of all the transcoded
+ * outstreams. It goes back to the pool when the last of them is done with it
+ */
+typedef struct SharedFrame {
+	AVFrame *frame;
+	uint8_t *buffer;
+	int width;
+	int height;
+	//scaling ladder: the picture already scaled for each outstream
+	AVFrame *level[1+QUALITYLEVELS_MAX+1];
+	uint8_t *level_buffer[1+QUALITYLEVELS_MAX+1];
+	AVRational time_base; //of the input stream
+	int64_t pts_base; //pts of the first video frame
+	volatile int refcnt;
+} SharedFrame;
+
+#define SHARED_FRAMES_NUM ENCODE_QUEUE_LEN
+SharedFrame shared_frames[SHARED_FRAMES_NUM];
+BoundedQueue shared_frame_pool;
+
+int initSharedFramePool() {
+	int i;
+
+	if(boundedQueueInit(&shared_frame_pool, SHARED_FRAMES_NUM) < 0)
+		return -1;
+	for(i = 0; i < SHARED_FRAMES_NUM; i++) {
+		if(!shared_frames[i].frame)
+			shared_frames[i].frame = avcodec_alloc_frame();
+		if(!shared_frames[i].frame)
+			return -1;
+		boundedQueuePush(&shared_frame_pool, &shared_frames[i]);
+	}
+	return 0;
+}
+
+void freeSharedFramePool() {
+	int i, j;
+
+	boundedQueueDestroy(&shared_frame_pool);
+	for(i = 0; i < SHARED_FRAMES_NUM; i++) {
+		av_free(shared_frames[i].frame);
+		av_free(shared_frames[i].buffer);
+		for(j = 0; j < 1+QUALITYLEVELS_MAX+1; j++) {
+			av_free(shared_frames[i].level[j]);
+			av_free(shared_frames[i].level_buffer[j]);
+		}
+		memset(&shared_frames[i], 0, sizeof(SharedFrame));
+	}
+	for(j = 0; j < 1+QUALITYLEVELS_MAX+1; j++) {
+		if(outstream[j].ladder_ctx) {
+			sws_freeContext(outstream[j].ladder_ctx);
+			outstream[j].ladder_ctx = NULL;
+		}
+	}
+}
+
+int parseLadderFilters(const char *list) {
+	char *names = strdup(list);
+	char *name, *save = NULL;
+	int flags;
+
+	for(name = strtok_r(names, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		if(strcmp(name, "bicubic") == 0) flags = SWS_BICUBIC;
+		else if(strcmp(name, "bilinear") == 0) flags = SWS_BILINEAR;
+		else if(strcmp(name, "fast_bilinear") == 0) flags = SWS_FAST_BILINEAR;
+		else if(strcmp(name, "area") == 0) flags = SWS_AREA;
+		else if(strcmp(name, "point") == 0) flags = SWS_POINT;
+		else {
+			fprintf(stderr, "Unknown scaling filter: %s\n", name);
+			free(names);
+			return -1;
+		}
+		if(ladder_filters_num < 1+QUALITYLEVELS_MAX+1)
+			ladder_filters[ladder_filters_num++] = flags;
+	}
+	free(names);
+	return ladder_filters_num > 0 ? 0 : -1;
+}
+
+/*
+ * scaling ladder: scale the decoded picture for outstreams first..last-1,
+ * each from the picture of the previous one
+ */
+int scaleLadder(SharedFrame *sf, AVFrame *pFrame, int width, int height, int first, int last) {
+	AVFrame *prev = pFrame;
+	int prev_width = width, prev_height = height;
+	struct timeval start;
+	int i, step;
+
+	for (i = first, step = 0; i < last; i++, step++) {
+		struct outstream *os = &outstream[i];
+		int w = os->pCodecCtxEnc->width;
+		int h = os->pCodecCtxEnc->height;
+
+		if(!sf->level[i]) {
+			sf->level[i] = avcodec_alloc_frame();
+			sf->level_buffer[i] = av_malloc(avpicture_get_size(PIX_FMT_YUV420P, w, h));
+			if(!sf->level[i] || !sf->level_buffer[i]) {
+				fprintf(stderr, "VIDEO: Memory error alloc ladder frame!!!\n");
+				return -1;
+			}
+			avpicture_fill((AVPicture*) sf->level[i], sf->level_buffer[i], PIX_FMT_YUV420P, w, h);
+		}
+
+		gettimeofday(&start, NULL);
+		if(w == prev_width && h == prev_height) {
+			av_picture_copy((AVPicture*) sf->level[i], (const AVPicture*) prev, PIX_FMT_YUV420P, w, h);
+		} else {
+			os->ladder_ctx = sws_getCachedContext(os->ladder_ctx, prev_width, prev_height, PIX_FMT_YUV420P, w, h, PIX_FMT_YUV420P,
+			                                      ladder_filters[STREAMER_MIN(step, ladder_filters_num - 1)], NULL, NULL, NULL);
+			if(os->ladder_ctx == NULL) {
+				fprintf(stderr, "Cannot initialize the conversion context!\n");
+				exit(1);
+			}
+			sws_scale(os->ladder_ctx, prev->data, prev->linesize, 0, prev_height, sf->level[i]->data, sf->level[i]->linesize);
+			stageStatsAdd(&os->scale_stats, &start);
+		}
+		sf->level[i]->pts = pFrame->pts;
+
+		//never scale a level from a smaller picture (e.g. the index channel after a short ladder)
+		if(w <= prev_width && h <= prev_height) {
+			prev = sf->level[i];
+			prev_width = w;
+			prev_height = h;
+		}
+	}
+	return 0;
+}
+
+void releaseSharedFrame(SharedFrame *sf) {
+	if(__sync_sub_and_fetch(&sf->refcnt, 1) == 0)
+		boundedQueuePush(&shared_frame_pool, sf);
+}
+
+/*
+ * pool of encoder threads. An outstream is encoded by one worker at a time,
+ * in queue order, so its chunks leave in order; any idle worker takes the
+ * next outstream with pending pictures, so cheap encodes do not wait for
+ * the expensive ones
+ */
+struct {
+	pthread_t *workers;
+	int workers_num;
+	int first, last; //outstreams served
+	int next; //where the next scan starts
+	int stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+} encode_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER };
+
+void queueEncodeJob(struct outstream *os, SharedFrame *sf) {
+	boundedQueuePush(&os->queue, sf);
+	pthread_mutex_lock(&encode_pool.lock);
+	os->pending++;
+	pthread_cond_signal(&encode_pool.work);
+	pthread_mutex_unlock(&encode_pool.lock);
+}
+
+/*
+ * copy a decoded picture into a shared frame and queue it to the encode
+ * pool for outstreams first..last-1. Waits while all shared frames are in use
+ */
+int dispatchFrame(AVFrame *pFrame, int width, int height, AVRational time_base, int64_t pts_base, int first, int last) {
+	SharedFrame *sf;
+	int i;
+
+	if(first >= last)
+		return 0;
+	sf = boundedQueuePop(&shared_frame_pool);
+	if(!sf)
+		return -1;
+
+	if(scaling_ladder) {
+		if(scaleLadder(sf, pFrame, width, height, first, last) < 0) {
+			boundedQueuePush(&shared_frame_pool, sf);
+			return -1;
+		}
+	} else {
+		if(sf->width != width || sf->height != height || !sf->buffer) {
+			av_free(sf->buffer);
+			sf->buffer = av_malloc(avpicture_get_size(PIX_FMT_YUV420P, width, height));
+			if(!sf->buffer) {
+				fprintf(stderr, "VIDEO: Memory error alloc shared frame!!!\n");
+				sf->width = sf->height = 0;
+				boundedQueuePush(&shared_frame_pool, sf);
+				return -1;
+			}
+			sf->width = width;
+			sf->height = height;
+		}
+		avpicture_fill((AVPicture*) sf->frame, sf->buffer, PIX_FMT_YUV420P, width, height);
+		av_picture_copy((AVPicture*) sf->frame, (const AVPicture*) pFrame, PIX_FMT_YUV420P, width, height);
+		sf->frame->pts = pFrame->pts;
+	}
+	sf->time_base = time_base;
+	sf->pts_base = pts_base;
+
+	sf->refcnt = last - first;
+	for (i = first; i < last; i++) {
+		queueEncodeJob(&outstream[i], sf);
+	}
+	return 0;
 }
 
 /*
@@ -214,42 +788,70 @@ AVFrame *preprocessFrame(AVFrame *pFrame) {
 }
 
 
-int transcodeFrame(uint8_t *video_outbuf, int video_outbuf_size, int64_t *target_pts, AVFrame *pFrame, AVRational time_base, AVCodecContext *pCodecCtx, AVCodecContext *pCodecCtxEnc)
-{
-	int video_frame_size = 0;
-	AVFrame *scaledFrame = NULL;
-	scaledFrame=avcodec_alloc_frame();
-	if(scaledFrame==NULL) {
+/*
+ * the scaled picture of an outstream is allocated once, with the size of its encoder
+ */
+int allocScaledFrame(struct outstream *os) {
+	os->scaled_frame = avcodec_alloc_frame();
+	os->scaled_buffer = av_malloc(avpicture_get_size(PIX_FMT_YUV420P, os->pCodecCtxEnc->width, os->pCodecCtxEnc->height));
+	if(!os->scaled_frame || !os->scaled_buffer) {
 		fprintf(stderr, "INIT: Memory error alloc video frame!!!\n");
-		if(scaledFrame) av_free(scaledFrame);
 		return -1;
 	}
-	int scaledFrame_buf_size = avpicture_get_size( PIX_FMT_YUV420P, pCodecCtxEnc->width, pCodecCtxEnc->height);
-	uint8_t* scaledFrame_buffer = (uint8_t *) av_malloc( scaledFrame_buf_size * sizeof( uint8_t ) );
-	avpicture_fill( (AVPicture*) scaledFrame, scaledFrame_buffer, PIX_FMT_YUV420P, pCodecCtxEnc->width, pCodecCtxEnc->height);
-	if(!video_outbuf || !scaledFrame_buffer) {
+	avpicture_fill((AVPicture*) os->scaled_frame, os->scaled_buffer, PIX_FMT_YUV420P, os->pCodecCtxEnc->width, os->pCodecCtxEnc->height);
+	return 0;
+}
+
+void freeScaledFrame(struct outstream *os) {
+	av_free(os->scaled_frame);
+	os->scaled_frame = NULL;
+	av_free(os->scaled_buffer);
+	os->scaled_buffer = NULL;
+	if(os->img_convert_ctx) {
+		sws_freeContext(os->img_convert_ctx);
+		os->img_convert_ctx = NULL;
+	}
+}
+
+int transcodeFrame(uint8_t *video_outbuf, int video_outbuf_size, int64_t *target_pts, AVFrame *pFrame, AVRational time_base, int width, int height, struct outstream *os)
+{
+	int video_frame_size = 0;
+	AVCodecContext *pCodecCtxEnc = os->pCodecCtxEnc;
+	AVFrame *scaledFrame = os->scaled_frame;
+	struct timeval scale_start;
+	int pict_type = 0;
+
+	if(!video_outbuf || !scaledFrame) {
 		fprintf(stderr, "INIT: Memory error alloc video_outbuf!!!\n");
 		return -1;
 	}
 
 
 
-					    if(pCodecCtx->height != pCodecCtxEnc->height || pCodecCtx->width != pCodecCtxEnc->width) {
+					    //an I frame was requested, e.g. for a channel zap
+					    if(os->keyframe_requests != keyframe_requests) {
+						os->keyframe_requests = keyframe_requests;
+						pict_type = FF_I_TYPE;
+					    }
+
+					    if(height != pCodecCtxEnc->height || width != pCodecCtxEnc->width) {
 //						static AVPicture pict;
-						static struct SwsContext *img_convert_ctx = NULL;
 
-						pFrame->pict_type = 0;
-						img_convert_ctx = sws_getCachedContext(img_convert_ctx, pCodecCtx->width, pCodecCtx->height, PIX_FMT_YUV420P, pCodecCtxEnc->width, pCodecCtxEnc->height, PIX_FMT_YUV420P, SWS_BICUBIC, NULL, NULL, NULL);
-						if(img_convert_ctx == NULL) {
+						pFrame->pict_type = pict_type;
+						//rebuilt only if the input size changes
+						os->img_convert_ctx = sws_getCachedContext(os->img_convert_ctx, width, height, PIX_FMT_YUV420P, pCodecCtxEnc->width, pCodecCtxEnc->height, PIX_FMT_YUV420P, SWS_BICUBIC, NULL, NULL, NULL);
+						if(os->img_convert_ctx == NULL) {
 							fprintf(stderr, "Cannot initialize the conversion context!\n");
 							exit(1);
 						}
-						sws_scale(img_convert_ctx, pFrame->data, pFrame->linesize, 0, pCodecCtx->height, scaledFrame->data, scaledFrame->linesize);
+						gettimeofday(&scale_start, NULL);
+						sws_scale(os->img_convert_ctx, pFrame->data, pFrame->linesize, 0, height, scaledFrame->data, scaledFrame->linesize);
+						stageStatsAdd(&os->scale_stats, &scale_start);
 						scaledFrame->pts = pFrame->pts;
-						scaledFrame->pict_type = 0;
+						scaledFrame->pict_type = pict_type;
 						video_frame_size = avcodec_encode_video(pCodecCtxEnc, video_outbuf, video_outbuf_size, scaledFrame);
 					    } else {
-						pFrame->pict_type = 0;
+						pFrame->pict_type = pict_type;
 						video_frame_size = avcodec_encode_video(pCodecCtxEnc, video_outbuf, video_outbuf_size, pFrame);
 					    }
 
@@ -257,8 +859,6 @@ int transcodeFrame(uint8_t *video_outbuf, int video_outbuf_size, int64_t *target
 					    if(pCodecCtxEnc->coded_frame->pts!=AV_NOPTS_VALUE)
 						*target_pts = av_rescale_q(pCodecCtxEnc->coded_frame->pts, pCodecCtxEnc->time_base, time_base);
 					    else {	//TODO: review this
-						if(scaledFrame) av_free(scaledFrame);
-						if(scaledFrame_buffer) av_free(scaledFrame_buffer);
 						return -1;
 					    }
 
@@ -282,8 +882,6 @@ int transcodeFrame(uint8_t *video_outbuf, int video_outbuf_size, int64_t *target
 #endif
 					}
 
-	if(scaledFrame) av_free(scaledFrame);
-	if(scaledFrame_buffer) av_free(scaledFrame_buffer);
 	return video_frame_size;
 }
 
@@ -335,28 +933,39 @@ void createFrame(struct Frame *frame, long long newTime, int video_frame_size, i
 }
 
 
+void sendVideoChunk(struct outstream *os)
+{
+	ExternalChunk *chunk = os->chunk;
+
+	//calculate priority
+	chunk->priority /= chunk->frames_num;
+
+	//SAVE ON FILE
+	//saveChunkOnFile(chunk);
+	//Send the chunk to an external transport/player
+	dctprintf(DEBUG_CHUNKER, "VIDEO: sending chunk video %d, prio:%f, size %d\n", chunk->seq, chunk->priority, chunk->len);
+	chunkShapeAdd(&chunk_shape[VIDEO_CHUNK], chunk);
+	queueChunk(os->out, os - outstream, os - outstream + 1);
+	os->out = getFreeChunk(&os->chunks);
+	os->chunk = os->out->chunk;
+	//initChunk(chunk, &seq_current_chunk);
+}
+
 void addFrameToOutstream(struct outstream *os, Frame *frame, uint8_t *video_outbuf)
 {
 
-	ExternalChunk *chunk = os->chunk;
-	struct output *output = os->output;
+	//with GOP aligned chunks an I frame always starts a new chunk
+	if(cmeta->gopAligned && frame->type == FF_I_TYPE && os->chunk->frames_num > 0) {
+		sendVideoChunk(os);
+	}
 
-					if(update_chunk(chunk, frame, video_outbuf) == -1) {
-						fprintf(stderr, "VIDEO: unable to update chunk %d. Exiting.\n", chunk->seq);
+					if(update_chunk(os->chunk, frame, video_outbuf) == -1) {
+						fprintf(stderr, "VIDEO: unable to update chunk %d. Exiting.\n", os->chunk->seq);
 						exit(-1);
 					}
 
-					if(chunkFilled(chunk, VIDEO_CHUNK)) { // is chunk filled using current strategy?
-						//calculate priority
-						chunk->priority /= chunk->frames_num;
-
-						//SAVE ON FILE
-						//saveChunkOnFile(chunk);
-						//Send the chunk to an external transport/player
-						sendChunk(output, chunk);
-						dctprintf(DEBUG_CHUNKER, "VIDEO: sent chunk video %d, prio:%f, size %d\n", chunk->seq, chunk->priority, chunk->len);
-						chunk->seq = 0; //signal that we need an increase
-						//initChunk(chunk, &seq_current_chunk);
+					if(chunkFilled(os->chunk, VIDEO_CHUNK)) { // is chunk filled using current strategy?
+						sendVideoChunk(os);
 					}
 }
 
@@ -365,6 +974,143 @@ long long pts2ms(int64_t pts, AVRational time_base)
 	return pts * 1000 * time_base.num / time_base.den;
 }
 
+/* encode one shared picture for an outstream, and queue the chunk if it fills up */
+void encodeSharedFrame(struct outstream *os, SharedFrame *sf)
+{
+	int64_t target_pts = 0;
+	int video_frame_size;
+	struct timeval start;
+
+	gettimeofday(&start, NULL);
+	//encoders may write to the input frame, do not touch the shared one
+	if(scaling_ladder) {
+		*os->picture = *sf->level[os - outstream];
+		video_frame_size = transcodeFrame(os->video_outbuf, STREAMER_MAX_VIDEO_BUFFER_SIZE, &target_pts, os->picture, sf->time_base, os->pCodecCtxEnc->width, os->pCodecCtxEnc->height, os);
+	} else {
+		*os->picture = *sf->frame;
+		video_frame_size = transcodeFrame(os->video_outbuf, STREAMER_MAX_VIDEO_BUFFER_SIZE, &target_pts, os->picture, sf->time_base, sf->width, sf->height, os);
+	}
+	if (video_frame_size > 0) {
+		//frames held back by the encoder are not numbered
+		os->frame.number = ++os->frame_count;
+		createFrame(&os->frame, pts2ms(target_pts - sf->pts_base, sf->time_base), video_frame_size,
+		            (unsigned char)os->pCodecCtxEnc->coded_frame->pict_type);
+		addFrameToOutstream(os, &os->frame, os->video_outbuf);
+	}
+	releaseSharedFrame(sf);
+	stageStatsAdd(&os->encode_stats, &start);
+}
+
+void *encodeWorker(void *arg)
+{
+	struct outstream *os;
+	int i, n = encode_pool.last - encode_pool.first;
+
+	pthread_mutex_lock(&encode_pool.lock);
+	for(;;) {
+		//look for an outstream with work that nobody is encoding
+		os = NULL;
+		for (i = 0; i < n && !os; i++) {
+			struct outstream *candidate = &outstream[encode_pool.first + (encode_pool.next + i) % n];
+			if (candidate->pending > 0 && !candidate->busy)
+				os = candidate;
+		}
+		if (!os) {
+			int pending = 0;
+			for (i = encode_pool.first; i < encode_pool.last; i++)
+				pending += outstream[i].pending;
+			if (encode_pool.stopping && pending == 0)
+				break;
+			pthread_cond_wait(&encode_pool.work, &encode_pool.lock);
+			continue;
+		}
+		os->busy = 1;
+		os->pending--;
+		encode_pool.next = (os - outstream - encode_pool.first + 1) % n;
+		pthread_mutex_unlock(&encode_pool.lock);
+
+		encodeSharedFrame(os, boundedQueuePop(&os->queue));
+
+		pthread_mutex_lock(&encode_pool.lock);
+		os->busy = 0;
+		//more pictures of this outstream may be waiting for a worker
+		if (os->pending > 0 || encode_pool.stopping)
+			pthread_cond_broadcast(&encode_pool.work);
+	}
+	pthread_mutex_unlock(&encode_pool.lock);
+	return NULL;
+}
+
+int initEncoder(struct outstream *os) {
+	if(boundedQueueInit(&os->queue, ENCODE_QUEUE_LEN) < 0)
+		return -1;
+	os->pending = 0;
+	os->busy = 0;
+	os->picture = avcodec_alloc_frame();
+	os->video_outbuf = av_malloc(STREAMER_MAX_VIDEO_BUFFER_SIZE);
+	if(!os->picture || !os->video_outbuf || allocScaledFrame(os) < 0) {
+		fprintf(stderr, "INIT: Memory error alloc encoder buffers!!!\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* start the encode pool for outstreams first..last-1 */
+int startEncodePool(int first, int last) {
+	int i;
+
+	encode_pool.first = first;
+	encode_pool.last = last;
+	encode_pool.next = 0;
+	encode_pool.stopping = 0;
+	encode_pool.workers_num = encode_threads > 0 ? encode_threads : last - first;
+	if (encode_pool.workers_num <= 0)
+		return 0;
+	encode_pool.workers = calloc(encode_pool.workers_num, sizeof(pthread_t));
+	if (!encode_pool.workers)
+		return -1;
+	for (i = 0; i < encode_pool.workers_num; i++) {
+		if(pthread_create(&encode_pool.workers[i], NULL, encodeWorker, NULL) != 0) {
+			fprintf(stderr, "INIT: cannot start encoder thread\n");
+			encode_pool.workers_num = i;
+			return -1;
+		}
+	}
+	fprintf(stderr, "INIT: %d encoder threads for %d outstreams\n", encode_pool.workers_num, last - first);
+	return 0;
+}
+
+/* let the workers encode what is queued, then stop them */
+void stopEncodePool() {
+	int i;
+
+	pthread_mutex_lock(&encode_pool.lock);
+	encode_pool.stopping = 1;
+	pthread_cond_broadcast(&encode_pool.work);
+	pthread_mutex_unlock(&encode_pool.lock);
+	for (i = 0; i < encode_pool.workers_num; i++) {
+		pthread_join(encode_pool.workers[i], NULL);
+	}
+	free(encode_pool.workers);
+	encode_pool.workers = NULL;
+	encode_pool.workers_num = 0;
+}
+
+/* free the encoder buffers once the encode pool has been stopped */
+void freeEncoder(struct outstream *os, const char *name) {
+	char scale_name[64];
+
+	stageStatsPrint(name, &os->encode_stats, &os->queue);
+	sprintf(scale_name, "%s scaling", name);
+	stageStatsPrint(scale_name, &os->scale_stats, NULL);
+	boundedQueueDestroy(&os->queue);
+	av_free(os->picture);
+	os->picture = NULL;
+	av_free(os->video_outbuf);
+	os->video_outbuf = NULL;
+	freeScaledFrame(os);
+}
+
 AVCodecContext *openVideoEncoder(const char *video_codec, int video_bitrate, int dest_width, int dest_height, AVRational time_base, const char *codec_options) {
 
 	AVCodec *pCodecEnc;
@@ -513,6 +1259,7 @@ AVCodecContext *openVideoEncoder(const char *video_codec, int video_bitrate, int
 
 int main(int argc, char *argv[]) {
 	signal(SIGINT, sigproc);
+	signal(SIGUSR1, sigForceKeyframe);
 	
 	int i=0,j,k;
 
@@ -565,6 +1312,12 @@ int main(int argc, char *argv[]) {
 	//Napa-Wine specific Frame and Chunk structures for transport
 	Frame *frame = NULL;
 	ExternalChunk *chunkaudio = NULL;
+	OutgoingChunk *audio_out = NULL;
+	ChunkPool audio_chunks;
+	AVPacket *demuxed;
+	struct timeval decode_start = {0, 0};
+	char stage_name[32];
+	long long scale_us;
 	
 	char av_input[1024];
 	int dest_width = -1;
@@ -577,6 +1330,12 @@ int main(int argc, char *argv[]) {
 		{"avfilter", required_argument, 0, 0},
 		{"indexchannel", required_argument, 0, 0},
 		{"passthrough", required_argument, 0, 0},
+		{"scaling_ladder", required_argument, 0, 0},
+		{"encode_threads", required_argument, 0, 0},
+		{"udp_batch", required_argument, 0, 0},
+		{"udp_gso", required_argument, 0, 0},
+		{"fec", required_argument, 0, 0},
+		{"loop", required_argument, 0, 0},
 		{"qualitylevels", required_argument, 0, 'Q'},
 		{0, 0, 0, 0}
 	};
@@ -592,6 +1351,18 @@ int main(int argc, char *argv[]) {
 				if( strcmp( "avfilter", long_options[option_index].name ) == 0 ) { avfilter = strdup(optarg); }
 				if( strcmp( "indexchannel", long_options[option_index].name ) == 0 ) { indexchannel = atoi(optarg); }
 				if( strcmp( "passthrough", long_options[option_index].name ) == 0 ) { passthrough = atoi(optarg); }
+				if( strcmp( "encode_threads", long_options[option_index].name ) == 0 ) { encode_threads = atoi(optarg); }
+				if( strcmp( "udp_batch", long_options[option_index].name ) == 0 ) { udp_batch = atoi(optarg); }
+				if( strcmp( "udp_gso", long_options[option_index].name ) == 0 ) { udp_gso = atoi(optarg); }
+				if( strcmp( "fec", long_options[option_index].name ) == 0 ) { fec_window = atoi(optarg); }
+				if( strcmp( "loop", long_options[option_index].name ) == 0 ) { loop_mode = atoi(optarg); }
+				if( strcmp( "scaling_ladder", long_options[option_index].name ) == 0 ) {
+					if (parseLadderFilters(optarg) < 0) {
+						print_usage(argc, argv);
+						return -1;
+					}
+					scaling_ladder = 1;
+				}
 				break;
 			case 'i':
 				sprintf(av_input, "%s", optarg);
@@ -691,6 +1462,19 @@ int main(int argc, char *argv[]) {
 	}
 #endif
 
+	//the output stage and the chunks survive restarts
+	for (i=0; i < (passthrough?1:0) + qualitylevels + (indexchannel?1:0); i++) {
+		if (startSenderThread(&outstream[i]) < 0) {
+			exit(1);
+		}
+	}
+	if(initChunkPool(&audio_chunks) < 0) {
+		fprintf(stderr, "INIT: Memory error alloc chunkaudio!!!\n");
+		return -1;
+	}
+	audio_out = getFreeChunk(&audio_chunks);
+	chunkaudio = audio_out->chunk;
+
 restart:
 	// read the configuration file
 	cmeta = chunkerInit();
@@ -702,6 +1486,9 @@ restart:
 		case 1:
 			chunkFilled = chunkFilledSizeStrategy;
 			break;
+		case 2:
+			chunkFilled = chunkFilledLatencyStrategy;
+			break;
 		default:
 			chunkFilled = chunkFilledFramesStrategy;
 	}
@@ -770,12 +1557,7 @@ restart:
 
 	//initialize outstream structures
 	for (i=0; i < (passthrough?1:0) + qualitylevels + (indexchannel?1:0); i++) {
-		outstream[i].chunk = (ExternalChunk *)malloc(sizeof(ExternalChunk));
-		if(!outstream[i].chunk) {
-			fprintf(stderr, "INIT: Memory error alloc chunk!!!\n");
-			return -1;
-		}
-		outstream[i].chunk->data = NULL;
+		//chunk structures and their payload buffers survive restarts
 		outstream[i].chunk->seq = 0;
 		dcprintf(DEBUG_CHUNKER, "INIT: chunk video %d\n", outstream[i].chunk->seq);
 		outstream[i].pCodecCtxEnc = NULL;
@@ -796,6 +1578,20 @@ restart:
 		}
 	}
 
+	//transcoded outstreams are encoded by a shared pool of threads
+	if (initSharedFramePool() < 0) {
+		fprintf(stderr, "INIT: Memory error alloc shared frames!!!\n");
+		return -1;
+	}
+	for (i=(passthrough?1:0); i < (passthrough?1:0) + qualitylevels + (indexchannel?1:0); i++) {
+		if (initEncoder(&outstream[i]) < 0) {
+			return -1;
+		}
+	}
+	if (startEncodePool(passthrough?1:0, (passthrough?1:0) + qualitylevels + (indexchannel?1:0)) < 0) {
+		return -1;
+	}
+
 	//fprintf(stderr, "INIT: VIDEO timebase OUT:%d %d IN: %d %d\n", outstream[1].pCodecCtxEnc->time_base.num, outstream[1].pCodecCtxEnc->time_base.den, pCodecCtx->time_base.num, pCodecCtx->time_base.den);
 
 	if(pCodec==NULL) {
@@ -869,14 +1665,7 @@ restart:
 		return -1;
 	}
 
-	//create empty first audio chunk
-
-	chunkaudio = (ExternalChunk *)malloc(sizeof(ExternalChunk));
-	if(!chunkaudio) {
-		fprintf(stderr, "INIT: Memory error alloc chunkaudio!!!\n");
-		return -1;
-	}
-  chunkaudio->data=NULL;
+	//empty first audio chunk
 	chunkaudio->seq = 0;
 	//initChunk(chunkaudio, &seq_current_chunk);
 	dcprintf(DEBUG_CHUNKER, "INIT: chunk audio %d\n", chunkaudio->seq);
@@ -919,9 +1708,20 @@ restart:
 	init_filters(avfilter, pCodecCtx);
 #endif
 
-	//main loop to read from the input file
-	while((av_read_frame(pFormatCtx, &packet)>=0) && !quit)
+	if (startDemuxThread(pFormatCtx) < 0) {
+		return -1;
+	}
+
+	//main loop: decode what the demux stage has read from the input file
+	while(!quit && (demuxed = boundedQueuePop(&demux_queue)) != NULL)
 	{
+		packet = *demuxed;
+		av_free(demuxed);
+		if (decode_stats.items || decode_start.tv_sec) {
+			stageStatsAdd(&decode_stats, &decode_start);
+		}
+		gettimeofday(&decode_start, NULL);
+
 		//detect if a strange number of anomalies is occurring
 		if(ptsvideo1 < 0 || ptsvideo1 > packet.dts || ptsaudio1 < 0 || ptsaudio1 > packet.dts) {
 			pts_anomalies_counter++;
@@ -1083,16 +1883,10 @@ restart:
 						pFrame = pFrame2;
 					}
 
-					for (i=(passthrough?1:0); i < (passthrough?1:0) + qualitylevels + (indexchannel?1:0); i++) {
-						video_frame_size = transcodeFrame(video_outbuf, video_outbuf_size, &target_pts, pFrame, pFormatCtx->streams[videoStream]->time_base, pCodecCtx, outstream[i].pCodecCtxEnc);
-						if (video_frame_size <= 0) {
-							av_free_packet(&packet);
-							contFrameVideo = STREAMER_MAX(contFrameVideo-1, 0);
-							continue;	//TODO: this seems wrong, continuing the internal cycle
-						}
-						createFrame(frame, pts2ms(target_pts - ptsvideo1, pFormatCtx->streams[videoStream]->time_base), video_frame_size,
-					            (unsigned char)outstream[i].pCodecCtxEnc->coded_frame->pict_type);
-						addFrameToOutstream(&outstream[i], frame, video_outbuf);
+					//hand the picture to the encoder threads of the transcoded outstreams
+					if (dispatchFrame(pFrame, pCodecCtx->width, pCodecCtx->height, pFormatCtx->streams[videoStream]->time_base, ptsvideo1,
+					                  (passthrough?1:0), (passthrough?1:0) + qualitylevels + (indexchannel?1:0)) < 0) {
+						fprintf(stderr, "VIDEO: unable to queue frame %d for encoding\n", frame->number);
 					}
 
 
@@ -1254,11 +2048,11 @@ restart:
 					//SAVE ON FILE
 					//saveChunkOnFile(chunkaudio);
 					//Send the chunk to an external transport/player
-					for (i=0; i < (passthrough?1:0) + qualitylevels; i++) {	//do not send audio to the index channel
-						sendChunk(outstream[i].output, chunkaudio);
-					}
-					dctprintf(DEBUG_CHUNKER, "AUDIO: just sent chunk audio %d\n", chunkaudio->seq);
-					chunkaudio->seq = 0; //signal that we need an increase
+					dctprintf(DEBUG_CHUNKER, "AUDIO: sending chunk audio %d\n", chunkaudio->seq);
+					chunkShapeAdd(&chunk_shape[AUDIO_CHUNK], chunkaudio);
+					queueChunk(audio_out, 0, (passthrough?1:0) + qualitylevels);	//do not send audio to the index channel
+					audio_out = getFreeChunk(&audio_chunks);
+					chunkaudio = audio_out->chunk;
 					//initChunk(chunkaudio, &seq_current_chunk);
 				}
 
@@ -1307,30 +2101,48 @@ restart:
 		fclose(psnrtrace);
 
 close:
+	stopDemuxThread();
+	memset(&decode_start, 0, sizeof(decode_start));
+
+	//drain the encoder threads before sending the last chunks
+	scale_us = 0;
+	stopEncodePool();
+	for (i=(passthrough?1:0); i < (passthrough?1:0) + qualitylevels + (indexchannel?1:0); i++) {
+		scale_us += outstream[i].scale_stats.busy_us;
+		sprintf(stage_name, "encode %d", i);
+		freeEncoder(&outstream[i], stage_name);
+	}
+	fprintf(stderr, "SCALE: %d levels scaled %s in %lld us\n", qualitylevels + (indexchannel?1:0),
+		scaling_ladder ? "as a ladder" : "from the decoded picture", scale_us);
+	freeSharedFramePool();
+
 	for (i=0; i < (passthrough?1:0) + qualitylevels + (indexchannel?1:0); i++) {
 		if(outstream[i].chunk->seq != 0 && outstream[i].chunk->frames_num>0) {
-			sendChunk(outstream[i].output, outstream[0].chunk);
 			dcprintf(DEBUG_CHUNKER, "CHUNKER: SENDING LAST VIDEO CHUNK\n");
-			outstream[i].chunk->seq = 0; //signal that we need an increase just in case we will restart
+			chunkShapeAdd(&chunk_shape[VIDEO_CHUNK], outstream[i].chunk);
+			queueChunk(outstream[i].out, i, i + 1);
+			outstream[i].out = getFreeChunk(&outstream[i].chunks);
+			outstream[i].chunk = outstream[i].out->chunk;
 		}
+		outstream[i].chunk->seq = 0; //signal that we need an increase just in case we will restart
 	}
-	for (i=0; i < (passthrough?1:0) + qualitylevels; i++) {
-		if(chunkaudio->seq != 0 && chunkaudio->frames_num>0) {
-			sendChunk(outstream[i].output, chunkaudio);
-			dcprintf(DEBUG_CHUNKER, "CHUNKER: SENDING LAST AUDIO CHUNK\n");
-		}
+	if(chunkaudio->seq != 0 && chunkaudio->frames_num>0) {
+		dcprintf(DEBUG_CHUNKER, "CHUNKER: SENDING LAST AUDIO CHUNK\n");
+		chunkShapeAdd(&chunk_shape[AUDIO_CHUNK], chunkaudio);
+		queueChunk(audio_out, 0, (passthrough?1:0) + qualitylevels);
+		audio_out = getFreeChunk(&audio_chunks);
+		chunkaudio = audio_out->chunk;
 	}
 	chunkaudio->seq = 0; //signal that we need an increase just in case we will restart
+	chunkShapePrint("AUDIO", &chunk_shape[AUDIO_CHUNK]);
+	chunkShapePrint("VIDEO", &chunk_shape[VIDEO_CHUNK]);
 
 #ifdef HTTPIO
 	/* finalize the HTTP chunk pusher */
 	finalizeChunkPusher();
 #endif
 
-	for (i=0; i < (passthrough?1:0) + qualitylevels + (indexchannel?1:0); i++) {
-		free(outstream[i].chunk);
-	}
-	free(chunkaudio);
+	fprintf(stderr, "CHUNKER: chunk payload buffers grew %d times\n", chunk_payload_reallocs);
 	free(frame);
 	av_free(video_outbuf);
 	av_free(audio_outbuf);
@@ -1360,7 +2172,7 @@ close:
 		pFormatCtx = NULL;
 	}
 
-	if(LOOP_MODE) {
+	if(loop_mode) {
 		//we want video to continue, but the av_read_frame stopped
 		//lets wait a 5 secs, and cycle in again
 		usleep(5000000);
@@ -1402,11 +2214,20 @@ close:
 		goto restart;
 	}
 
+	//let the output stage send what is left
+	for (i=0; i < (passthrough?1:0) + qualitylevels + (indexchannel?1:0); i++) {
+		sprintf(stage_name, "output %d", i);
+		stopSenderThread(&outstream[i], stage_name);
+	}
+	freeChunkPool(&audio_chunks);
 #ifdef TCPIO
 	for (i=0; i < (passthrough?1:0) + qualitylevels + (indexchannel?1:0); i++) {
 		finalizeTCPChunkPusher(outstream[i].output);
 	}
 #endif
+#ifdef UDPIO
+	finalizeUDPChunkPusher();
+#endif
 
 
 	return 0;
@@ -1425,12 +2246,13 @@ int update_chunk(ExternalChunk *chunk, Frame *frame, uint8_t *outbuf) {
 	//add frame priority to chunk priority (to be normalized later on)
 	chunk->priority += frame->type + 1; // I:2, P:3, B:4
 
-	//HINT on malloc
-	chunk->data = (uint8_t *)realloc(chunk->data, sizeof(uint8_t)*(chunk->payload_len + frame->size + sizeFrameHeader));
-	if(!chunk->data)  {
+	if(reserveChunkPayload(chunk, chunk->payload_len + frame->size + sizeFrameHeader) < 0)  {
 		fprintf(stderr, "Memory error in chunk!!!\n");
 		return -1;
 	}
+	//mark the chunks a player can start decoding from
+	if(chunk->frames_num == 0 && frame->type == FF_I_TYPE)
+		chunk->category = CHUNK_CATEGORY_KEYFRAME;
 	chunk->frames_num++; // number of frames in the current chunk
 
 /*
@@ -13,6 +13,10 @@
 
 #define STREAMER_MAX_VIDEO_BUFFER_SIZE 200000
 #define STREAMER_MAX_AUDIO_BUFFER_SIZE 10000
+#define ENCODE_QUEUE_LEN 8 //decoded pictures in flight towards the encoder threads
+#define CHUNK_POOL_LEN 8 //chunks per producer, filling or in flight towards the outputs
+#define DEMUX_QUEUE_LEN 64 //packets read ahead of the decoder
+#define UDP_BATCH_DEFAULT 32 //fragments per sendmmsg of the UDP output
 
 #ifndef __WIN32__
 #define DELETE_DIR(folder) {char command_name[255]; sprintf(command_name, "rm -fR %s", folder); system(command_name); }
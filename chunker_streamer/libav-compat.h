@@ -1,6 +1,9 @@
 #ifndef MAX_STREAMS
 #define MAX_STREAMS 20
 #endif
+#ifndef FF_I_TYPE
+#define FF_I_TYPE AV_PICTURE_TYPE_I
+#endif
 #ifndef CODEC_TYPE_VIDEO
 #define CODEC_TYPE_VIDEO AVMEDIA_TYPE_VIDEO
 #define CODEC_TYPE_AUDIO AVMEDIA_TYPE_AUDIO
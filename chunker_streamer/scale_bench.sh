@@ -0,0 +1,26 @@
+#!/bin/bash
+# time spent scaling 1 to 4 quality levels, from the decoded picture and as a ladder
+# usage: ./scale_bench.sh input_file [ladder_filters] [output_url]
+# the default output needs a streamer built with IO=udp, nobody has to listen on it
+
+INPUT=$1
+FILTERS=${2:-bilinear}
+OUTPUT=${3:-udp://127.0.0.1:6099}
+
+[ -n "$INPUT" ] || { echo "usage: $0 input_file [ladder_filters] [output_url]"; exit 1; }
+INPUT=`readlink -f "$INPUT"`
+cd `dirname $0`
+[ -x ./chunker_streamer ] || { echo "build chunker_streamer first (make IO=udp)"; exit 1; }
+
+#total of the SCALE line the streamer prints on close
+#-l reads the file as fast as it is encoded, --loop 0 exits at its end
+scale_us() {
+	./chunker_streamer -i "$INPUT" -a 64000 -v 800000 -F $OUTPUT -l --loop 0 "$@" 2>&1 >/dev/null | sed -n 's/^SCALE: .* in \([0-9]*\) us$/\1/p'
+}
+
+printf "%-8s %-20s %-20s\n" "levels" "decoded (us)" "ladder $FILTERS (us)"
+for q in 1 2 3 4; do
+	direct=`scale_us --qualitylevels $q`
+	ladder=`scale_us --qualitylevels $q --scaling_ladder $FILTERS`
+	printf "%-8s %-20s %-20s\n" $q "$direct" "$ladder"
+done